@@ -0,0 +1,156 @@
+#include "clox.h"
+#include <time.h>
+
+/*
+ * Lox benchmarks with the scripts compiled in, so the binary needs nothing
+ * but a libc: it runs natively and as a guest of the RISC-V emulator
+ * (`make bench_rv`, proxy-kernel mode). Each script prints one result that
+ * is checked, then the table shows guest retired instructions (rdinstret,
+ * RISC-V only), wall time, and the resulting MIPS. Under the emulator the
+ * time is host time, so MIPS is the emulator's speed on that workload.
+ *
+ *   clox_bench [name...]   run only the named benchmarks
+ */
+
+typedef struct {
+  const char *name;
+  const char *source;
+  const char *expected;
+} Bench;
+
+static const Bench benches[] = {
+    {"fib",
+     "fun fib(n) { if (n < 2) return n; return fib(n - 2) + fib(n - 1); }"
+     "print fib(22);",
+     "17711\n"},
+    {"loop",
+     "var sum = 0;"
+     "for (var i = 0; i < 100000; i = i + 1) {"
+     "  if (i < 50000) sum = sum + 1; else sum = sum + 2;"
+     "}"
+     "print sum;",
+     "150000\n"},
+    {"strings",
+     "var a = \"lox\"; var n = 0;"
+     "for (var i = 0; i < 20000; i = i + 1) {"
+     "  var b = \"l\" + \"o\" + \"x\";"
+     "  if (a == b) n = n + 1;"
+     "}"
+     "print n;",
+     "20000\n"},
+    {"trees",
+     "class Tree {"
+     "  init(depth) {"
+     "    this.left = nil; this.right = nil;"
+     "    if (depth > 0) {"
+     "      this.left = Tree(depth - 1); this.right = Tree(depth - 1);"
+     "    }"
+     "  }"
+     "  check() {"
+     "    if (this.left == nil) return 1;"
+     "    return 1 + this.left.check() + this.right.check();"
+     "  }"
+     "}"
+     "var total = 0;"
+     "for (var i = 0; i < 10; i = i + 1) total = total + Tree(10).check();"
+     "print total;",
+     "20470\n"},
+    {"closures",
+     "fun makeCounter() {"
+     "  var n = 0;"
+     "  fun inc() { n = n + 1; return n; }"
+     "  return inc;"
+     "}"
+     "var total = 0;"
+     "for (var i = 0; i < 2000; i = i + 1) {"
+     "  var c = makeCounter();"
+     "  for (var j = 0; j < 20; j = j + 1) c();"
+     "  total = total + c();"
+     "}"
+     "print total;",
+     "42000\n"},
+    {"invoke",
+     "class Base { value() { return 1; } }"
+     "class Derived < Base { value() { return super.value() + 1; } }"
+     "var d = Derived(); var total = 0;"
+     "for (var i = 0; i < 50000; i = i + 1) total = total + d.value();"
+     "print total;",
+     "100000\n"},
+};
+
+static uint64_t instret(void) {
+#if defined(__riscv) && __riscv_xlen == 64
+  uint64_t n;
+  __asm__ volatile("rdinstret %0" : "=r"(n));
+  return n;
+#else
+  return 0;
+#endif
+}
+
+static double now(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool selected(const char *name, int argc, char **argv) {
+  if (argc < 2)
+    return true;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], name) == 0)
+      return true;
+  }
+  return false;
+}
+
+static VM vm; // too big for a small guest stack
+
+int main(int argc, char **argv) {
+  int failCount = 0;
+  uint64_t totalInsns = 0;
+  double totalSecs = 0;
+
+  printf("%-10s %-6s %12s %10s %8s\n", "bench", "result", "instret", "ms",
+         "MIPS");
+  for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+    const Bench *bench = &benches[i];
+    if (!selected(bench->name, argc, argv))
+      continue;
+
+    vmInit(&vm);
+    vmClearPrintBuffer(&vm);
+    vmClearErrorBuffer(&vm);
+
+    uint64_t insns = instret();
+    double start = now();
+    InterpretResult result = interpret(&vm, bench->source);
+    double secs = now() - start;
+    insns = instret() - insns;
+
+    bool passed = result == INTERPRET_OK &&
+                  strcmp(vmGetPrintBuffer(&vm), bench->expected) == 0;
+    if (!passed)
+      failCount++;
+    totalInsns += insns;
+    totalSecs += secs;
+
+    if (insns)
+      printf("%-10s %-6s %12llu %10.2f %8.1f\n", bench->name,
+             passed ? "ok" : "WRONG", (unsigned long long)insns, secs * 1e3,
+             insns / secs / 1e6);
+    else
+      printf("%-10s %-6s %12s %10.2f %8s\n", bench->name,
+             passed ? "ok" : "WRONG", "-", secs * 1e3, "-");
+    vmFree(&vm);
+  }
+
+  if (totalInsns)
+    printf("%-10s %-6s %12llu %10.2f %8.1f\n", "total",
+           failCount ? "FAIL" : "ok", (unsigned long long)totalInsns,
+           totalSecs * 1e3, totalInsns / totalSecs / 1e6);
+  else
+    printf("%-10s %-6s %12s %10.2f %8s\n", "total", failCount ? "FAIL" : "ok",
+           "-", totalSecs * 1e3, "-");
+  return failCount > 0 ? 1 : 0;
+}
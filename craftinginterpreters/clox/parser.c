@@ -238,7 +238,9 @@ static void emitLoop(VM *vm, int loopStart) {
   emitByte(vm, offset & 0xff);
 }
 
+#ifndef NDEBUG
 #define DEBUG_PRINT_CODE
+#endif
 
 static void initCompiler(VM *vm, Compiler *compiler, FunctionType type) {
   compiler->enclosing = vm->compiler;
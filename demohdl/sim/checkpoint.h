@@ -0,0 +1,92 @@
+#pragma once
+// Checkpoints of a Verilated model plus testbench state, so many runs can
+// fork from one warmed-up state instead of re-simulating reset and
+// initialization. Needs a model built with --savable (`make sim` passes it
+// and defines SIM_SAVABLE).
+//
+// File layout (after Verilator's own header): magic, testbench time and
+// cycle, the caller's state (e.g. the golden model, so checking continues
+// seamlessly), then the model in Verilator's format, which refuses to load
+// into a different design.
+
+#include "testbench.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <type_traits>
+
+#if SIM_SAVABLE
+#include "verilated_save.h"
+
+static const char CHECKPOINT_MAGIC[8] = {'d', 'h', 'd', 'l', 'c', 'k', 'p', '1'};
+
+template <typename Model, typename State>
+bool checkpoint_save(const char *path, Model *dut, const Testbench<Model> &tb,
+                     const State &state) {
+  static_assert(std::is_trivially_copyable<State>::value,
+                "checkpoint state is saved as raw bytes");
+  VerilatedSave os;
+  os.open(path);
+  if (!os.isOpen()) {
+    perror(path);
+    return false;
+  }
+  os.write(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+  os.write(&tb.time, sizeof(tb.time));
+  os.write(&tb.cycle, sizeof(tb.cycle));
+  os.write(&state, sizeof(state));
+  os << *dut;
+  os.close();
+  printf("Checkpoint at cycle %llu saved to %s\n",
+         (unsigned long long)tb.cycle, path);
+  return true;
+}
+
+template <typename Model, typename State>
+bool checkpoint_restore(const char *path, Model *dut, Testbench<Model> *tb,
+                        State *state) {
+  static_assert(std::is_trivially_copyable<State>::value,
+                "checkpoint state is saved as raw bytes");
+  // VerilatedRestore treats a missing file as fatal; check first
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  fclose(f);
+
+  VerilatedRestore is;
+  is.open(path);
+  char magic[sizeof(CHECKPOINT_MAGIC)];
+  is.read(magic, sizeof(magic));
+  if (memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0) {
+    fprintf(stderr, "%s: not a testbench checkpoint\n", path);
+    is.close();
+    return false;
+  }
+  is.read(&tb->time, sizeof(tb->time));
+  is.read(&tb->cycle, sizeof(tb->cycle));
+  is.read(state, sizeof(*state));
+  is >> *dut;
+  is.close();
+  printf("Restored cycle %llu from %s\n", (unsigned long long)tb->cycle,
+         path);
+  return true;
+}
+
+#else
+
+template <typename Model, typename State>
+bool checkpoint_save(const char *, Model *, const Testbench<Model> &,
+                     const State &) {
+  fprintf(stderr, "built without --savable: no checkpoints\n");
+  return false;
+}
+
+template <typename Model, typename State>
+bool checkpoint_restore(const char *, Model *, Testbench<Model> *, State *) {
+  fprintf(stderr, "built without --savable: no checkpoints\n");
+  return false;
+}
+
+#endif
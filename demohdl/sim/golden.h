@@ -0,0 +1,103 @@
+#pragma once
+// Golden C++ models of the demohdl modules, parameterized like the Veryl
+// sources, for scoreboards that check the Verilated model every cycle.
+//
+// Values use the same C types Verilator picks for a WIDTH-bit signal
+// (CData/SData/IData/QData), so they compare directly against model
+// signals. clock() is one rising edge; everything is inline and
+// allocation-free so a check costs a few instructions per cycle.
+
+#include <stdint.h>
+#include <type_traits>
+
+template <unsigned WIDTH>
+using Bits = typename std::conditional<
+    WIDTH <= 8, uint8_t,
+    typename std::conditional<
+        WIDTH <= 16, uint16_t,
+        typename std::conditional<WIDTH <= 32, uint32_t,
+                                  uint64_t>::type>::type>::type;
+
+template <unsigned WIDTH> constexpr Bits<WIDTH> bits_mask() {
+  return WIDTH >= 64 ? (Bits<WIDTH>)~0ull
+                     : (Bits<WIDTH>)((1ull << (WIDTH % 64)) - 1);
+}
+
+// src/Counter.veryl: counts up by 2, cleared by reset
+template <unsigned WIDTH> class CounterModel {
+public:
+  typedef Bits<WIDTH> T;
+  static constexpr T STEP = 2;
+
+  void reset() { cnt = 0; }
+  void clock() { cnt = (T)(cnt + STEP) & bits_mask<WIDTH>(); }
+  T o_cnt() const { return cnt; }
+
+private:
+  T cnt = 0;
+};
+
+// src/DelayN.veryl: DEPTH-stage shift register, cleared by reset
+template <unsigned WIDTH, unsigned DEPTH> class DelayNModel {
+  static_assert(DEPTH >= 1, "DelayN needs at least one stage");
+
+public:
+  typedef Bits<WIDTH> T;
+
+  void reset() {
+    for (unsigned i = 0; i < DEPTH; i++)
+      pipe[i] = 0;
+  }
+  void clock(T in) {
+    for (unsigned i = DEPTH - 1; i > 0; i--)
+      pipe[i] = pipe[i - 1];
+    pipe[0] = in & bits_mask<WIDTH>();
+  }
+  T o_data() const { return pipe[DEPTH - 1]; }
+
+private:
+  T pipe[DEPTH] = {};
+};
+
+// src/Gates.veryl: combinational, one bit per output
+struct GatesModel {
+  uint8_t and_out, or_out, xor_out, not_a, nand_out, nor_out, xnor_out;
+
+  void eval(uint8_t a, uint8_t b) {
+    and_out = a & b;
+    or_out = a | b;
+    xor_out = a ^ b;
+    not_a = !a;
+    nand_out = !(a & b);
+    nor_out = !(a | b);
+    xnor_out = !(a ^ b);
+  }
+};
+
+// src/Top.veryl: the counter feeding a 1-cycle and a 3-cycle delay, with
+// the active-low reset (asynchronous in the RTL: while it is held, every
+// register reads 0)
+struct TopModel {
+  CounterModel<8> counter;
+  DelayNModel<8, 1> delay1;
+  DelayNModel<8, 3> delay3;
+  GatesModel gates;
+
+  void clock(bool rst_n) {
+    if (!rst_n) {
+      counter.reset();
+      delay1.reset();
+      delay3.reset();
+      return;
+    }
+    // All registers sample their inputs before the edge
+    uint8_t cnt = counter.o_cnt();
+    counter.clock();
+    delay1.clock(cnt);
+    delay3.clock(cnt);
+  }
+
+  uint8_t cnt() const { return counter.o_cnt(); }
+  uint8_t delayed_1() const { return delay1.o_data(); }
+  uint8_t delayed_3() const { return delay3.o_data(); }
+};
@@ -0,0 +1,160 @@
+// Randomized regression: many independent Top models, each in its own
+// VerilatedContext, spread over a pool of host threads. Every seed drives
+// its model with random gate inputs and random resets for `cycles` cycles
+// and checks each cycle against the golden model (golden.h).
+//
+//   regress --jobs 8 --seeds 256 --cycles 1000000
+//   regress --seed 1234 --seeds 1      # reproduce one failing seed
+
+#include "Vdemohdl_Top.h"
+#include "Vdemohdl_Top___024root.h"
+#include "golden.h"
+#include "testbench.h"
+#include "verilated.h"
+#include "waves.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef Waves<Vdemohdl_Top> TopWaves;
+typedef Testbench<Vdemohdl_Top> TopBench;
+
+// splitmix64: tiny, fast, and every seed gives an independent stream
+struct Rng {
+  uint64_t s;
+  explicit Rng(uint64_t seed) : s(seed) {}
+  uint64_t next() {
+    uint64_t z = (s += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+};
+
+struct Result {
+  uint64_t seed;
+  uint64_t cycles; // run before the first mismatch, or all of them
+  std::string error;
+};
+
+static Result run_seed(uint64_t seed, uint64_t cycles) {
+  Result r = {seed, cycles, ""};
+  VerilatedContext ctx;
+  Vdemohdl_Top dut(&ctx, "TOP");
+  TopWaves waves;
+  TopBench tb(&dut, &waves, &dut.i_clk, &dut.i_rst, 0);
+  Vdemohdl_Top___024root *root = dut.rootp;
+
+  Rng rng(seed);
+  TopModel model;
+  tb.reset(2);
+  uint64_t reset_left = 0;
+
+  char buf[160];
+  for (uint64_t c = 0; c < cycles; c++) {
+    uint64_t x = rng.next();
+    uint8_t a = x & 1, b = (x >> 1) & 1;
+    if (reset_left == 0 && ((x >> 2) & 1023) == 0)
+      reset_left = 1 + ((x >> 12) & 3); // about one reset per 1k cycles
+    bool rst_n = reset_left == 0;
+    if (reset_left)
+      reset_left--;
+
+    dut.gate_a = a;
+    dut.gate_b = b;
+    dut.i_rst = rst_n;
+    tb.tick();
+    model.clock(rst_n);
+    model.gates.eval(a, b);
+
+    const GatesModel &g = model.gates;
+    if (dut.gate_and != g.and_out || dut.gate_or != g.or_out ||
+        dut.gate_xor != g.xor_out || dut.gate_not != g.not_a ||
+        dut.gate_nand != g.nand_out || dut.gate_nor != g.nor_out ||
+        dut.gate_xnor != g.xnor_out) {
+      snprintf(buf, sizeof(buf), "gates(a=%d, b=%d) wrong", a, b);
+    } else if (root->demohdl_Top__DOT__cnt != model.cnt() ||
+               root->demohdl_Top__DOT__delayed_1 != model.delayed_1() ||
+               root->demohdl_Top__DOT__delayed_3 != model.delayed_3()) {
+      snprintf(buf, sizeof(buf),
+               "cnt/delay1/delay3 = %d/%d/%d, expected %d/%d/%d",
+               root->demohdl_Top__DOT__cnt, root->demohdl_Top__DOT__delayed_1,
+               root->demohdl_Top__DOT__delayed_3, model.cnt(),
+               model.delayed_1(), model.delayed_3());
+    } else {
+      continue;
+    }
+    r.cycles = c;
+    r.error = "cycle " + std::to_string(c) + ": " + buf;
+    break;
+  }
+  return r;
+}
+
+int main(int argc, char **argv) {
+  unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+  uint64_t first_seed = 1, seeds = 64, cycles = 100000;
+  for (int i = 1; i < argc; i++) {
+    const char *v = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (v && strcmp(argv[i], "--jobs") == 0)
+      jobs = std::max(1, atoi(v));
+    else if (v && strcmp(argv[i], "--seed") == 0)
+      first_seed = strtoull(v, nullptr, 0);
+    else if (v && strcmp(argv[i], "--seeds") == 0)
+      seeds = strtoull(v, nullptr, 0);
+    else if (v && strcmp(argv[i], "--cycles") == 0)
+      cycles = strtoull(v, nullptr, 0);
+    else {
+      fprintf(stderr,
+              "usage: %s [--jobs N] [--seed FIRST] [--seeds N] [--cycles N]\n",
+              argv[0]);
+      return 1;
+    }
+    i++;
+  }
+
+  jobs = (unsigned)std::min<uint64_t>(jobs, std::max<uint64_t>(seeds, 1));
+
+  std::atomic<uint64_t> next{0};
+  std::atomic<uint64_t> total_cycles{0};
+  std::mutex lock;
+  std::vector<Result> failures;
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> pool;
+  for (unsigned t = 0; t < jobs; t++) {
+    pool.emplace_back([&] {
+      for (uint64_t i; (i = next++) < seeds;) {
+        Result r = run_seed(first_seed + i, cycles);
+        total_cycles += r.cycles;
+        if (!r.error.empty()) {
+          std::lock_guard<std::mutex> guard(lock);
+          failures.push_back(r);
+        }
+      }
+    });
+  }
+  for (std::thread &t : pool)
+    t.join();
+  double secs = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+
+  std::sort(failures.begin(), failures.end(),
+            [](const Result &a, const Result &b) { return a.seed < b.seed; });
+  for (const Result &f : failures)
+    printf("FAIL seed %llu: %s\n", (unsigned long long)f.seed,
+           f.error.c_str());
+  printf("%llu seeds, %llu failed, %.3gM cycles in %.2f s on %u threads "
+         "(%.3gM cycles/s)\n",
+         (unsigned long long)seeds, (unsigned long long)failures.size(),
+         total_cycles / 1e6, secs, jobs, total_cycles / secs / 1e6);
+  return failures.empty() ? 0 : 1;
+}
@@ -1,83 +1,208 @@
 #include "Vdemohdl_Top.h"
 #include "Vdemohdl_Top___024root.h"
+#include "checkpoint.h"
+#include "golden.h"
 #include "verilated.h"
-#include "verilated_vcd_c.h"
+#include "testbench.h"
+#include "waves.h"
+#include <chrono>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-// Global simulation time
-static int sim_time = 0;
+typedef Waves<Vdemohdl_Top> TopWaves;
+typedef Testbench<Vdemohdl_Top> TopBench;
 
-// Test combinational logic gates
-void test_gates(Vdemohdl_Top *dut, VerilatedVcdC *tfp) {
+// Internal signals of Top, also the waveform capture's probes
+struct TopProbes {
+  Signal<CData> cnt, delayed_1, delayed_3;
+
+  TopProbes(TopBench *tb, Vdemohdl_Top *dut)
+      : cnt(tb->probe("cnt", &dut->rootp->demohdl_Top__DOT__cnt, 8)),
+        delayed_1(tb->probe("delayed_1",
+                            &dut->rootp->demohdl_Top__DOT__delayed_1, 8)),
+        delayed_3(tb->probe("delayed_3",
+                            &dut->rootp->demohdl_Top__DOT__delayed_3, 8)) {}
+};
+
+// Test combinational logic gates against the golden truth table
+bool test_gates(Vdemohdl_Top *dut, TopBench *tb) {
   printf("\n=== Logic Gates Test ===\n");
   printf(" a | b | AND | OR | XOR | NOT | NAND | NOR | XNOR\n");
   printf("---|---|-----|----|-----|-----|------|-----|-----\n");
 
+  GatesModel g;
+  Scoreboard<CData> sb("gates");
   for (int a = 0; a <= 1; a++) {
     for (int b = 0; b <= 1; b++) {
       dut->gate_a = a;
       dut->gate_b = b;
-      dut->eval();
-      tfp->dump(sim_time++);
+      tb->step();
 
       printf(" %d | %d |  %d  | %d  |  %d  |  %d  |   %d  |  %d  |   %d\n", a,
              b, dut->gate_and, dut->gate_or, dut->gate_xor, dut->gate_not,
              dut->gate_nand, dut->gate_nor, dut->gate_xnor);
+
+      // One check of all seven outputs packed into a byte
+      g.eval(a, b);
+      sb.check(g.and_out | g.or_out << 1 | g.xor_out << 2 | g.not_a << 3 |
+                   g.nand_out << 4 | g.nor_out << 5 | g.xnor_out << 6,
+               dut->gate_and | dut->gate_or << 1 | dut->gate_xor << 2 |
+                   dut->gate_not << 3 | dut->gate_nand << 4 |
+                   dut->gate_nor << 5 | dut->gate_xnor << 6);
     }
   }
+  return sb.report();
 }
 
-// Test sequential counter with delays
-void test_counter(Vdemohdl_Top *dut, VerilatedVcdC *tfp) {
-  printf("\n=== Counter & Delay Test ===\n");
+// Golden model of Top and a scoreboard per checked signal. check() is
+// inline and allocation-free: it runs every cycle, also in --bench.
+struct TopChecker {
+  TopModel model;
+  Scoreboard<CData> cnt{"cnt"}, delay1{"delay1"}, delay3{"delay3"};
+
+  void check(const TopProbes &p, uint64_t cycle) {
+    model.clock(true);
+    cnt.check(model.cnt(), p.cnt(), cycle);
+    delay1.check(model.delayed_1(), p.delayed_1(), cycle);
+    delay3.check(model.delayed_3(), p.delayed_3(), cycle);
+  }
 
-  // Reset phase (active-low)
-  dut->i_clk = 0;
-  dut->i_rst = 0;
-  for (int i = 0; i < 10; i++) {
-    dut->i_clk = !dut->i_clk;
-    dut->eval();
-    tfp->dump(sim_time++);
+  bool report() const {
+    bool ok = cnt.report();
+    ok &= delay1.report();
+    ok &= delay3.report();
+    return ok;
   }
+};
 
-  // Release reset
-  dut->i_rst = 1;
+struct CounterOptions {
+  uint64_t cycles = 25;       // checked and tabulated
+  uint64_t warmup = 0;        // checked, run before `cycles`
+  const char *save = nullptr; // checkpoint after reset and warm-up
+  bool restored = false;      // state came from a checkpoint instead
+};
+
+// Test sequential counter with delays. The golden model checks every
+// cycle; the table shows the first 15 after warm-up.
+bool test_counter(Vdemohdl_Top *dut, TopBench *tb, const TopProbes &p,
+                  TopChecker *checker, const CounterOptions &o) {
+  printf("\n=== Counter & Delay Test ===\n");
+
+  if (!o.restored) {
+    tb->reset(5);
+    tb->run(o.warmup, [&](uint64_t cycle) { checker->check(p, cycle); });
+    if (o.save && !checkpoint_save(o.save, dut, *tb, checker->model))
+      return false;
+  }
 
   printf("Cycle | cnt | delay1 | delay3\n");
   printf("------|-----|--------|-------\n");
 
-  int cycle = 0;
-  for (int i = 0; i < 50; i++) {
-    dut->i_clk = !dut->i_clk;
-    dut->eval();
-    tfp->dump(sim_time++);
-
-    if (dut->i_clk && cycle < 15) {
-      printf("%5d | %3d | %6d | %6d\n", cycle,
-             dut->rootp->demohdl_Top__DOT__cnt,
-             dut->rootp->demohdl_Top__DOT__delayed_1,
-             dut->rootp->demohdl_Top__DOT__delayed_3);
-      cycle++;
-    }
+  uint64_t first = tb->cycle;
+  tb->run(o.cycles, [&](uint64_t cycle) {
+    checker->check(p, cycle);
+    if (cycle - first < 15)
+      printf("%5d | %3d | %6d | %6d\n", (int)cycle, p.cnt(), p.delayed_1(),
+             p.delayed_3());
+  });
+  return checker->report();
+}
+
+// Throughput benchmark: `cycles` full clock cycles, no tracing, no output
+// until the end. Runs once bare and once with the golden model checking
+// every cycle, and reports what the checks cost.
+int bench(Vdemohdl_Top *dut, TopBench *tb, const TopProbes &p,
+          uint64_t cycles) {
+  double secs[2];
+  TopChecker checker;
+  for (int checked = 0; checked < 2; checked++) {
+    tb->reset(2);
+    auto start = std::chrono::steady_clock::now();
+    if (checked)
+      tb->run(cycles, [&](uint64_t c) { checker.check(p, c); });
+    else
+      tb->run(cycles);
+    secs[checked] = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
   }
+
+  printf("threads | cycles | checked | seconds | cycles/s\n");
+  for (int checked = 0; checked < 2; checked++)
+    printf("%7u | %5.1fM | %7s | %7.3f | %.2fM\n",
+           dut->contextp()->threads(), cycles / 1e6, checked ? "yes" : "no",
+           secs[checked], cycles / secs[checked] / 1e6);
+  printf("checking overhead: %.1f%%\n", (secs[1] / secs[0] - 1) * 100);
+  return checker.report() ? 0 : 1;
 }
 
 int main(int argc, char **argv) {
   Verilated::commandArgs(argc, argv);
 
   Vdemohdl_Top *dut = new Vdemohdl_Top;
-  Verilated::traceEverOn(true);
+  TopWaves waves;
+  TopBench tb(dut, &waves, &dut->i_clk, &dut->i_rst, 0); // active-low reset
+  tb.probe("i_clk", &dut->i_clk, 1);
+  tb.probe("i_rst", &dut->i_rst, 1);
+  TopProbes probes(&tb, dut);
+
+  WaveOptions wave_opts;
+  CounterOptions counter_opts;
+  const char *restore = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (parse_wave_option(&wave_opts, argc, argv, &i))
+      continue;
+    if (i + 1 < argc && strcmp(argv[i], "--cycles") == 0) {
+      counter_opts.cycles = strtoull(argv[++i], nullptr, 0);
+    } else if (i + 1 < argc && strcmp(argv[i], "--warmup") == 0) {
+      counter_opts.warmup = strtoull(argv[++i], nullptr, 0);
+    } else if (i + 1 < argc && strcmp(argv[i], "--save") == 0) {
+      counter_opts.save = argv[++i];
+    } else if (i + 1 < argc && strcmp(argv[i], "--restore") == 0) {
+      restore = argv[++i];
+    } else if (i + 1 < argc && strcmp(argv[i], "--bench") == 0) {
+      // Measure simulation speed instead of testing
+      int status =
+          bench(dut, &tb, probes, (uint64_t)(atof(argv[i + 1]) * 1e6));
+      delete dut;
+      return status;
+    } else if (argv[i][0] != '+') { // +args are Verilator's
+      fprintf(stderr,
+              "usage: %s [options]\n"
+              "  --bench M          run M million cycles, report speed\n"
+              "  --cycles N         counter test length (default 25)\n"
+              "  --warmup N         cycles run before the counter test\n"
+              "  --save FILE        checkpoint after reset and warm-up\n"
+              "  --restore FILE     start from a checkpoint instead\n%s"
+              "probes: i_clk i_rst cnt delayed_1 delayed_3\n",
+              argv[0], WAVE_USAGE);
+      delete dut;
+      return 1;
+    }
+  }
 
-  VerilatedVcdC *tfp = new VerilatedVcdC;
-  dut->trace(tfp, 99);
-  tfp->open("vcd/wave.vcd");
+  // The model, testbench time and the golden model continue from the
+  // checkpoint; the waveforms start at the restored time
+  TopChecker checker;
+  if (restore) {
+    if (!checkpoint_restore(restore, dut, &tb, &checker.model)) {
+      delete dut;
+      return 1;
+    }
+    counter_opts.restored = true;
+  }
+
+  if (!waves.open(dut, wave_opts)) {
+    delete dut;
+    return 1;
+  }
 
   // Run tests
-  test_gates(dut, tfp);
-  test_counter(dut, tfp);
+  bool ok = test_gates(dut, &tb);
+  ok &= test_counter(dut, &tb, probes, &checker, counter_opts);
 
-  tfp->close();
+  waves.close();
   delete dut;
-  printf("\nWaveform saved to vcd/wave.vcd\n");
-  return 0;
+  return ok ? 0 : 1;
 }
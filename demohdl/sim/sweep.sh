@@ -0,0 +1,77 @@
+#!/bin/sh
+# Build and measure src/Sweep.veryl over a grid of WIDTH x DEPTH.
+# Called by `make sweep`; the knobs come from the environment:
+#
+#   WIDTHS="8 16 32 64" DEPTHS="1 4 16 64 256 1024" MCYCLES=1 sim/sweep.sh
+#
+# For each configuration: Verilator and C++ compile time, eval cost
+# (ns per clock cycle), model size and peak RSS. Results go to
+# sweep/sweep.csv, and each metric is printed as a table with one row per
+# WIDTH and one column per DEPTH.
+
+WIDTHS=${WIDTHS:-"8 16 32 64"}
+DEPTHS=${DEPTHS:-"1 4 16 64 256 1024"}
+MCYCLES=${MCYCLES:-1}
+VFLAGS=${VFLAGS:-"-O3 --x-assign fast --x-initial fast"}
+OUT=${OUT:-sweep}
+MODULE=demohdl_Sweep
+
+now() { perl -MTime::HiRes=time -e 'printf "%.2f\n", time'; }
+
+mkdir -p "$OUT"
+CSV="$OUT/sweep.csv"
+echo "width,depth,cycles,ns_per_cycle,model_bytes,max_rss_kb,ok,verilate_s,compile_s" > "$CSV"
+
+for w in $WIDTHS; do
+  for d in $DEPTHS; do
+    dir="$OUT/w${w}_d${d}"
+    line= vs= cs=
+    t0=$(now)
+    if verilator --cc target/*.sv --exe sim/sweep_main.cpp -Mdir "$dir" \
+        --top-module $MODULE -GWIDTH=$w -GDEPTH=$d $VFLAGS \
+        -CFLAGS "-DSWEEP_WIDTH=$w -DSWEEP_DEPTH=$d" > "$dir.log" 2>&1; then
+      t1=$(now)
+      vs=$(echo "$t0 $t1" | awk '{ printf "%.2f", $2 - $1 }')
+      if make -C "$dir" -f V$MODULE.mk OPT_FAST=-O3 OPT_SLOW=-O3 \
+          >> "$dir.log" 2>&1; then
+        t2=$(now)
+        cs=$(echo "$t1 $t2" | awk '{ printf "%.2f", $2 - $1 }')
+        line=$("./$dir/V$MODULE" "$MCYCLES" || true)
+      fi
+    fi
+    # A step that failed leaves its time, and the later ones, empty
+    [ -n "$line" ] || line="$w,$d,,,,,FAIL"
+    echo "$line,$vs,$cs" >> "$CSV"
+    echo "WIDTH=$w DEPTH=$d: $line, verilate ${vs:--}s, compile ${cs:--}s"
+  done
+done
+
+# Pivot one CSV column into a WIDTH x DEPTH table
+table() {
+  echo
+  echo "$2"
+  awk -F, -v col="$1" -v depths="$DEPTHS" '
+    NR == 1 { next }
+    { v[$1 "," $2] = $col; if (!($1 in seen)) { seen[$1] = 1; ws[++n] = $1 } }
+    END {
+      nd = split(depths, ds, " ")
+      printf "%8s", "W \\ D"
+      for (j = 1; j <= nd; j++) printf " %9s", ds[j]
+      printf "\n"
+      for (i = 1; i <= n; i++) {
+        printf "%8s", ws[i]
+        for (j = 1; j <= nd; j++) printf " %9s", v[ws[i] "," ds[j]]
+        printf "\n"
+      }
+    }' "$CSV"
+}
+
+table 4 "Eval cost (ns per cycle)"
+table 5 "Model size (bytes)"
+table 6 "Peak RSS (KB)"
+table 8 "Verilator time (s)"
+table 9 "C++ compile time (s)"
+echo
+echo "Results: $CSV"
+grep -q ',FAIL,' "$CSV" && { echo "Some configurations FAILED"; exit 1; }
+exit 0
@@ -0,0 +1,61 @@
+// Eval-cost probe for one Sweep configuration, built by sim/sweep.sh with
+// -DSWEEP_WIDTH / -DSWEEP_DEPTH matching the Verilator -G overrides.
+// Prints one CSV line:
+//
+//   width,depth,cycles,ns_per_cycle,model_bytes,max_rss_kb,ok
+
+#include "Vdemohdl_Sweep.h"
+#include "Vdemohdl_Sweep___024root.h"
+#include "golden.h"
+#include "testbench.h"
+#include "verilated.h"
+#include "waves.h"
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#ifndef SWEEP_WIDTH
+#define SWEEP_WIDTH 8
+#endif
+#ifndef SWEEP_DEPTH
+#define SWEEP_DEPTH 1
+#endif
+
+int main(int argc, char **argv) {
+  uint64_t cycles = argc > 1 ? (uint64_t)(atof(argv[1]) * 1e6) : 1000000;
+
+  VerilatedContext ctx;
+  Vdemohdl_Sweep dut(&ctx, "TOP");
+  Waves<Vdemohdl_Sweep> waves;
+  Testbench<Vdemohdl_Sweep> tb(&dut, &waves, &dut.i_clk, &dut.i_rst, 0);
+
+  tb.reset(2);
+  tb.run(1000); // warm caches and branch predictors
+  auto start = std::chrono::steady_clock::now();
+  tb.run(cycles);
+  double secs = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+
+  // Closed form of the golden models: the counter adds 2 per cycle and
+  // the delay line shows its value from DEPTH cycles earlier
+  uint64_t n = tb.cycle, mask = bits_mask<SWEEP_WIDTH>();
+  uint64_t cnt = (2 * n) & mask;
+  uint64_t data = n >= SWEEP_DEPTH ? (2 * (n - SWEEP_DEPTH)) & mask : 0;
+  bool ok = (uint64_t)dut.o_cnt == cnt && (uint64_t)dut.o_data == data;
+
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+  long rss_kb = ru.ru_maxrss / 1024; // bytes on macOS
+#else
+  long rss_kb = ru.ru_maxrss;
+#endif
+
+  printf("%d,%d,%llu,%.2f,%zu,%ld,%s\n", SWEEP_WIDTH, SWEEP_DEPTH,
+         (unsigned long long)cycles, secs * 1e9 / cycles,
+         sizeof(Vdemohdl_Sweep) + sizeof(*dut.rootp), rss_kb,
+         ok ? "ok" : "FAIL");
+  return ok ? 0 : 1;
+}
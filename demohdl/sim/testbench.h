@@ -0,0 +1,175 @@
+#pragma once
+// Clocked testbench harness for Verilator models.
+//
+//   Testbench<Vtop> tb(dut, &waves, &dut->i_clk, &dut->i_rst, 0);
+//   auto cnt = tb.probe("cnt", &dut->rootp->top__DOT__cnt, 8);
+//   Scoreboard<uint8_t> sb("cnt");
+//   tb.reset(5);
+//   tb.run(1000, [&](uint64_t c) {
+//     model.clock();
+//     sb.check(model.cnt(), cnt(), c);
+//   });
+//
+// One cycle is a rising edge and a falling edge, one time step each.
+// Monitors run after every rising edge. When nothing watches the model
+// (no monitors, no waveform output) run() is a bare eval loop.
+
+#include "waves.h"
+#include <functional>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+// Typed read-only view of a model signal
+template <typename T> class Signal {
+public:
+  explicit Signal(const T *p) : p(p) {}
+  T operator()() const { return *p; }
+
+private:
+  const T *p;
+};
+
+// Compares observed values against expected ones (from a reference model
+// or a queue of expect() calls), reporting the first few mismatches
+template <typename T> class Scoreboard {
+public:
+  explicit Scoreboard(const char *name, unsigned max_reports = 5)
+      : name(name), max_reports(max_reports) {}
+
+  void expect(T value) { queue.push_back(value); }
+
+  // Checks the oldest expect()ed value
+  void observe(T actual, uint64_t cycle = 0) {
+    if (head == queue.size()) {
+      fail(cycle, "unexpected value %llu", (unsigned long long)actual);
+      return;
+    }
+    check(queue[head++], actual, cycle);
+    if (head == queue.size()) {
+      queue.clear();
+      head = 0;
+    }
+  }
+
+  void check(T expected, T actual, uint64_t cycle = 0) {
+    checks++;
+    if (expected != actual)
+      fail(cycle, "expected %llu, got %llu", (unsigned long long)expected,
+           (unsigned long long)actual);
+  }
+
+  bool report() const {
+    printf("Scoreboard %s: %llu checks, %llu mismatches%s\n", name,
+           (unsigned long long)checks, (unsigned long long)errors,
+           head < queue.size() ? ", expected values left over" : "");
+    return errors == 0 && head == queue.size();
+  }
+
+private:
+  template <typename... Args>
+  __attribute__((noinline)) void fail(uint64_t cycle, const char *fmt,
+                                      Args... args) {
+    if (errors++ >= max_reports)
+      return;
+    printf("  %s @ cycle %llu: ", name, (unsigned long long)cycle);
+    printf(fmt, args...);
+    printf("\n");
+  }
+
+  const char *name;
+  unsigned max_reports;
+  std::vector<T> queue;
+  size_t head = 0;
+  uint64_t checks = 0, errors = 0;
+};
+
+template <typename Model> class Testbench {
+public:
+  typedef std::function<void(uint64_t cycle)> Monitor;
+
+  Testbench(Model *dut, Waves<Model> *waves, uint8_t *clk, uint8_t *rst,
+            uint8_t rst_active)
+      : dut(dut), waves(waves), clk(clk), rst(rst), rst_active(rst_active) {}
+
+  // Also registered with the waveform capture; call before waves->open()
+  template <typename T>
+  Signal<T> probe(const char *name, const T *sig, int width) {
+    waves->capture.probe(name, sig, width);
+    return Signal<T>(sig);
+  }
+
+  void monitor(Monitor m) { monitors.push_back(m); }
+
+  // Settle combinational inputs without a clock edge
+  void step() {
+    dut->eval();
+    waves->dump(time++);
+  }
+
+  // `each(cycle)` runs after the rising edge, after the monitors
+  template <typename F> void tick(F each) {
+    *clk = 1;
+    step();
+    for (Monitor &m : monitors)
+      m(cycle);
+    each(cycle);
+    cycle++;
+    *clk = 0;
+    step();
+  }
+  void tick() { tick([](uint64_t) {}); }
+
+  // The callback is a template parameter, not a Monitor, so a per-cycle
+  // check inlines into the eval loop and can stay on in long runs
+  template <typename F> void run(uint64_t cycles, F each) {
+    if (!monitors.empty() || waves->enabled()) {
+      for (uint64_t i = 0; i < cycles; i++)
+        tick(each);
+      return;
+    }
+    for (uint64_t i = 0; i < cycles; i++) {
+      *clk = 1;
+      dut->eval();
+      each(cycle++);
+      *clk = 0;
+      dut->eval();
+    }
+    time += 2 * cycles;
+  }
+  void run(uint64_t cycles) { run(cycles, [](uint64_t) {}); }
+
+  // Runs until `done` holds after a rising edge, at most `max` cycles.
+  // Returns false on timeout.
+  bool run_until(std::function<bool()> done, uint64_t max) {
+    for (uint64_t i = 0; i < max; i++) {
+      tick();
+      if (done())
+        return true;
+    }
+    return false;
+  }
+
+  // Holds reset for `cycles` cycles, then releases it. Monitors do not
+  // run and the cycle count restarts at 0.
+  void reset(uint64_t cycles) {
+    std::vector<Monitor> saved;
+    saved.swap(monitors);
+    *clk = 0;
+    *rst = rst_active;
+    run(cycles);
+    *rst = !rst_active;
+    monitors.swap(saved);
+    cycle = 0;
+  }
+
+  uint64_t cycle = 0; // rising edges since reset
+  uint64_t time = 0;  // time steps (waveform timestamps)
+
+private:
+  Model *dut;
+  Waves<Model> *waves;
+  uint8_t *clk, *rst;
+  uint8_t rst_active;
+  std::vector<Monitor> monitors;
+};
@@ -0,0 +1,297 @@
+#pragma once
+// Waveform output for the Verilator testbench.
+//
+// Waves wraps the model's trace file (VCD, or FST when built with
+// --trace-fst) and adds:
+//   * a scope filter and depth, so only part of the hierarchy is traced
+//   * a time window: dump() outside [start, end) costs nothing
+//   * a triggered capture, like an on-chip logic analyzer: a few probed
+//     signals are sampled into an in-memory ring every step, and when the
+//     trigger fires the ring (the steps *before* the event) plus the
+//     following steps are written to their own VCD
+//
+// A long simulation can run with the full trace off and still come back
+// with the interesting region.
+
+#include "verilated.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#if VM_TRACE_FST
+#include "verilated_fst_c.h"
+typedef VerilatedFstC VerilatedTraceFile;
+#define WAVES_DEFAULT_PATH "vcd/wave.fst"
+#define WAVES_DEFAULT_NAME WAVES_DEFAULT_PATH
+#elif VM_TRACE
+#include "verilated_vcd_c.h"
+typedef VerilatedVcdC VerilatedTraceFile;
+#define WAVES_DEFAULT_PATH "vcd/wave.vcd"
+#define WAVES_DEFAULT_NAME WAVES_DEFAULT_PATH
+#else
+#define WAVES_DEFAULT_PATH nullptr // built without --trace
+#define WAVES_DEFAULT_NAME "none"
+#endif
+
+struct WaveOptions {
+  const char *path = WAVES_DEFAULT_PATH; // full trace, nullptr for none
+  int depth = 99;                        // hierarchy levels traced
+  const char *scope = nullptr;           // e.g. "TOP.demohdl_Top.counter"
+  uint64_t start = 0, end = UINT64_MAX;  // time window of the full trace
+
+  const char *capture = nullptr; // triggered capture VCD, nullptr for none
+  const char *trigger = nullptr; // "probe=value"
+  unsigned pre = 16, post = 16;  // steps kept before / after the trigger
+};
+
+static const char WAVE_USAGE[] =
+    "  --waves FILE       full trace file (default " WAVES_DEFAULT_NAME ")\n"
+    "  --no-waves         no full trace\n"
+    "  --trace-depth N    trace N levels of hierarchy\n"
+    "  --trace-scope S    trace only scope S and below\n"
+    "  --window A:B       full trace only for time steps [A, B)\n"
+    "  --capture FILE     triggered capture into FILE\n"
+    "  --trigger P=V      trigger when probe P equals V\n"
+    "  --pre N --post M   steps captured before / after the trigger\n";
+
+// Consumes the option at argv[*i] (and its value). Returns false if it is
+// not a wave option.
+inline bool parse_wave_option(WaveOptions *o, int argc, char **argv, int *i) {
+  const char *a = argv[*i];
+  const char *v = *i + 1 < argc ? argv[*i + 1] : nullptr;
+
+  if (strcmp(a, "--no-waves") == 0) {
+    o->path = nullptr;
+    return true;
+  }
+  if (!v)
+    return false;
+  if (strcmp(a, "--waves") == 0)
+    o->path = v;
+  else if (strcmp(a, "--trace-depth") == 0)
+    o->depth = atoi(v);
+  else if (strcmp(a, "--trace-scope") == 0)
+    o->scope = v;
+  else if (strcmp(a, "--window") == 0) {
+    char *end;
+    o->start = strtoull(v, &end, 0);
+    o->end = *end == ':' && end[1] ? strtoull(end + 1, nullptr, 0) : UINT64_MAX;
+  } else if (strcmp(a, "--capture") == 0)
+    o->capture = v;
+  else if (strcmp(a, "--trigger") == 0)
+    o->trigger = v;
+  else if (strcmp(a, "--pre") == 0)
+    o->pre = atoi(v);
+  else if (strcmp(a, "--post") == 0)
+    o->post = atoi(v);
+  else
+    return false;
+  (*i)++;
+  return true;
+}
+
+// Ring of probe samples, written as a VCD once the trigger has fired and
+// `post` more steps have been seen. One-shot.
+class Capture {
+public:
+  // Verilator signals are CData/SData/IData/QData: 1 to 8 bytes
+  template <typename T> void probe(const char *name, const T *sig, int width) {
+    static_assert(sizeof(T) <= 8, "wide signals are not supported");
+    probes.push_back({name, sig, sizeof(T), width});
+  }
+
+  bool setup(const WaveOptions &o) {
+    path = o.capture;
+    if (!path)
+      return true;
+    pre = o.pre;
+    post = o.post;
+    ring.resize((size_t)(pre + 1 + post) * probes.size());
+    times.resize(pre + 1 + post);
+    if (o.trigger) {
+      const char *eq = strchr(o.trigger, '=');
+      trig = eq ? find(std::string(o.trigger, eq - o.trigger)) : -1;
+      if (trig < 0) {
+        fprintf(stderr, "--trigger %s: expected probe=value with one of:",
+                o.trigger);
+        for (const Probe &p : probes)
+          fprintf(stderr, " %s", p.name);
+        fprintf(stderr, "\n");
+        return false;
+      }
+      trig_value = strtoull(eq + 1, nullptr, 0);
+    }
+    return true;
+  }
+
+  // Fire from the test instead of (or as well as) a --trigger condition;
+  // the next sample() is the trigger step
+  void trigger() { fire = true; }
+
+  void sample(uint64_t t) {
+    if (!path || done)
+      return;
+    size_t slot = count % times.size();
+    times[slot] = t;
+    uint64_t *row = &ring[slot * probes.size()];
+    for (size_t i = 0; i < probes.size(); i++)
+      row[i] = read(probes[i]);
+    count++;
+
+    if (remaining < 0 && (fire || (trig >= 0 && row[trig] == trig_value)))
+      remaining = post;
+    else if (remaining > 0)
+      remaining--;
+    if (remaining == 0)
+      write();
+  }
+
+  bool enabled() const { return path && !done; }
+
+  // A run that ends before `post` steps still gets what was captured
+  void finish() {
+    if (path && !done && remaining >= 0)
+      write();
+  }
+
+private:
+  struct Probe {
+    const char *name;
+    const void *sig;
+    size_t bytes;
+    int width;
+  };
+
+  static uint64_t read(const Probe &p) {
+    uint64_t v = 0;
+    memcpy(&v, p.sig, p.bytes); // little-endian host
+    return v;
+  }
+
+  int find(const std::string &name) const {
+    for (size_t i = 0; i < probes.size(); i++)
+      if (name == probes[i].name)
+        return (int)i;
+    return -1;
+  }
+
+  void write() {
+    done = true;
+    FILE *f = fopen(path, "w");
+    if (!f) {
+      perror(path);
+      return;
+    }
+    fprintf(f, "$timescale 1ns $end\n$scope module capture $end\n");
+    for (size_t i = 0; i < probes.size(); i++)
+      fprintf(f, "$var wire %d %c %s $end\n", probes[i].width, (char)('!' + i),
+              probes[i].name);
+    fprintf(f, "$upscope $end\n$enddefinitions $end\n");
+
+    size_t n = times.size();
+    size_t first = count > n ? count - n : 0;
+    std::vector<uint64_t> last(probes.size());
+    for (size_t s = first; s < count; s++) {
+      const uint64_t *row = &ring[(s % n) * probes.size()];
+      fprintf(f, "#%llu\n", (unsigned long long)times[s % n]);
+      for (size_t i = 0; i < probes.size(); i++) {
+        if (s != first && row[i] == last[i])
+          continue;
+        last[i] = row[i];
+        char id = (char)('!' + i);
+        if (probes[i].width == 1) {
+          fprintf(f, "%d%c\n", (int)(row[i] & 1), id);
+          continue;
+        }
+        fputc('b', f);
+        for (int b = probes[i].width - 1; b >= 0; b--)
+          fputc('0' + (int)((row[i] >> b) & 1), f);
+        fprintf(f, " %c\n", id);
+      }
+    }
+    fclose(f);
+    printf("Capture of %zu steps saved to %s\n", count - first, path);
+  }
+
+  std::vector<Probe> probes;
+  const char *path = nullptr;
+  unsigned pre = 0, post = 0;
+  std::vector<uint64_t> ring; // [step][probe]
+  std::vector<uint64_t> times;
+  size_t count = 0;   // steps sampled
+  int remaining = -1; // steps left after the trigger, -1 before it
+  int trig = -1;      // probe index of --trigger
+  uint64_t trig_value = 0;
+  bool fire = false;
+  bool done = false;
+};
+
+// Call dump() once per time step, as with the Verilator trace file
+template <typename Model> class Waves {
+public:
+  Capture capture;
+
+  bool open(Model *dut, const WaveOptions &o) {
+    start = o.start;
+    end = o.end;
+    if (!capture.setup(o))
+      return false;
+#if VM_TRACE
+    if (o.path) {
+      Verilated::traceEverOn(true);
+      tfp = new VerilatedTraceFile;
+      if (o.scope)
+        tfp->dumpvars(o.depth, o.scope);
+      dut->trace(tfp, o.depth);
+      tfp->open(o.path);
+      path = o.path;
+    }
+#else
+    (void)dut;
+    if (o.path) {
+      fprintf(stderr, "built without --trace: use --no-waves\n");
+      return false;
+    }
+#endif
+    return true;
+  }
+
+  // False when dump() would do nothing at all
+  bool enabled() const {
+#if VM_TRACE
+    if (tfp)
+      return true;
+#endif
+    return capture.enabled();
+  }
+
+  void dump(uint64_t t) {
+#if VM_TRACE
+    if (tfp && t >= start && t < end)
+      tfp->dump(t);
+#endif
+    capture.sample(t);
+  }
+
+  void close() {
+    capture.finish();
+#if VM_TRACE
+    if (tfp) {
+      tfp->close();
+      delete tfp;
+      tfp = nullptr;
+      printf("\nWaveform saved to %s\n", path);
+    }
+#endif
+  }
+
+private:
+#if VM_TRACE
+  VerilatedTraceFile *tfp = nullptr;
+#endif
+  const char *path = nullptr;
+  uint64_t start = 0, end = UINT64_MAX;
+};
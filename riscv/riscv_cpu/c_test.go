@@ -1,8 +1,10 @@
 package riscv
 
 import (
+	"bytes"
 	"fmt"
 	"os"
+	"strings"
 	"testing"
 
 	. "riscv/system_interface"
@@ -38,6 +40,17 @@ func Test_C_CODE(t *testing.T) {
 	sys := NewRVI32System()
 	sys.rom.Load(byteArrayToUint32Array(data))
 
+	// RISCV_TRACE=<file> writes the commit trace for co-simulation against
+	// tinyRiscVTrapEmulator (`make cosim` there)
+	if path := os.Getenv("RISCV_TRACE"); path != "" {
+		f, err := os.Create(path)
+		if err != nil {
+			t.Fatalf("failed to create trace: %v", err)
+		}
+		defer f.Close()
+		sys.SetCommitTrace(f)
+	}
+
 	// First instruction in binary (little-endian word at offset 0)
 	expected := uint32(0)
 	if len(data) >= 4 {
@@ -90,3 +103,40 @@ func Test_C_CODE(t *testing.T) {
 
 	fmt.Println()
 }
+
+func Test_C_CODE_CommitTrace(t *testing.T) {
+	data, err := os.ReadFile("test_code/build/main.bin")
+	if err != nil {
+		t.Fatalf("failed to read binary: %v", err)
+	}
+
+	sys := NewRVI32System()
+	sys.rom.Load(byteArrayToUint32Array(data))
+
+	var trace bytes.Buffer
+	sys.SetCommitTrace(&trace)
+	for sys.State != TERMINATE {
+		sys.Cycle()
+	}
+
+	lines := strings.Split(strings.TrimSpace(trace.String()), "\n")
+
+	// bootloader: lui sp, 0x20400; addi sp, sp, -4; j main
+	want := []string{
+		"0x10000000 (0x20400137) x2 0x20400000",
+		"0x10000004 (0xffc10113) x2 0x203ffffc",
+		"0x10000008 (0x07c0006f)",
+	}
+	for i, w := range want {
+		if i >= len(lines) {
+			t.Fatalf("trace has %d lines; want at least %d", len(lines), len(want))
+		}
+		if lines[i] != w {
+			t.Fatalf("trace line %d = %q; want %q", i+1, lines[i], w)
+		}
+	}
+
+	if !strings.Contains(trace.String(), "mem 0x20000000 0x00000ae0\n") {
+		t.Fatalf("trace has no store of 0xAE0 to 0x20000000")
+	}
+}
@@ -2,6 +2,7 @@ package riscv
 
 import (
 	"fmt"
+	"io"
 	. "riscv/csr"
 	. "riscv/pipeline"
 	. "riscv/system_interface"
@@ -101,6 +102,11 @@ func NewRVI32System() *RVI32System {
 	return sys
 }
 
+// SetCommitTrace logs every retired instruction to w (see WriteBackStage).
+func (sys *RVI32System) SetCommitTrace(w io.Writer) {
+	sys.WB.SetTrace(w)
+}
+
 func (sys *RVI32System) Compute() {
 	sys.IF.Compute()
 	sys.DE.Compute()
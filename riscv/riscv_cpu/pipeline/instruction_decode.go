@@ -238,8 +238,9 @@ type DecodedValues struct {
 
 	imm int32
 
-	pc      uint32
-	pcPlus4 uint32
+	pc          uint32
+	pcPlus4     uint32
+	instruction uint32
 }
 
 func (ids *DecodeStage) GetDecodedValuesOut() DecodedValues {
@@ -268,7 +269,8 @@ func (ids *DecodeStage) GetDecodedValuesOut() DecodedValues {
 
 		imm: ids.imm.GetN(),
 
-		pc:      ids.pc.GetN(),
-		pcPlus4: ids.pcPlus4.GetN(),
+		pc:          ids.pc.GetN(),
+		pcPlus4:     ids.pcPlus4.GetN(),
+		instruction: ids.instruction.GetN(),
 	}
 }
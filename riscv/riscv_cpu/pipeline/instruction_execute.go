@@ -56,6 +56,10 @@ type ExecuteStage struct {
 	branchAddress RUint32
 	branchValid   RBool
 
+	// Carried to write-back for the commit trace
+	pc          RUint32
+	instruction RUint32
+
 	regFile *[32]RUint32
 
 	shouldStall        func() bool
@@ -92,6 +96,8 @@ func (ies *ExecuteStage) Compute() {
 		ies.csrShouldRead.SetN(decoded.csrShouldRead)
 
 		ies.pcPlus4.SetN(decoded.pcPlus4)
+		ies.pc.SetN(decoded.pc)
+		ies.instruction.SetN(decoded.instruction)
 
 		ies.imm32.SetN(decoded.imm)
 		ies.func3.SetN(decoded.func3)
@@ -281,6 +287,8 @@ func (ies *ExecuteStage) LatchNext() {
 	ies.pcPlus4.LatchNext()
 	ies.branchAddress.LatchNext()
 	ies.branchValid.LatchNext()
+	ies.pc.LatchNext()
+	ies.instruction.LatchNext()
 
 	ies.imm32.LatchNext()
 	ies.func3.LatchNext()
@@ -310,6 +318,9 @@ type ExecutedValues struct {
 	pcPlus4       uint32
 	BranchAddress uint32
 	BranchValid   bool
+
+	pc          uint32
+	instruction uint32
 }
 
 func (ies *ExecuteStage) GetExecutionValuesOut() ExecutedValues {
@@ -337,5 +348,8 @@ func (ies *ExecuteStage) GetExecutionValuesOut() ExecutedValues {
 		pcPlus4:       ies.pcPlus4.GetN(),
 		BranchAddress: ies.branchAddress.GetN(),
 		BranchValid:   ies.branchValid.GetN(),
+
+		pc:          ies.pc.GetN(),
+		instruction: ies.instruction.GetN(),
 	}
 }
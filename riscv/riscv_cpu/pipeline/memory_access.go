@@ -48,6 +48,14 @@ type MemoryAccessStage struct {
 	rd             RByte
 
 	writeBackValueValid RBool
+
+	// Carried to write-back for the commit trace
+	pc                RUint32
+	instruction       RUint32
+	storeValid        RBool
+	storeAddress      RUint32
+	storeValue        RUint32
+	storeWidthInBytes RByte
 }
 
 func NewMemoryAccessStage(params *MemoryAccessParams) *MemoryAccessStage {
@@ -75,7 +83,23 @@ func (ma *MemoryAccessStage) Compute() {
 
 		addr := uint32(int32(ev.rs1V) + ev.imm32)
 
+		ma.pc.SetN(ev.pc)
+		ma.instruction.SetN(ev.instruction)
+		ma.storeValid.SetN(ev.isStoreOp)
+
 		if ev.isStoreOp {
+			ma.storeAddress.SetN(addr)
+			switch ev.func3 {
+			case STORE_FUNC3_SB:
+				ma.storeValue.SetN(ev.rs2V & 0xFF)
+				ma.storeWidthInBytes.SetN(1)
+			case STORE_FUNC3_SH:
+				ma.storeValue.SetN(ev.rs2V & 0xFFFF)
+				ma.storeWidthInBytes.SetN(2)
+			default:
+				ma.storeValue.SetN(ev.rs2V)
+				ma.storeWidthInBytes.SetN(4)
+			}
 
 			switch ev.func3 {
 			case STORE_FUNC3_SB:
@@ -178,12 +202,26 @@ func (ma *MemoryAccessStage) LatchNext() {
 	ma.writeBackValue.LatchNext()
 	ma.rd.LatchNext()
 	ma.writeBackValueValid.LatchNext()
+
+	ma.pc.LatchNext()
+	ma.instruction.LatchNext()
+	ma.storeValid.LatchNext()
+	ma.storeAddress.LatchNext()
+	ma.storeValue.LatchNext()
+	ma.storeWidthInBytes.LatchNext()
 }
 
 type MemoryAccessValues struct {
 	writeBackValid bool
 	writeBackValue uint32
 	rd             byte
+
+	pc                uint32
+	instruction       uint32
+	storeValid        bool
+	storeAddress      uint32
+	storeValue        uint32
+	storeWidthInBytes byte
 }
 
 func (ma *MemoryAccessStage) GetMemoryAccessValuesOut() MemoryAccessValues {
@@ -191,5 +229,12 @@ func (ma *MemoryAccessStage) GetMemoryAccessValuesOut() MemoryAccessValues {
 		writeBackValid: ma.writeBackValueValid.GetN(),
 		writeBackValue: ma.writeBackValue.GetN(),
 		rd:             ma.rd.GetN(),
+
+		pc:                ma.pc.GetN(),
+		instruction:       ma.instruction.GetN(),
+		storeValid:        ma.storeValid.GetN(),
+		storeAddress:      ma.storeAddress.GetN(),
+		storeValue:        ma.storeValue.GetN(),
+		storeWidthInBytes: ma.storeWidthInBytes.GetN(),
 	}
 }
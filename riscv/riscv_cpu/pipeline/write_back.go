@@ -2,6 +2,7 @@ package pipeline
 
 import (
 	"fmt"
+	"io"
 	. "riscv/system_interface"
 )
 
@@ -23,6 +24,8 @@ type WriteBackStage struct {
 	regFile                 *[32]RUint32
 	shouldStall             func() bool
 	getMemoryAccessValuesIn func() MemoryAccessValues
+
+	trace io.Writer
 }
 
 func NewWriteBackStage(params *WriteBackParams) *WriteBackStage {
@@ -51,7 +54,34 @@ func (wb *WriteBackStage) Compute() {
 				fmt.Print(" (discarded)\n")
 			}
 		}
+
+		if wb.trace != nil {
+			wb.writeCommitTrace(mv)
+		}
+	}
+}
+
+// SetTrace makes write-back log every retired instruction to w, nil to stop.
+func (wb *WriteBackStage) SetTrace(w io.Writer) {
+	wb.trace = w
+}
+
+// Commit trace line, the same format as tinyRiscVTrapEmulator's `--trace`
+// so the two models can be compared with its tracediff tool:
+//
+//	<pc> (<insn>)[ x<rd> <value>][ mem <addr> <value>]
+//
+// Numbers are 0x-prefixed lowercase hex, 8 digits wide except the store
+// value, which has two digits per byte stored. Writes to x0 are not listed.
+func (wb *WriteBackStage) writeCommitTrace(mv MemoryAccessValues) {
+	line := fmt.Sprintf("0x%08x (0x%08x)", mv.pc, mv.instruction)
+	if mv.writeBackValid && mv.rd != 0 {
+		line += fmt.Sprintf(" x%d 0x%08x", mv.rd, mv.writeBackValue)
+	}
+	if mv.storeValid {
+		line += fmt.Sprintf(" mem 0x%08x 0x%0*x", mv.storeAddress, int(mv.storeWidthInBytes)*2, mv.storeValue)
 	}
+	fmt.Fprintln(wb.trace, line)
 }
 
 func (wb *WriteBackStage) LatchNext() {
@@ -0,0 +1,205 @@
+#define _DEFAULT_SOURCE // sysconf(_SC_NPROCESSORS_ONLN) on glibc
+#include "batch.h"
+#include "emulator.h"
+#include "fpu.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef enum {
+  RESULT_PASS,
+  RESULT_FAIL,    // the program reported failure
+  RESULT_TIMEOUT, // instruction budget exhausted
+  RESULT_ERROR,   // could not load, or stopped on a fault
+} ResultKind;
+
+static const char *result_names[] = {"PASS", "FAIL", "TIMEOUT", "ERROR"};
+
+typedef struct {
+  ResultKind kind;
+  char detail[64];
+  uint64_t instret;
+  double seconds; // wall time of the run, load excluded
+} BatchResult;
+
+typedef struct {
+  int nfiles;
+  char **files;
+  const BatchOptions *opt;
+  BatchResult *results;
+  atomic_int next; // index of the next program to hand out
+} BatchQueue;
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* `quiet` points the guest's console (or stdin/stdout/stderr) at nothing. */
+static bool load_program(Emulator *emu, char *path, const ElfInfo *probe,
+                         bool quiet) {
+  if (probe->tohost) {
+    Machine virt;
+    ElfInfo info;
+    if (!machine_load(&virt, "virt") || !emu_init_machine(emu, &virt))
+      return false;
+    if (quiet)
+      emu->console = NULL;
+    if (!elf_load(emu, path, &info))
+      return false;
+    emu->tohost = info.tohost;
+    emu->cpu.xlen = info.xlen;
+    emu->cpu.pc = info.entry;
+    return true;
+  }
+
+  char *argv[] = {path, NULL};
+  char *envp[] = {NULL};
+  if (!emu_init(emu, 0, PK_DRAM_SIZE))
+    return false;
+  if (!pk_load(emu, 1, argv, envp))
+    return false;
+  // One /dev/null each: the guest may close them, and pk_close_all does
+  for (int fd = 0; quiet && fd < 3; fd++)
+    emu->pk.fds[fd] = open("/dev/null", O_RDWR);
+  return true;
+}
+
+static void run_one(char *path, const BatchOptions *opt, BatchResult *r) {
+  memset(r, 0, sizeof(*r));
+  r->kind = RESULT_ERROR;
+
+  ElfInfo probe;
+  if (!elf_probe(path, &probe)) {
+    snprintf(r->detail, sizeof(r->detail), "not a loadable ELF");
+    return;
+  }
+
+  Emulator *emu = malloc(sizeof(Emulator)); // too big for a thread stack
+  if (!emu) {
+    snprintf(r->detail, sizeof(r->detail), "out of memory");
+    return;
+  }
+  if (!load_program(emu, path, &probe, !opt->verbose)) {
+    snprintf(r->detail, sizeof(r->detail), "load failed");
+    goto out;
+  }
+
+  uint64_t limit = opt->max_insns ? opt->max_insns : UINT64_MAX;
+  bool running = true;
+  double start = now();
+  fp_enter(&emu->cpu);
+  while (running && emu->cpu.instret < limit)
+    running = emu_step(emu);
+  fp_leave(&emu->cpu);
+  r->seconds = now() - start;
+  r->instret = emu->cpu.instret;
+
+  if (emu->tohost_value) {
+    r->kind = emu->tohost_value == 1 ? RESULT_PASS : RESULT_FAIL;
+    if (r->kind == RESULT_FAIL)
+      snprintf(r->detail, sizeof(r->detail), "test case %llu",
+               emu->tohost_value >> 1);
+  } else if (emu->pk.exited) {
+    r->kind = emu->pk.exit_code == 0 ? RESULT_PASS : RESULT_FAIL;
+    if (r->kind == RESULT_FAIL)
+      snprintf(r->detail, sizeof(r->detail), "exit status %d",
+               emu->pk.exit_code);
+  } else if (running) {
+    r->kind = RESULT_TIMEOUT;
+    snprintf(r->detail, sizeof(r->detail), "pc=%llx", emu->cpu.pc);
+  } else {
+    snprintf(r->detail, sizeof(r->detail), "stopped at pc=%llx",
+             emu->cpu.pc);
+  }
+
+  if (emu->pk.enabled)
+    pk_close_all(emu);
+out:
+  emu_free(emu);
+  free(emu);
+}
+
+static void *worker(void *arg) {
+  BatchQueue *q = arg;
+  for (;;) {
+    int i = atomic_fetch_add(&q->next, 1);
+    if (i >= q->nfiles)
+      return NULL;
+    run_one(q->files[i], q->opt, &q->results[i]);
+  }
+}
+
+static void write_report(const char *path, int nfiles, char **files,
+                         const BatchResult *results) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    perror(path);
+    return;
+  }
+  fprintf(f, "program,result,detail,instret,seconds,mips\n");
+  for (int i = 0; i < nfiles; i++) {
+    const BatchResult *r = &results[i];
+    fprintf(f, "%s,%s,%s,%llu,%.6f,%.2f\n", files[i], result_names[r->kind],
+            r->detail, r->instret, r->seconds,
+            r->seconds > 0 ? r->instret / r->seconds / 1e6 : 0.0);
+  }
+  fclose(f);
+}
+
+int batch_run(int nfiles, char **files, const BatchOptions *opt) {
+  BatchResult *results = calloc(nfiles, sizeof(BatchResult));
+  if (!results)
+    return nfiles;
+
+  int jobs = opt->jobs > 0 ? opt->jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs < 1)
+    jobs = 1;
+  if (jobs > nfiles)
+    jobs = nfiles;
+
+  BatchQueue q = {.nfiles = nfiles, .files = files, .opt = opt,
+                  .results = results};
+  atomic_init(&q.next, 0);
+
+  double start = now();
+  pthread_t threads[jobs];
+  int started = 0;
+  for (; started < jobs; started++) {
+    if (pthread_create(&threads[started], NULL, worker, &q) != 0)
+      break;
+  }
+  if (started == 0)
+    worker(&q); // no threads available: run everything here
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  double wall = now() - start;
+
+  int counts[4] = {0};
+  uint64_t total_insns = 0;
+  for (int i = 0; i < nfiles; i++) {
+    const BatchResult *r = &results[i];
+    counts[r->kind]++;
+    total_insns += r->instret;
+    printf("%-7s %-40s %12llu insns %9.3f ms  %s\n", result_names[r->kind],
+           files[i], r->instret, r->seconds * 1e3, r->detail);
+  }
+  printf("\n%d programs: %d passed, %d failed, %d timed out, %d errors\n",
+         nfiles, counts[RESULT_PASS], counts[RESULT_FAIL],
+         counts[RESULT_TIMEOUT], counts[RESULT_ERROR]);
+  printf("%llu instructions in %.3f s on %d threads (%.1f MIPS aggregate)\n",
+         total_insns, wall, started ? started : 1,
+         wall > 0 ? total_insns / wall / 1e6 : 0.0);
+
+  if (opt->report)
+    write_report(opt->report, nfiles, files, results);
+
+  free(results);
+  return nfiles - counts[RESULT_PASS];
+}
@@ -0,0 +1,28 @@
+#ifndef BATCH_H
+#define BATCH_H
+#include <stdint.h>
+
+/*
+ * Batch runner.
+ *
+ * Runs a list of guest programs, each in its own Emulator, on a pool of host
+ * threads. Emulator instances share nothing, so tests scale with cores.
+ *
+ * Pass/fail comes from the program itself:
+ *   - ELF with a `tohost` symbol (riscv-tests, bare-metal firmware): boots
+ *     in M-mode on the "virt" machine profile (bus.h); the first nonzero
+ *     store to `tohost` ends the run, 1 = pass, (n << 1) | 1 = test case n
+ *     failed. The syscon test finisher reports the same way.
+ *   - anything else runs under the proxy kernel; exit status 0 = pass.
+ */
+typedef struct {
+  int jobs;             // worker threads, 0 = one per online CPU
+  uint64_t max_insns;   // per-program instruction budget, 0 = unlimited
+  const char *report;   // CSV report path, or NULL
+  bool verbose;         // let guest console output through
+} BatchOptions;
+
+/* Returns the number of programs that did not pass. */
+int batch_run(int nfiles, char **files, const BatchOptions *opt);
+
+#endif // BATCH_H
@@ -0,0 +1,311 @@
+#include "bus.h"
+#include "emulator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const struct {
+  const char *name;
+  const char *text;
+} builtin_profiles[] = {
+    {"virt", "ram      0x80000000 0x8000000\n"
+             "uart     0x10000000\n"
+             "syscon   0x100000\n"
+             "plic     0x0c000000\n"
+             "virtio_blk 0x10001000 1\n"},
+    {"riscv_cpu", "rom      0x10000000 0x100000\n"
+                  "ram      0x20000000 0x400000\n"
+                  "reset_pc 0x10000000\n"
+                  "unmapped zero\n"},
+};
+
+#define UART_SIZE 0x100
+#define SYSCON_SIZE 0x1000
+
+// 16550 registers we model
+#define UART_THR 0 // transmit holding (write) / receive buffer (read)
+#define UART_LSR 5 // line status
+#define UART_LSR_DR 0x01
+#define UART_LSR_THRE 0x20
+#define UART_LSR_TEMT 0x40
+
+// sifive_test finisher values
+#define SYSCON_PASS 0x5555
+#define SYSCON_FAIL 0x3333
+
+// ============================================================================
+// Profile parsing
+// ============================================================================
+
+static bool parse_u64(const char *tok, uint64_t *out) {
+  char *end;
+  if (!tok)
+    return false;
+  *out = strtoull(tok, &end, 0);
+  return *end == '\0';
+}
+
+static bool add_region(Machine *m, RegionKind kind, uint64_t base,
+                       uint64_t size) {
+  if (m->nregions == BUS_MAX_REGIONS)
+    return false;
+  m->regions[m->nregions++] = (Region){.kind = kind, .base = base, .size = size};
+  return true;
+}
+
+static bool has_region(const Machine *m, RegionKind kind) {
+  for (int i = 0; i < m->nregions; i++)
+    if (m->regions[i].kind == kind)
+      return true;
+  return false;
+}
+
+static bool parse_line(Machine *m, char *line) {
+  char *hash = strchr(line, '#');
+  if (hash)
+    *hash = '\0';
+
+  const char *sep = " \t\r\n";
+  char *key = strtok(line, sep);
+  if (!key)
+    return true; // blank line
+  char *a = strtok(NULL, sep);
+  char *b = strtok(NULL, sep);
+  uint64_t base, size;
+
+  if (strcmp(key, "ram") == 0) {
+    if (m->ram_size || !parse_u64(a, &m->ram_base) ||
+        !parse_u64(b, &m->ram_size) || m->ram_size == 0)
+      return false;
+    return true;
+  }
+  if (strcmp(key, "rom") == 0)
+    return parse_u64(a, &base) && parse_u64(b, &size) && size &&
+           add_region(m, REGION_ROM, base, size);
+  if (strcmp(key, "uart") == 0)
+    return parse_u64(a, &base) && add_region(m, REGION_UART, base, UART_SIZE);
+  if (strcmp(key, "syscon") == 0)
+    return parse_u64(a, &base) &&
+           add_region(m, REGION_SYSCON, base, SYSCON_SIZE);
+  if (strcmp(key, "plic") == 0)
+    return parse_u64(a, &base) && !has_region(m, REGION_PLIC) &&
+           add_region(m, REGION_PLIC, base, PLIC_SIZE);
+  if (strcmp(key, "virtio_blk") == 0) {
+    uint64_t irq;
+    if (!parse_u64(a, &base) || !parse_u64(b, &irq) || irq == 0 ||
+        irq >= PLIC_SOURCES || has_region(m, REGION_VIRTIO_BLK))
+      return false;
+    m->blk.irq = (int)irq;
+    return add_region(m, REGION_VIRTIO_BLK, base, VIRTIO_MMIO_SIZE);
+  }
+  if (strcmp(key, "reset_pc") == 0)
+    return parse_u64(a, &m->reset_pc);
+  if (strcmp(key, "unmapped") == 0 && a) {
+    if (strcmp(a, "zero") == 0)
+      m->unmapped_zero = true;
+    else if (strcmp(a, "fault") == 0)
+      m->unmapped_zero = false;
+    else
+      return false;
+    return true;
+  }
+  return false;
+}
+
+static bool overlaps(uint64_t a, uint64_t alen, uint64_t b, uint64_t blen) {
+  return a < b + blen && b < a + alen;
+}
+
+static bool parse_profile(Machine *m, const char *text, const char *origin) {
+  int lineno = 0;
+  while (*text) {
+    const char *nl = strchr(text, '\n');
+    size_t len = nl ? (size_t)(nl - text) : strlen(text);
+    char line[256];
+    lineno++;
+    if (len >= sizeof(line)) {
+      fprintf(stderr, "%s:%d: line too long\n", origin, lineno);
+      return false;
+    }
+    memcpy(line, text, len);
+    line[len] = '\0';
+    if (!parse_line(m, line)) {
+      fprintf(stderr, "%s:%d: bad directive\n", origin, lineno);
+      return false;
+    }
+    text += nl ? len + 1 : len;
+  }
+
+  if (m->ram_size == 0) {
+    fprintf(stderr, "%s: no ram region\n", origin);
+    return false;
+  }
+  for (int i = 0; i < m->nregions; i++) {
+    const Region *r = &m->regions[i];
+    bool clash = overlaps(r->base, r->size, m->ram_base, m->ram_size);
+    for (int j = 0; j < i; j++)
+      clash |= overlaps(r->base, r->size, m->regions[j].base,
+                        m->regions[j].size);
+    if (clash) {
+      fprintf(stderr, "%s: region at %llx overlaps another\n", origin,
+              r->base);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool machine_load(Machine *m, const char *name_or_path) {
+  memset(m, 0, sizeof(*m));
+  snprintf(m->name, sizeof(m->name), "%s", name_or_path);
+
+  for (size_t i = 0; i < sizeof(builtin_profiles) / sizeof(builtin_profiles[0]);
+       i++) {
+    if (strcmp(builtin_profiles[i].name, name_or_path) == 0)
+      return parse_profile(m, builtin_profiles[i].text, name_or_path);
+  }
+
+  FILE *f = fopen(name_or_path, "r");
+  if (!f) {
+    fprintf(stderr, "%s: not a built-in profile (virt, riscv_cpu) or a "
+                    "readable file\n",
+            name_or_path);
+    return false;
+  }
+  char text[4096];
+  size_t n = fread(text, 1, sizeof(text) - 1, f);
+  fclose(f);
+  text[n] = '\0';
+  return parse_profile(m, text, name_or_path);
+}
+
+// ============================================================================
+// Mapping
+// ============================================================================
+
+bool emu_init_machine(Emulator *emu, const Machine *m) {
+  if (!emu_init(emu, m->ram_base, m->ram_size))
+    return false;
+  emu->machine = *m;
+  emu->console = stdout;
+
+  for (int i = 0; i < m->nregions; i++) {
+    Region *r = &emu->machine.regions[i];
+    if (r->kind != REGION_ROM)
+      continue;
+    r->mem = calloc(r->size, 1);
+    if (!r->mem) {
+      emu_free(emu);
+      return false;
+    }
+  }
+
+  emu->cpu.pc = m->reset_pc;
+  emu->cpu.mode = MODE_MACHINE; // bare metal boots in M-mode
+  return true;
+}
+
+void bus_free(Emulator *emu) {
+  virtio_blk_detach(emu);
+  for (int i = 0; i < emu->machine.nregions; i++) {
+    free(emu->machine.regions[i].mem);
+    emu->machine.regions[i].mem = NULL;
+  }
+}
+
+static Region *find_region(Emulator *emu, uint64_t addr, int size) {
+  for (int i = 0; i < emu->machine.nregions; i++) {
+    Region *r = &emu->machine.regions[i];
+    if (addr - r->base < r->size && addr + size - r->base <= r->size)
+      return r;
+  }
+  return NULL;
+}
+
+uint8_t *bus_rom_ptr(Emulator *emu, uint64_t addr, uint64_t len) {
+  Region *r = find_region(emu, addr, len);
+  return r && r->kind == REGION_ROM ? r->mem + (addr - r->base) : NULL;
+}
+
+// ============================================================================
+// Devices
+// ============================================================================
+
+/* Fill the receive buffer from the console (or the replay log). */
+static bool uart_rx_ready(Emulator *emu) {
+  uint8_t byte;
+  if (emu->uart_rx < 0 && replay_uart_input(emu, &byte))
+    emu->uart_rx = byte;
+  return emu->uart_rx >= 0;
+}
+
+bool bus_read(Emulator *emu, uint64_t addr, int size, uint64_t *out) {
+  Region *r = find_region(emu, addr, size);
+  *out = 0;
+  if (!r)
+    return emu->machine.unmapped_zero;
+
+  uint64_t off = addr - r->base;
+  switch (r->kind) {
+  case REGION_ROM:
+    memcpy(out, r->mem + off, size);
+    break;
+  case REGION_UART:
+    // Transmit is always ready; input arrives when the guest looks for it
+    if (off == UART_LSR) {
+      *out = UART_LSR_THRE | UART_LSR_TEMT;
+      if (uart_rx_ready(emu))
+        *out |= UART_LSR_DR;
+    } else if (off == UART_THR && uart_rx_ready(emu)) {
+      *out = emu->uart_rx;
+      emu->uart_rx = -1;
+    }
+    break;
+  case REGION_SYSCON:
+    break;
+  // 32-bit registers; a 64-bit read takes two
+  case REGION_PLIC:
+    *out = plic_read(emu, off);
+    if (size == 8)
+      *out |= (uint64_t)plic_read(emu, off + 4) << 32;
+    break;
+  case REGION_VIRTIO_BLK:
+    *out = virtio_blk_read(emu, off);
+    if (size == 8)
+      *out |= (uint64_t)virtio_blk_read(emu, off + 4) << 32;
+    break;
+  }
+  return true;
+}
+
+bool bus_write(Emulator *emu, uint64_t addr, int size, uint64_t val) {
+  Region *r = find_region(emu, addr, size);
+  if (!r)
+    return emu->machine.unmapped_zero;
+
+  uint64_t off = addr - r->base;
+  switch (r->kind) {
+  case REGION_ROM:
+    break; // read-only, like the Go model's ROM
+  case REGION_UART:
+    if (off == UART_THR && emu->console)
+      fputc((int)(val & 0xFF), emu->console);
+    break;
+  case REGION_SYSCON:
+    // Report through the same signature as tohost
+    if (off == 0 && (val & 0xFFFF) == SYSCON_PASS)
+      emu->tohost_value = 1;
+    else if (off == 0 && (val & 0xFFFF) == SYSCON_FAIL) {
+      uint64_t code = (val >> 16) & 0xFFFF;
+      emu->tohost_value = ((code ? code : 1) << 1) | 1;
+    }
+    break;
+  case REGION_PLIC:
+    plic_write(emu, off, (uint32_t)val);
+    break;
+  case REGION_VIRTIO_BLK:
+    virtio_blk_write(emu, off, (uint32_t)val);
+    break;
+  }
+  return true;
+}
@@ -0,0 +1,87 @@
+#ifndef BUS_H
+#define BUS_H
+#include "plic.h"
+#include "virtio_blk.h"
+#include <stdint.h>
+
+struct Emulator;
+
+/*
+ * Machine profiles.
+ *
+ * A profile describes what sits on the bus besides main RAM: ROMs, devices,
+ * where the CPU starts and what happens on an access to nothing. Profiles
+ * are small text files, one directive per line ('#' starts a comment):
+ *
+ *   ram      <base> <size>   main RAM (exactly one)
+ *   rom      <base> <size>   read-only, writes are ignored; ELF segments
+ *                            may be loaded into it
+ *   uart     <base>          16550-style console on stdout / stdin
+ *   syscon   <base>          test finisher: 0x5555 = pass,
+ *                            (code << 16) | 0x3333 = fail
+ *   plic     <base>          interrupt controller (plic.h, at most one)
+ *   virtio_blk <base> <irq>  virtio-mmio disk on PLIC source <irq>
+ *                            (virtio_blk.h, at most one; the image is
+ *                            given with --disk)
+ *   reset_pc <addr>          default: the ELF entry point
+ *   unmapped zero|fault      unmapped reads return 0 and writes are
+ *                            dropped, or the access faults (default)
+ *
+ * Two profiles are built in: "virt" (QEMU virt-like: RAM at 0x80000000, the
+ * PLIC at 0x0c000000, a virtio disk at 0x10001000 on source 1) and
+ * "riscv_cpu" (the Go riscv_cpu model: ROM at 0x10000000, RAM at
+ * 0x20000000, unmapped memory reads as 0 so running off the end of the
+ * program fetches the all-zero halt instruction).
+ *
+ * RAM accesses take the emulator's fast path; everything here is only
+ * consulted when an address misses RAM.
+ */
+#define BUS_MAX_REGIONS 8
+
+typedef enum {
+  REGION_ROM,
+  REGION_UART,
+  REGION_SYSCON,
+  REGION_PLIC,
+  REGION_VIRTIO_BLK
+} RegionKind;
+
+typedef struct {
+  RegionKind kind;
+  uint64_t base;
+  uint64_t size;
+  uint8_t *mem; // REGION_ROM backing store
+} Region;
+
+typedef struct {
+  char name[32];
+  uint64_t ram_base;
+  uint64_t ram_size;
+  uint64_t reset_pc; // 0: use the ELF entry point
+  bool unmapped_zero;
+  int nregions;
+  Region regions[BUS_MAX_REGIONS];
+
+  // Device state, guest-visible only, so a snapshot can copy it
+  Plic plic;
+  VirtioBlk blk;
+} Machine;
+
+/* Load a built-in profile by name, or else a profile file by path. */
+bool machine_load(Machine *m, const char *name_or_path);
+
+/* Map a profile: RAM, ROM backing stores, reset state. */
+bool emu_init_machine(struct Emulator *emu, const Machine *m);
+void bus_free(struct Emulator *emu);
+
+/*
+ * Slow path for accesses that miss RAM. Return false on an access fault;
+ * bus_write also returns false when a device stops the machine.
+ */
+bool bus_read(struct Emulator *emu, uint64_t addr, int size, uint64_t *out);
+bool bus_write(struct Emulator *emu, uint64_t addr, int size, uint64_t val);
+
+/* Host pointer into a ROM region for fetch or loading, or NULL. */
+uint8_t *bus_rom_ptr(struct Emulator *emu, uint64_t addr, uint64_t len);
+
+#endif // BUS_H
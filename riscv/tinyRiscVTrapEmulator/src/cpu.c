@@ -1,20 +1,28 @@
 #include "cpu.h"
+#include "fpu.h"
 #include <stdio.h>
 #include <string.h>
 
 void cpu_init(CPU *cpu) {
   memset(cpu, 0, sizeof(*cpu));
   cpu->pc = 0;
+  cpu->xlen = 64;
   cpu->mode = MODE_USER;
   cpu->stvec = 0;
 }
 
 const char *scause_to_str(uint64_t scause) {
   switch (scause) {
+  case 2:
+    return "Illegal instruction";
+  case 3:
+    return "Breakpoint";
   case 8:
     return "ECALL from U-mode";
   case 9:
     return "ECALL from S-mode";
+  case 11:
+    return "ECALL from M-mode";
   default:
     return "UNKNOWN";
   }
@@ -23,7 +31,9 @@ const char *scause_to_str(uint64_t scause) {
 void cpu_dump(const CPU *cpu) {
   printf("CPU State:\n");
   printf("  PC: %016llx  Mode: %s\n", cpu->pc,
-         cpu->mode == MODE_USER ? "USER" : "SUPERVISOR");
+         cpu->mode == MODE_USER         ? "USER"
+         : cpu->mode == MODE_SUPERVISOR ? "SUPERVISOR"
+                                        : "MACHINE");
 
   printf("  Registers:\n");
   for (int i = 0; i < 32; i += 4) {
@@ -42,5 +52,265 @@ void cpu_dump(const CPU *cpu) {
   printf("    stvec:   %016llx (Trap Vector Base)\n", cpu->stvec);
   printf("    sepc:    %016llx (Exception PC)\n", cpu->sepc);
   printf("    scause:  %016llx (Trap Cause)\n", cpu->scause);
-  printf("    sstatus: %016llx (Status)\n", cpu->sstatus);
+  printf("    sstatus: %016llx (Status)\n", cpu->mstatus & SSTATUS_MASK);
+}
+
+// ============================================================================
+// CSRs
+// ============================================================================
+
+#define MISA_RV32 (1ULL << 30)
+#define MISA_RV64 (2ULL << 62)
+#define MISA_EXT(c) (1ULL << ((c) - 'A'))
+
+// UXL = SXL = 64-bit, read-only
+#define MSTATUS_XL (2ULL << 32 | 2ULL << 34)
+#define MSTATUS_WRITABLE                                                       \
+  (MSTATUS_SIE | MSTATUS_MIE | MSTATUS_SPIE | MSTATUS_MPIE | MSTATUS_SPP |     \
+   MSTATUS_MPP | MSTATUS_FS | (1ULL << 18) /* SUM */ |                     \
+   (1ULL << 19) /* MXR */)
+
+// Software may only set the S-level soft and timer bits; the external
+// interrupt bits follow the PLIC
+#define MIP_WRITABLE (MIP_SSIP | MIP_STIP)
+
+// SD summarizes a dirty FS in the top bit
+static uint64_t read_mstatus(const CPU *cpu) {
+  bool sd = (cpu->mstatus & MSTATUS_FS) == MSTATUS_FS;
+  if (cpu->xlen == 64)
+    return cpu->mstatus | MSTATUS_XL | (uint64_t)sd << 63;
+  return cpu->mstatus | (uint64_t)sd << 31;
+}
+
+static void write_mstatus(CPU *cpu, uint64_t val) {
+  val &= MSTATUS_WRITABLE;
+  if (((val & MSTATUS_MPP) >> MSTATUS_MPP_SHIFT) == 2) // reserved mode
+    val &= ~MSTATUS_MPP;
+  cpu->mstatus = val;
+}
+
+bool csr_read(CPU *cpu, uint16_t csr, uint64_t *out) {
+  if (((csr >> 8) & 3) > cpu->mode)
+    return false;
+
+  // PMP registers exist so boot code can program them, but do nothing
+  if (csr >= 0x3A0 && csr <= 0x3EF) {
+    *out = 0;
+    return true;
+  }
+
+  switch (csr) {
+  case 0x001:
+  case 0x002:
+  case 0x003:
+    if (!fp_enabled(cpu))
+      return false;
+    *out = fp_read_fcsr(cpu);
+    if (csr == 0x001)
+      *out &= FFLAGS_MASK;
+    else if (csr == 0x002)
+      *out >>= FRM_SHIFT;
+    break;
+
+  case 0x100:
+    *out = read_mstatus(cpu) & (SSTATUS_MASK | (1ULL << 31)); // + RV32 SD
+    break;
+  case 0x104: *out = cpu->mie & cpu->mideleg; break;
+  case 0x105: *out = cpu->stvec; break;
+  case 0x106: *out = 0; break; // scounteren
+  case 0x140: *out = cpu->sscratch; break;
+  case 0x141: *out = cpu->sepc; break;
+  case 0x142: *out = cpu->scause; break;
+  case 0x143: *out = cpu->stval; break;
+  case 0x144: *out = cpu->mip & cpu->mideleg; break;
+  case 0x180: *out = cpu->satp; break;
+
+  case 0x300: *out = read_mstatus(cpu); break;
+  case 0x301:
+    *out = (cpu->xlen == 64 ? MISA_RV64 : MISA_RV32) | MISA_EXT('I') |
+           MISA_EXT('M') | MISA_EXT('A') | MISA_EXT('C') | MISA_EXT('F') |
+           MISA_EXT('D') | MISA_EXT('S') | MISA_EXT('U');
+    break;
+  case 0x302: *out = cpu->medeleg; break;
+  case 0x303: *out = cpu->mideleg; break;
+  case 0x304: *out = cpu->mie; break;
+  case 0x305: *out = cpu->mtvec; break;
+  case 0x306: *out = 0; break; // mcounteren
+  case 0x340: *out = cpu->mscratch; break;
+  case 0x341: *out = cpu->mepc; break;
+  case 0x342: *out = cpu->mcause; break;
+  case 0x343: *out = cpu->mtval; break;
+  case 0x344: *out = cpu->mip; break;
+
+  // No timer yet: cycle and time both count retired instructions
+  case 0xB00: case 0xB02:
+  case 0xC00: case 0xC01: case 0xC02: *out = cpu->instret; break;
+  case 0xB80: case 0xB82: // RV32 upper halves
+  case 0xC80: case 0xC81: case 0xC82:
+    if (cpu->xlen != 32)
+      return false;
+    *out = cpu->instret >> 32;
+    break;
+
+  case 0xF11: case 0xF12: case 0xF13: // mvendorid, marchid, mimpid
+  case 0xF14: *out = 0; break;        // mhartid
+  default: return false;
+  }
+  return true;
+}
+
+bool csr_write(CPU *cpu, uint16_t csr, uint64_t val) {
+  if (((csr >> 8) & 3) > cpu->mode || (csr >> 10) == 3) // read-only
+    return false;
+  if (csr >= 0x3A0 && csr <= 0x3EF)
+    return true;
+
+  switch (csr) {
+  case 0x001:
+  case 0x002:
+  case 0x003: {
+    if (!fp_enabled(cpu))
+      return false;
+    uint32_t fcsr = fp_read_fcsr(cpu);
+    if (csr == 0x001)
+      fcsr = (fcsr & ~FFLAGS_MASK) | (val & FFLAGS_MASK);
+    else if (csr == 0x002)
+      fcsr = (fcsr & FFLAGS_MASK) | (val & 7) << FRM_SHIFT;
+    else
+      fcsr = val;
+    fp_write_fcsr(cpu, fcsr);
+    break;
+  }
+
+  case 0x100:
+    write_mstatus(cpu, (cpu->mstatus & ~SSTATUS_MASK) | (val & SSTATUS_MASK));
+    break;
+  case 0x104: cpu->mie = (cpu->mie & ~cpu->mideleg) | (val & cpu->mideleg); break;
+  case 0x105: cpu->stvec = val & ~3ULL; break; // direct mode only
+  case 0x106: break;
+  case 0x140: cpu->sscratch = val; break;
+  case 0x141: cpu->sepc = val & ~1ULL; break;
+  case 0x142: cpu->scause = val; break;
+  case 0x143: cpu->stval = val; break;
+  case 0x144: {
+    uint64_t mask = cpu->mideleg & MIP_SSIP;
+    cpu->mip = (cpu->mip & ~mask) | (val & mask);
+    break;
+  }
+  case 0x180: cpu->satp = 0; break; // no MMU: only Bare is supported
+
+  case 0x300: write_mstatus(cpu, val); break;
+  case 0x301: break; // misa is fixed
+  case 0x302: cpu->medeleg = val & ~(1ULL << CAUSE_ECALL_M); break;
+  case 0x303: cpu->mideleg = val; break;
+  case 0x304: cpu->mie = val; break;
+  case 0x305: cpu->mtvec = val & ~3ULL; break;
+  case 0x306: break;
+  case 0x340: cpu->mscratch = val; break;
+  case 0x341: cpu->mepc = val & ~1ULL; break;
+  case 0x342: cpu->mcause = val; break;
+  case 0x343: cpu->mtval = val; break;
+  case 0x344:
+    cpu->mip = (cpu->mip & ~MIP_WRITABLE) | (val & MIP_WRITABLE);
+    break;
+  case 0xB00: case 0xB02:
+    cpu->instret = cpu->xlen == 32
+                       ? (cpu->instret & ~0xFFFFFFFFULL) | (uint32_t)val
+                       : val;
+    break;
+  case 0xB80: case 0xB82:
+    if (cpu->xlen != 32)
+      return false;
+    cpu->instret = (cpu->instret & 0xFFFFFFFFULL) | (uint64_t)val << 32;
+    break;
+  default: return false;
+  }
+  return true;
+}
+
+// ============================================================================
+// Traps
+// ============================================================================
+
+static bool take_trap(CPU *cpu, uint64_t cause, uint64_t tval, bool to_s) {
+  uint64_t tvec = to_s ? cpu->stvec : cpu->mtvec;
+  if (!tvec)
+    return false;
+
+  uint64_t st = cpu->mstatus;
+  if (to_s) {
+    cpu->sepc = cpu->pc;
+    cpu->scause = cause;
+    cpu->stval = tval;
+    st &= ~(MSTATUS_SPIE | MSTATUS_SIE | MSTATUS_SPP);
+    if (cpu->mstatus & MSTATUS_SIE)
+      st |= MSTATUS_SPIE;
+    if (cpu->mode == MODE_SUPERVISOR)
+      st |= MSTATUS_SPP;
+    cpu->mode = MODE_SUPERVISOR;
+  } else {
+    cpu->mepc = cpu->pc;
+    cpu->mcause = cause;
+    cpu->mtval = tval;
+    st &= ~(MSTATUS_MPIE | MSTATUS_MIE | MSTATUS_MPP);
+    if (cpu->mstatus & MSTATUS_MIE)
+      st |= MSTATUS_MPIE;
+    st |= (uint64_t)cpu->mode << MSTATUS_MPP_SHIFT;
+    cpu->mode = MODE_MACHINE;
+  }
+  cpu->mstatus = st;
+  cpu->pc = tvec;
+  return true;
+}
+
+bool cpu_trap(CPU *cpu, uint64_t cause, uint64_t tval) {
+  bool to_s = cpu->mode <= MODE_SUPERVISOR && ((cpu->medeleg >> cause) & 1);
+  return take_trap(cpu, cause, tval, to_s);
+}
+
+// Highest priority first
+static const int irq_priority[] = {IRQ_M_EXT, IRQ_M_SOFT, IRQ_M_TIMER,
+                                   IRQ_S_EXT, IRQ_S_SOFT, IRQ_S_TIMER};
+
+bool cpu_interrupt(CPU *cpu) {
+  uint64_t pending = cpu->mip & cpu->mie;
+  // M-level interrupts are always on below M-mode, in M-mode with MIE.
+  // Delegated ones likewise for S-mode and SIE, and never interrupt M-mode.
+  bool m_on = cpu->mode < MODE_MACHINE || (cpu->mstatus & MSTATUS_MIE);
+  bool s_on = cpu->mode < MODE_SUPERVISOR ||
+              (cpu->mode == MODE_SUPERVISOR && (cpu->mstatus & MSTATUS_SIE));
+  uint64_t enabled = (m_on ? pending & ~cpu->mideleg : 0) |
+                     (s_on ? pending & cpu->mideleg : 0);
+  if (!enabled)
+    return false;
+
+  uint64_t flag = cpu->xlen == 32 ? 1ULL << 31 : 1ULL << 63;
+  for (size_t i = 0; i < sizeof(irq_priority) / sizeof(irq_priority[0]); i++) {
+    int irq = irq_priority[i];
+    if ((enabled >> irq) & 1)
+      return take_trap(cpu, flag | irq, 0, (cpu->mideleg >> irq) & 1);
+  }
+  return false;
+}
+
+void cpu_mret(CPU *cpu) {
+  uint64_t st = cpu->mstatus;
+  cpu->mode = (st & MSTATUS_MPP) >> MSTATUS_MPP_SHIFT;
+  st &= ~(MSTATUS_MIE | MSTATUS_MPP);
+  if (st & MSTATUS_MPIE)
+    st |= MSTATUS_MIE;
+  st |= MSTATUS_MPIE;
+  cpu->mstatus = st;
+  cpu->pc = cpu->mepc;
+}
+
+void cpu_sret(CPU *cpu) {
+  uint64_t st = cpu->mstatus;
+  cpu->mode = (st & MSTATUS_SPP) ? MODE_SUPERVISOR : MODE_USER;
+  st &= ~(MSTATUS_SIE | MSTATUS_SPP);
+  if (st & MSTATUS_SPIE)
+    st |= MSTATUS_SIE;
+  st |= MSTATUS_SPIE;
+  cpu->mstatus = st;
+  cpu->pc = cpu->sepc;
 }
@@ -2,16 +2,73 @@
 #define CPU_H
 #include <stdint.h>
 
-typedef enum { MODE_USER = 0, MODE_SUPERVISOR = 1 } Mode;
+typedef enum { MODE_USER = 0, MODE_SUPERVISOR = 1, MODE_MACHINE = 3 } Mode;
+
+/*
+ * Trap causes (mcause/scause). Interrupts have the top bit set.
+ */
+#define CAUSE_ILLEGAL_INSN 2
+#define CAUSE_BREAKPOINT 3
+#define CAUSE_ECALL_U 8
+#define CAUSE_ECALL_S 9
+#define CAUSE_ECALL_M 11
+
+/* Interrupt numbers: bits of mip / mie, and the cause code when taken */
+#define IRQ_S_SOFT 1
+#define IRQ_M_SOFT 3
+#define IRQ_S_TIMER 5
+#define IRQ_M_TIMER 7
+#define IRQ_S_EXT 9
+#define IRQ_M_EXT 11
+#define MIP_SSIP (1ULL << IRQ_S_SOFT)
+#define MIP_STIP (1ULL << IRQ_S_TIMER)
+#define MIP_SEIP (1ULL << IRQ_S_EXT)
+#define MIP_MEIP (1ULL << IRQ_M_EXT)
+
+/* mstatus bits; sstatus is the SSTATUS_MASK view of mstatus */
+#define MSTATUS_SIE (1ULL << 1)
+#define MSTATUS_MIE (1ULL << 3)
+#define MSTATUS_SPIE (1ULL << 5)
+#define MSTATUS_MPIE (1ULL << 7)
+#define MSTATUS_SPP (1ULL << 8)
+#define MSTATUS_MPP (3ULL << 11)
+#define MSTATUS_MPP_SHIFT 11
+#define MSTATUS_FS (3ULL << 13) // Off / Initial / Clean / Dirty
+#define MSTATUS_FS_INITIAL (1ULL << 13)
+#define SSTATUS_MASK 0x80000003000DE762ULL
 
 typedef struct {
-  uint64_t x[32];
+  uint64_t x[32]; // RV32: kept sign-extended from bit 31
   uint64_t pc;
+  int xlen;       // 32 or 64
+  uint64_t f[32]; // F/D registers, singles NaN-boxed
+  uint32_t fcsr;  // frm and fflags; see fpu.h for how flags accrue
   uint64_t stvec;
   uint64_t sepc;
   uint64_t scause;
-  uint64_t sstatus;
+  uint64_t stval;
+  uint64_t sscratch;
+  uint64_t satp;
   Mode mode;
+
+  // Machine-level CSRs (bare-metal programs such as riscv-tests boot in
+  // M-mode)
+  uint64_t mstatus;
+  uint64_t mtvec;
+  uint64_t mepc;
+  uint64_t mcause;
+  uint64_t mtval;
+  uint64_t mscratch;
+  uint64_t medeleg;
+  uint64_t mideleg;
+  uint64_t mie;
+  uint64_t mip; // MEIP / SEIP are driven by the PLIC (plic.h)
+
+  uint64_t instret; // retired instructions, also read back as cycle/time
+
+  // LR/SC reservation (single hart: any SC to the reserved address wins)
+  uint64_t reservation;
+  bool reservation_valid;
 } CPU;
 
 void cpu_init(CPU *cpu);
@@ -19,4 +76,30 @@ const char *scause_to_str(uint64_t scause);
 /* Debug helper to dump state */
 void cpu_dump(const CPU *cpu);
 
+/*
+ * CSR access from the current privilege mode. Return false when the CSR
+ * does not exist or is not accessible (an illegal instruction).
+ */
+bool csr_read(CPU *cpu, uint16_t csr, uint64_t *out);
+bool csr_write(CPU *cpu, uint16_t csr, uint64_t val);
+
+/*
+ * Take a synchronous trap: to S-mode if delegated through medeleg, M-mode
+ * otherwise. `pc` must still point at the trapping instruction. Returns
+ * false if no handler is installed (the target tvec is 0), leaving the CPU
+ * untouched.
+ */
+bool cpu_trap(CPU *cpu, uint64_t cause, uint64_t tval);
+
+/*
+ * Take the highest-priority interrupt that is pending, enabled in mie and
+ * enabled for the current mode (mstatus.MIE / SIE, delegation through
+ * mideleg). `pc` is the next instruction to run. Returns false if none is
+ * taken.
+ */
+bool cpu_interrupt(CPU *cpu);
+
+void cpu_mret(CPU *cpu);
+void cpu_sret(CPU *cpu);
+
 #endif // CPU_H
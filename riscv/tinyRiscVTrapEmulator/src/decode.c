@@ -0,0 +1,490 @@
+#include "decode.h"
+
+/*
+ * 32-bit instruction decoder.
+ *
+ * Instruction formats (bit positions):
+ *
+ *   R: | funct7 | rs2 | rs1 | funct3 | rd          | opcode |
+ *   I: | imm[11:0]    | rs1 | funct3 | rd          | opcode |
+ *   S: | imm[11:5]| rs2 | rs1 | funct3 | imm[4:0]  | opcode |
+ *   B: | imm[12|10:5] | rs2 | rs1 | funct3 | imm[4:1|11] | opcode |
+ *   U: | imm[31:12]                  | rd          | opcode |
+ *   J: | imm[20|10:1|11|19:12]       | rd          | opcode |
+ */
+
+static int64_t imm_i(uint32_t inst) { return (int32_t)inst >> 20; }
+
+static int64_t imm_s(uint32_t inst) {
+  return (int32_t)(((int32_t)(inst & 0xFE000000) >> 20) | ((inst >> 7) & 0x1F));
+}
+
+static int64_t imm_b(uint32_t inst) {
+  return (int32_t)(((int32_t)(inst & 0x80000000) >> 19) // imm[12]
+                   | ((inst & 0x80) << 4)               // imm[11]
+                   | ((inst >> 20) & 0x7E0)             // imm[10:5]
+                   | ((inst >> 7) & 0x1E));             // imm[4:1]
+}
+
+static int64_t imm_u(uint32_t inst) { return (int32_t)(inst & 0xFFFFF000); }
+
+static int64_t imm_j(uint32_t inst) {
+  return (int32_t)(((int32_t)(inst & 0x80000000) >> 11) // imm[20]
+                   | (inst & 0xFF000)                   // imm[19:12]
+                   | ((inst >> 9) & 0x800)              // imm[11]
+                   | ((inst >> 20) & 0x7FE));           // imm[10:1]
+}
+
+/* OP-FP: the op is picked by funct7 (operation and format), then funct3 or
+ * rs2 for the variants. */
+static uint8_t decode_op_fp(uint32_t funct7, uint32_t funct3, uint32_t rs2) {
+  if (funct7 == 0x20 && rs2 == 1)
+    return INSN_FCVT_S_D;
+  if (funct7 == 0x21 && rs2 == 0)
+    return INSN_FCVT_D_S;
+
+  uint32_t fmt = funct7 & 3; // 0 = S, 1 = D
+  uint8_t op = INSN_ILLEGAL;
+  if (fmt > 1)
+    return op;
+  switch (funct7 >> 2) {
+  case 0x00: op = INSN_FADD_S; break;
+  case 0x01: op = INSN_FSUB_S; break;
+  case 0x02: op = INSN_FMUL_S; break;
+  case 0x03: op = INSN_FDIV_S; break;
+  case 0x0B:
+    if (rs2 == 0)
+      op = INSN_FSQRT_S;
+    break;
+  case 0x04:
+    if (funct3 <= 2)
+      op = INSN_FSGNJ_S + funct3;
+    break;
+  case 0x05:
+    if (funct3 <= 1)
+      op = INSN_FMIN_S + funct3;
+    break;
+  case 0x14: {
+    static const uint8_t ops[3] = {INSN_FLE_S, INSN_FLT_S, INSN_FEQ_S};
+    if (funct3 <= 2)
+      op = ops[funct3];
+    break;
+  }
+  case 0x18:
+    if (rs2 <= 3)
+      op = INSN_FCVT_W_S + rs2;
+    break;
+  case 0x1A:
+    if (rs2 <= 3)
+      op = INSN_FCVT_S_W + rs2;
+    break;
+  case 0x1C:
+    if (rs2 == 0 && funct3 == 0)
+      op = INSN_FMV_X_W;
+    else if (rs2 == 0 && funct3 == 1)
+      op = INSN_FCLASS_S;
+    break;
+  case 0x1E:
+    if (rs2 == 0 && funct3 == 0)
+      op = INSN_FMV_W_X;
+    break;
+  }
+  return op != INSN_ILLEGAL && fmt ? FP_DOUBLE(op) : op;
+}
+
+static Insn decode64(uint32_t inst) {
+  Insn in = {0};
+  in.raw = inst;
+  in.len = 4;
+  in.op = INSN_ILLEGAL;
+
+  if (inst == 0) {
+    in.op = INSN_HALT;
+    return in;
+  }
+
+  uint32_t opcode = inst & 0x7F;
+  uint32_t funct3 = (inst >> 12) & 0x7;
+  uint32_t funct7 = inst >> 25;
+  in.rd = (inst >> 7) & 0x1F;
+  in.rs1 = (inst >> 15) & 0x1F;
+  in.rs2 = (inst >> 20) & 0x1F;
+
+  switch (opcode) {
+  case 0x37: // LUI
+    in.op = INSN_LUI;
+    in.imm = imm_u(inst);
+    break;
+  case 0x17: // AUIPC
+    in.op = INSN_AUIPC;
+    in.imm = imm_u(inst);
+    break;
+  case 0x6F: // JAL
+    in.op = INSN_JAL;
+    in.imm = imm_j(inst);
+    break;
+  case 0x67: // JALR
+    if (funct3 == 0) {
+      in.op = INSN_JALR;
+      in.imm = imm_i(inst);
+    }
+    break;
+  case 0x63: { // BRANCH
+    static const uint8_t ops[8] = {INSN_BEQ,     INSN_BNE,  INSN_ILLEGAL,
+                                   INSN_ILLEGAL, INSN_BLT,  INSN_BGE,
+                                   INSN_BLTU,    INSN_BGEU};
+    in.op = ops[funct3];
+    in.imm = imm_b(inst);
+    break;
+  }
+  case 0x03: { // LOAD
+    static const uint8_t ops[8] = {INSN_LB,  INSN_LH,  INSN_LW,  INSN_LD,
+                                   INSN_LBU, INSN_LHU, INSN_LWU, INSN_ILLEGAL};
+    in.op = ops[funct3];
+    in.imm = imm_i(inst);
+    break;
+  }
+  case 0x23: { // STORE
+    static const uint8_t ops[8] = {INSN_SB,      INSN_SH,      INSN_SW,
+                                   INSN_SD,      INSN_ILLEGAL, INSN_ILLEGAL,
+                                   INSN_ILLEGAL, INSN_ILLEGAL};
+    in.op = ops[funct3];
+    in.imm = imm_s(inst);
+    break;
+  }
+  case 0x13: // OP-IMM
+    in.imm = imm_i(inst);
+    switch (funct3) {
+    case 0: in.op = INSN_ADDI; break;
+    case 2: in.op = INSN_SLTI; break;
+    case 3: in.op = INSN_SLTIU; break;
+    case 4: in.op = INSN_XORI; break;
+    case 6: in.op = INSN_ORI; break;
+    case 7: in.op = INSN_ANDI; break;
+    case 1: // SLLI: 6-bit shamt on RV64
+      if ((inst >> 26) == 0) {
+        in.op = INSN_SLLI;
+        in.imm = (inst >> 20) & 0x3F;
+      }
+      break;
+    case 5: // SRLI / SRAI
+      if ((inst >> 26) == 0x00)
+        in.op = INSN_SRLI;
+      else if ((inst >> 26) == 0x10)
+        in.op = INSN_SRAI;
+      in.imm = (inst >> 20) & 0x3F;
+      break;
+    }
+    break;
+  case 0x1B: // OP-IMM-32
+    in.imm = imm_i(inst);
+    switch (funct3) {
+    case 0: in.op = INSN_ADDIW; break;
+    case 1:
+      if (funct7 == 0x00)
+        in.op = INSN_SLLIW;
+      in.imm = in.rs2;
+      break;
+    case 5:
+      if (funct7 == 0x00)
+        in.op = INSN_SRLIW;
+      else if (funct7 == 0x20)
+        in.op = INSN_SRAIW;
+      in.imm = in.rs2;
+      break;
+    }
+    break;
+  case 0x33: // OP
+    if (funct7 == 0x00) {
+      static const uint8_t ops[8] = {INSN_ADD, INSN_SLL, INSN_SLT, INSN_SLTU,
+                                     INSN_XOR, INSN_SRL, INSN_OR,  INSN_AND};
+      in.op = ops[funct3];
+    } else if (funct7 == 0x20) {
+      if (funct3 == 0)
+        in.op = INSN_SUB;
+      else if (funct3 == 5)
+        in.op = INSN_SRA;
+    } else if (funct7 == 0x01) {
+      static const uint8_t ops[8] = {INSN_MUL, INSN_MULH, INSN_MULHSU,
+                                     INSN_MULHU, INSN_DIV, INSN_DIVU,
+                                     INSN_REM, INSN_REMU};
+      in.op = ops[funct3];
+    }
+    break;
+  case 0x3B: // OP-32
+    if (funct7 == 0x00) {
+      if (funct3 == 0)
+        in.op = INSN_ADDW;
+      else if (funct3 == 1)
+        in.op = INSN_SLLW;
+      else if (funct3 == 5)
+        in.op = INSN_SRLW;
+    } else if (funct7 == 0x20) {
+      if (funct3 == 0)
+        in.op = INSN_SUBW;
+      else if (funct3 == 5)
+        in.op = INSN_SRAW;
+    } else if (funct7 == 0x01) {
+      static const uint8_t ops[8] = {INSN_MULW,    INSN_ILLEGAL, INSN_ILLEGAL,
+                                     INSN_ILLEGAL, INSN_DIVW,    INSN_DIVUW,
+                                     INSN_REMW,    INSN_REMUW};
+      in.op = ops[funct3];
+    }
+    break;
+  case 0x2F: { // AMO
+    uint32_t funct5 = inst >> 27;
+    bool is_d = funct3 == 3;
+    if (funct3 != 2 && funct3 != 3)
+      break;
+    if (funct5 == 0x02)
+      in.op = in.rs2 == 0 ? (is_d ? INSN_LR_D : INSN_LR_W) : INSN_ILLEGAL;
+    else if (funct5 == 0x03)
+      in.op = is_d ? INSN_SC_D : INSN_SC_W;
+    else if (funct5 == AMO_ADD || funct5 == AMO_SWAP || funct5 == AMO_XOR ||
+             funct5 == AMO_OR || funct5 == AMO_AND || funct5 == AMO_MIN ||
+             funct5 == AMO_MAX || funct5 == AMO_MINU || funct5 == AMO_MAXU)
+      in.op = is_d ? INSN_AMO_D : INSN_AMO_W;
+    in.imm = funct5;
+    break;
+  }
+  case 0x07: // LOAD-FP
+    if (funct3 == 2)
+      in.op = INSN_FLW;
+    else if (funct3 == 3)
+      in.op = INSN_FLD;
+    in.imm = imm_i(inst);
+    break;
+  case 0x27: // STORE-FP
+    if (funct3 == 2)
+      in.op = INSN_FSW;
+    else if (funct3 == 3)
+      in.op = INSN_FSD;
+    in.imm = imm_s(inst);
+    break;
+  case 0x43: // FMADD
+  case 0x47: // FMSUB
+  case 0x4B: // FNMSUB
+  case 0x4F: // FNMADD
+    if ((funct7 & 3) <= 1) {
+      in.op = INSN_FMADD_S + ((opcode >> 2) & 3);
+      if (funct7 & 3)
+        in.op = FP_DOUBLE(in.op);
+      in.rs3 = inst >> 27;
+      in.rm = funct3;
+    }
+    break;
+  case 0x53: // OP-FP
+    in.op = decode_op_fp(funct7, funct3, in.rs2);
+    in.rm = funct3;
+    break;
+  case 0x0F: // MISC-MEM (FENCE, FENCE.I)
+    if (funct3 == 0 || funct3 == 1)
+      in.op = INSN_FENCE;
+    break;
+  case 0x73: // SYSTEM
+    if (funct3 != 0) {
+      static const uint8_t csr_ops[8] = {
+          0,          INSN_CSRRW,  INSN_CSRRS,  INSN_CSRRC,
+          0,          INSN_CSRRWI, INSN_CSRRSI, INSN_CSRRCI,
+      };
+      in.op = csr_ops[funct3];
+      in.imm = inst >> 20;
+    } else if (inst == 0x00000073)
+      in.op = INSN_ECALL;
+    else if (inst == 0x00100073)
+      in.op = INSN_EBREAK;
+    else if (inst == 0x30200073)
+      in.op = INSN_MRET;
+    else if (inst == 0x10200073)
+      in.op = INSN_SRET;
+    else if (inst == 0x10500073)
+      in.op = INSN_WFI;
+    else if (funct7 == 0x09 && in.rd == 0)
+      in.op = INSN_SFENCE_VMA;
+    break;
+  }
+
+  return in;
+}
+
+/* Map an RV64 decode onto its RV32 meaning (see decode.h). */
+static Insn narrow_rv32(Insn in) {
+  switch (in.op) {
+  case INSN_LD: case INSN_SD: case INSN_LWU:
+  case INSN_ADDIW: case INSN_SLLIW: case INSN_SRLIW: case INSN_SRAIW:
+  case INSN_ADDW: case INSN_SUBW: case INSN_SLLW: case INSN_SRLW:
+  case INSN_SRAW: case INSN_MULW: case INSN_DIVW: case INSN_DIVUW:
+  case INSN_REMW: case INSN_REMUW:
+  case INSN_LR_D: case INSN_SC_D: case INSN_AMO_D:
+  case INSN_FCVT_L_S: case INSN_FCVT_LU_S: case INSN_FCVT_S_L:
+  case INSN_FCVT_S_LU: case INSN_FCVT_L_D: case INSN_FCVT_LU_D:
+  case INSN_FCVT_D_L: case INSN_FCVT_D_LU: case INSN_FMV_X_D:
+  case INSN_FMV_D_X:
+    in.op = INSN_ILLEGAL;
+    break;
+
+  case INSN_SLLI: in.op = in.imm < 32 ? INSN_SLLIW : INSN_ILLEGAL; break;
+  case INSN_SRLI: in.op = in.imm < 32 ? INSN_SRLIW : INSN_ILLEGAL; break;
+  case INSN_SRAI: in.op = in.imm < 32 ? INSN_SRAIW : INSN_ILLEGAL; break;
+  case INSN_SLL: in.op = INSN_SLLW; break;
+  case INSN_SRL: in.op = INSN_SRLW; break;
+  case INSN_SRA: in.op = INSN_SRAW; break;
+
+  case INSN_MULH: in.op = INSN_MULH32; break;
+  case INSN_MULHSU: in.op = INSN_MULHSU32; break;
+  case INSN_MULHU: in.op = INSN_MULHU32; break;
+  case INSN_DIV: in.op = INSN_DIVW; break;
+  case INSN_DIVU: in.op = INSN_DIVUW; break;
+  case INSN_REM: in.op = INSN_REMW; break;
+  case INSN_REMU: in.op = INSN_REMUW; break;
+  }
+  return in;
+}
+
+Insn decode(uint32_t inst, int xlen) {
+  Insn in = decode64(inst);
+  return xlen == 32 ? narrow_rv32(in) : in;
+}
+
+Insn decode_compressed(uint16_t inst, int xlen) {
+  Insn in;
+  if (inst == 0) {
+    in = decode(0, xlen);
+  } else {
+    uint32_t expanded = rvc_expand(inst, xlen);
+    in = expanded ? decode(expanded, xlen) : (Insn){.op = INSN_ILLEGAL};
+  }
+  in.raw = inst;
+  in.len = 2;
+  return in;
+}
+
+const char *insn_name(uint8_t op) {
+  static const char *names[] = {
+      [INSN_ILLEGAL] = "illegal", [INSN_HALT] = "halt",
+      [INSN_LUI] = "lui",         [INSN_AUIPC] = "auipc",
+      [INSN_JAL] = "jal",         [INSN_JALR] = "jalr",
+      [INSN_BEQ] = "beq",         [INSN_BNE] = "bne",
+      [INSN_BLT] = "blt",         [INSN_BGE] = "bge",
+      [INSN_BLTU] = "bltu",       [INSN_BGEU] = "bgeu",
+      [INSN_LB] = "lb",           [INSN_LH] = "lh",
+      [INSN_LW] = "lw",           [INSN_LD] = "ld",
+      [INSN_LBU] = "lbu",         [INSN_LHU] = "lhu",
+      [INSN_LWU] = "lwu",         [INSN_SB] = "sb",
+      [INSN_SH] = "sh",           [INSN_SW] = "sw",
+      [INSN_SD] = "sd",           [INSN_ADDI] = "addi",
+      [INSN_SLTI] = "slti",       [INSN_SLTIU] = "sltiu",
+      [INSN_XORI] = "xori",       [INSN_ORI] = "ori",
+      [INSN_ANDI] = "andi",       [INSN_SLLI] = "slli",
+      [INSN_SRLI] = "srli",       [INSN_SRAI] = "srai",
+      [INSN_ADD] = "add",         [INSN_SUB] = "sub",
+      [INSN_SLL] = "sll",         [INSN_SLT] = "slt",
+      [INSN_SLTU] = "sltu",       [INSN_XOR] = "xor",
+      [INSN_SRL] = "srl",         [INSN_SRA] = "sra",
+      [INSN_OR] = "or",           [INSN_AND] = "and",
+      [INSN_ADDIW] = "addiw",     [INSN_SLLIW] = "slliw",
+      [INSN_SRLIW] = "srliw",     [INSN_SRAIW] = "sraiw",
+      [INSN_ADDW] = "addw",       [INSN_SUBW] = "subw",
+      [INSN_SLLW] = "sllw",       [INSN_SRLW] = "srlw",
+      [INSN_SRAW] = "sraw",       [INSN_FENCE] = "fence",
+      [INSN_ECALL] = "ecall",     [INSN_EBREAK] = "ebreak",
+      [INSN_MUL] = "mul",         [INSN_MULH] = "mulh",
+      [INSN_MULHSU] = "mulhsu",   [INSN_MULHU] = "mulhu",
+      [INSN_DIV] = "div",         [INSN_DIVU] = "divu",
+      [INSN_REM] = "rem",         [INSN_REMU] = "remu",
+      [INSN_MULW] = "mulw",       [INSN_DIVW] = "divw",
+      [INSN_DIVUW] = "divuw",     [INSN_REMW] = "remw",
+      [INSN_REMUW] = "remuw",     [INSN_MULH32] = "mulh",
+      [INSN_MULHSU32] = "mulhsu", [INSN_MULHU32] = "mulhu",
+      [INSN_LR_W] = "lr.w",       [INSN_SC_W] = "sc.w",
+      [INSN_AMO_W] = "amo.w",     [INSN_LR_D] = "lr.d",
+      [INSN_SC_D] = "sc.d",       [INSN_AMO_D] = "amo.d",
+      [INSN_CSRRW] = "csrrw",     [INSN_CSRRS] = "csrrs",
+      [INSN_CSRRC] = "csrrc",     [INSN_CSRRWI] = "csrrwi",
+      [INSN_CSRRSI] = "csrrsi",   [INSN_CSRRCI] = "csrrci",
+      [INSN_MRET] = "mret",       [INSN_SRET] = "sret",
+      [INSN_WFI] = "wfi",         [INSN_SFENCE_VMA] = "sfence.vma",
+      [INSN_FLW] = "flw",              [INSN_FSW] = "fsw",
+      [INSN_FLD] = "fld",              [INSN_FSD] = "fsd",
+      [INSN_FMADD_S] = "fmadd.s",      [INSN_FMSUB_S] = "fmsub.s",
+      [INSN_FNMSUB_S] = "fnmsub.s",    [INSN_FNMADD_S] = "fnmadd.s",
+      [INSN_FADD_S] = "fadd.s",        [INSN_FSUB_S] = "fsub.s",
+      [INSN_FMUL_S] = "fmul.s",        [INSN_FDIV_S] = "fdiv.s",
+      [INSN_FSQRT_S] = "fsqrt.s",      [INSN_FSGNJ_S] = "fsgnj.s",
+      [INSN_FSGNJN_S] = "fsgnjn.s",    [INSN_FSGNJX_S] = "fsgnjx.s",
+      [INSN_FMIN_S] = "fmin.s",        [INSN_FMAX_S] = "fmax.s",
+      [INSN_FCVT_W_S] = "fcvt.w.s",    [INSN_FCVT_WU_S] = "fcvt.wu.s",
+      [INSN_FCVT_L_S] = "fcvt.l.s",    [INSN_FCVT_LU_S] = "fcvt.lu.s",
+      [INSN_FMV_X_W] = "fmv.x.w",      [INSN_FEQ_S] = "feq.s",
+      [INSN_FLT_S] = "flt.s",          [INSN_FLE_S] = "fle.s",
+      [INSN_FCLASS_S] = "fclass.s",    [INSN_FCVT_S_W] = "fcvt.s.w",
+      [INSN_FCVT_S_WU] = "fcvt.s.wu",  [INSN_FCVT_S_L] = "fcvt.s.l",
+      [INSN_FCVT_S_LU] = "fcvt.s.lu",  [INSN_FMV_W_X] = "fmv.w.x",
+      [INSN_FMADD_D] = "fmadd.d",      [INSN_FMSUB_D] = "fmsub.d",
+      [INSN_FNMSUB_D] = "fnmsub.d",    [INSN_FNMADD_D] = "fnmadd.d",
+      [INSN_FADD_D] = "fadd.d",        [INSN_FSUB_D] = "fsub.d",
+      [INSN_FMUL_D] = "fmul.d",        [INSN_FDIV_D] = "fdiv.d",
+      [INSN_FSQRT_D] = "fsqrt.d",      [INSN_FSGNJ_D] = "fsgnj.d",
+      [INSN_FSGNJN_D] = "fsgnjn.d",    [INSN_FSGNJX_D] = "fsgnjx.d",
+      [INSN_FMIN_D] = "fmin.d",        [INSN_FMAX_D] = "fmax.d",
+      [INSN_FCVT_W_D] = "fcvt.w.d",    [INSN_FCVT_WU_D] = "fcvt.wu.d",
+      [INSN_FCVT_L_D] = "fcvt.l.d",    [INSN_FCVT_LU_D] = "fcvt.lu.d",
+      [INSN_FMV_X_D] = "fmv.x.d",      [INSN_FEQ_D] = "feq.d",
+      [INSN_FLT_D] = "flt.d",          [INSN_FLE_D] = "fle.d",
+      [INSN_FCLASS_D] = "fclass.d",    [INSN_FCVT_D_W] = "fcvt.d.w",
+      [INSN_FCVT_D_WU] = "fcvt.d.wu",  [INSN_FCVT_D_L] = "fcvt.d.l",
+      [INSN_FCVT_D_LU] = "fcvt.d.lu",  [INSN_FMV_D_X] = "fmv.d.x",
+      [INSN_FCVT_S_D] = "fcvt.s.d",    [INSN_FCVT_D_S] = "fcvt.d.s",
+  };
+  if (op < sizeof(names) / sizeof(names[0]) && names[op])
+    return names[op];
+  return "?";
+}
+
+bool insn_writes_rd(uint8_t op) {
+  switch (op) {
+  case INSN_ILLEGAL:
+  case INSN_HALT:
+  case INSN_BEQ:
+  case INSN_BNE:
+  case INSN_BLT:
+  case INSN_BGE:
+  case INSN_BLTU:
+  case INSN_BGEU:
+  case INSN_SB:
+  case INSN_SH:
+  case INSN_SW:
+  case INSN_SD:
+  case INSN_FSW:
+  case INSN_FSD:
+  case INSN_FENCE:
+  case INSN_ECALL:
+  case INSN_EBREAK:
+  case INSN_MRET:
+  case INSN_SRET:
+  case INSN_WFI:
+  case INSN_SFENCE_VMA:
+    return false;
+  default:
+    return !insn_writes_frd(op);
+  }
+}
+
+bool insn_writes_frd(uint8_t op) {
+  if (op == INSN_FLW || op == INSN_FLD)
+    return true;
+  if (op < INSN_FP_FIRST)
+    return false;
+  switch (op) {
+  // The ops that produce an integer
+  case INSN_FCVT_W_S: case INSN_FCVT_WU_S: case INSN_FCVT_L_S:
+  case INSN_FCVT_LU_S: case INSN_FMV_X_W: case INSN_FEQ_S: case INSN_FLT_S:
+  case INSN_FLE_S: case INSN_FCLASS_S:
+  case INSN_FCVT_W_D: case INSN_FCVT_WU_D: case INSN_FCVT_L_D:
+  case INSN_FCVT_LU_D: case INSN_FMV_X_D: case INSN_FEQ_D: case INSN_FLT_D:
+  case INSN_FLE_D: case INSN_FCLASS_D:
+    return false;
+  default:
+    return true;
+  }
+}
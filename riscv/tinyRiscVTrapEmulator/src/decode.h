@@ -0,0 +1,238 @@
+#ifndef DECODE_H
+#define DECODE_H
+#include <stdint.h>
+
+/*
+ * Predecoded instruction form.
+ *
+ * Every instruction, 32-bit or 16-bit compressed (RVC), is decoded once into
+ * an Insn and kept in the decode cache. Compressed instructions are first
+ * expanded to their 32-bit equivalent, so the executor only ever sees one
+ * form and only `len` tells them apart.
+ */
+typedef enum {
+  INSN_ILLEGAL = 0,
+  INSN_HALT, // all-zero instruction, used by the demo programs to stop
+
+  // RV64I
+  INSN_LUI,
+  INSN_AUIPC,
+  INSN_JAL,
+  INSN_JALR,
+  INSN_BEQ,
+  INSN_BNE,
+  INSN_BLT,
+  INSN_BGE,
+  INSN_BLTU,
+  INSN_BGEU,
+  INSN_LB,
+  INSN_LH,
+  INSN_LW,
+  INSN_LD,
+  INSN_LBU,
+  INSN_LHU,
+  INSN_LWU,
+  INSN_SB,
+  INSN_SH,
+  INSN_SW,
+  INSN_SD,
+  INSN_ADDI,
+  INSN_SLTI,
+  INSN_SLTIU,
+  INSN_XORI,
+  INSN_ORI,
+  INSN_ANDI,
+  INSN_SLLI,
+  INSN_SRLI,
+  INSN_SRAI,
+  INSN_ADD,
+  INSN_SUB,
+  INSN_SLL,
+  INSN_SLT,
+  INSN_SLTU,
+  INSN_XOR,
+  INSN_SRL,
+  INSN_SRA,
+  INSN_OR,
+  INSN_AND,
+  INSN_ADDIW,
+  INSN_SLLIW,
+  INSN_SRLIW,
+  INSN_SRAIW,
+  INSN_ADDW,
+  INSN_SUBW,
+  INSN_SLLW,
+  INSN_SRLW,
+  INSN_SRAW,
+  INSN_FENCE,
+  INSN_ECALL,
+  INSN_EBREAK,
+
+  // RV64M
+  INSN_MUL,
+  INSN_MULH,
+  INSN_MULHSU,
+  INSN_MULHU,
+  INSN_DIV,
+  INSN_DIVU,
+  INSN_REM,
+  INSN_REMU,
+  INSN_MULW,
+  INSN_DIVW,
+  INSN_DIVUW,
+  INSN_REMW,
+  INSN_REMUW,
+
+  // RV32 forms of the high-half multiplies (see decode())
+  INSN_MULH32,
+  INSN_MULHSU32,
+  INSN_MULHU32,
+
+  // RV64A (imm holds funct5 for the AMOs)
+  INSN_LR_W,
+  INSN_SC_W,
+  INSN_AMO_W,
+  INSN_LR_D,
+  INSN_SC_D,
+  INSN_AMO_D,
+
+  // Zicsr (imm holds the CSR number; rs1 is the zimm for the *I forms)
+  INSN_CSRRW,
+  INSN_CSRRS,
+  INSN_CSRRC,
+  INSN_CSRRWI,
+  INSN_CSRRSI,
+  INSN_CSRRCI,
+
+  // Privileged
+  INSN_MRET,
+  INSN_SRET,
+  INSN_WFI,
+  INSN_SFENCE_VMA,
+
+  // RV64F / RV64D loads and stores
+  INSN_FLW,
+  INSN_FSW,
+  INSN_FLD,
+  INSN_FSD,
+
+  // RV64F computational ops (rm holds the rounding mode, rs3 the FMA
+  // addend). Everything from here on is executed by fp_execute().
+  INSN_FMADD_S,
+  INSN_FMSUB_S,
+  INSN_FNMSUB_S,
+  INSN_FNMADD_S,
+  INSN_FADD_S,
+  INSN_FSUB_S,
+  INSN_FMUL_S,
+  INSN_FDIV_S,
+  INSN_FSQRT_S,
+  INSN_FSGNJ_S,
+  INSN_FSGNJN_S,
+  INSN_FSGNJX_S,
+  INSN_FMIN_S,
+  INSN_FMAX_S,
+  INSN_FCVT_W_S,
+  INSN_FCVT_WU_S,
+  INSN_FCVT_L_S,
+  INSN_FCVT_LU_S,
+  INSN_FMV_X_W,
+  INSN_FEQ_S,
+  INSN_FLT_S,
+  INSN_FLE_S,
+  INSN_FCLASS_S,
+  INSN_FCVT_S_W,
+  INSN_FCVT_S_WU,
+  INSN_FCVT_S_L,
+  INSN_FCVT_S_LU,
+  INSN_FMV_W_X,
+
+  // RV64D: the same ops in the same order, see FP_DOUBLE()
+  INSN_FMADD_D,
+  INSN_FMSUB_D,
+  INSN_FNMSUB_D,
+  INSN_FNMADD_D,
+  INSN_FADD_D,
+  INSN_FSUB_D,
+  INSN_FMUL_D,
+  INSN_FDIV_D,
+  INSN_FSQRT_D,
+  INSN_FSGNJ_D,
+  INSN_FSGNJN_D,
+  INSN_FSGNJX_D,
+  INSN_FMIN_D,
+  INSN_FMAX_D,
+  INSN_FCVT_W_D,
+  INSN_FCVT_WU_D,
+  INSN_FCVT_L_D,
+  INSN_FCVT_LU_D,
+  INSN_FMV_X_D,
+  INSN_FEQ_D,
+  INSN_FLT_D,
+  INSN_FLE_D,
+  INSN_FCLASS_D,
+  INSN_FCVT_D_W,
+  INSN_FCVT_D_WU,
+  INSN_FCVT_D_L,
+  INSN_FCVT_D_LU,
+  INSN_FMV_D_X,
+
+  INSN_FCVT_S_D,
+  INSN_FCVT_D_S,
+} InsnOp;
+
+#define INSN_FP_FIRST INSN_FMADD_S
+#define FP_DOUBLE(op) ((op) + (INSN_FMADD_D - INSN_FMADD_S))
+
+// funct5 values of the AMO instructions
+#define AMO_ADD 0x00
+#define AMO_SWAP 0x01
+#define AMO_XOR 0x04
+#define AMO_OR 0x08
+#define AMO_AND 0x0C
+#define AMO_MIN 0x10
+#define AMO_MAX 0x14
+#define AMO_MINU 0x18
+#define AMO_MAXU 0x1C
+
+typedef struct {
+  uint8_t op; // InsnOp
+  uint8_t rd;
+  uint8_t rs1;
+  uint8_t rs2;
+  uint8_t len; // 2 for compressed, 4 otherwise
+  uint8_t rs3; // FMA addend
+  uint8_t rm;  // FP rounding mode (funct3)
+  uint8_t idiom; // loop idiom state, owned by the executor (0 = unchecked)
+  uint32_t raw; // original encoding (16-bit parcel for RVC)
+  int64_t imm;  // sign-extended immediate / shift amount
+} Insn;
+
+/*
+ * Decode a 32-bit instruction for an XLEN of 32 or 64. RV32 code runs on the
+ * same 64-bit register file with every register kept sign-extended from bit
+ * 31, so most RV32 instructions map onto the RV64 op that has the right
+ * result modulo 2^32 (shifts and divides map onto the *W forms); RV64-only
+ * instructions decode as illegal.
+ */
+Insn decode(uint32_t inst, int xlen);
+
+/*
+ * Expand a 16-bit compressed instruction into the equivalent 32-bit
+ * encoding. Returns 0 for reserved / illegal encodings.
+ */
+uint32_t rvc_expand(uint16_t inst, int xlen);
+
+/* Decode a 16-bit compressed instruction (expand, then decode). */
+Insn decode_compressed(uint16_t inst, int xlen);
+
+const char *insn_name(uint8_t op);
+
+/*
+ * Whether `op` writes its integer rd (branches, stores and system ops do
+ * not) or its FP rd.
+ */
+bool insn_writes_rd(uint8_t op);
+bool insn_writes_frd(uint8_t op);
+
+#endif // DECODE_H
@@ -1,76 +1,829 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS / MAP_NORESERVE on glibc
 #include "emulator.h"
+#include "fpu.h"
+#include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
-void emu_init(Emulator *emu) {
+bool emu_init(Emulator *emu, uint64_t dram_base, uint64_t dram_size) {
+  memset(emu, 0, sizeof(*emu));
   cpu_init(&emu->cpu);
-  memset(emu->dram, 0, DRAM_SIZE);
+  emu->console_in = -1;
+  emu->uart_rx = -1;
+
+  // Anonymous mappings are zero-filled and only backed once touched
+  emu->dram = mmap(NULL, dram_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (emu->dram == MAP_FAILED) {
+    perror("mmap guest RAM");
+    emu->dram = NULL;
+    return false;
+  }
+  emu->dram_base = dram_base;
+  emu->dram_size = dram_size;
+  emu->code_pages = calloc(dram_size / PAGE_SIZE, 1);
+  if (!emu->code_pages) {
+    emu_free(emu);
+    return false;
+  }
+
+  emu_flush_decode_cache(emu);
+  return true;
+}
+
+void emu_free(Emulator *emu) {
+  bus_free(emu);
+  if (emu->dram)
+    munmap(emu->dram, emu->dram_size);
+  free(emu->code_pages);
+  emu->dram = NULL;
+  emu->code_pages = NULL;
+}
+
+void emu_flush_decode_cache(Emulator *emu) {
+  for (size_t i = 0; i < DECODE_CACHE_SIZE; i++)
+    emu->icache[i].pc = DECODE_CACHE_EMPTY;
+  memset(emu->code_pages, 0, emu->dram_size / PAGE_SIZE);
 }
 
 void emu_load_program(Emulator *emu, const uint8_t *code, size_t size) {
-  if (size > DRAM_SIZE) {
+  if (size > emu->dram_size) {
     fprintf(stderr, "Program too large for RAM\n");
     return;
   }
   memcpy(emu->dram, code, size);
+  emu_flush_decode_cache(emu);
+  emu->cpu.pc = emu->dram_base;
+}
+
+uint8_t *emu_guest_ptr(Emulator *emu, uint64_t addr, uint64_t len) {
+  uint64_t off = addr - emu->dram_base; // wraps (and fails) below RAM
+  if (off > emu->dram_size || len > emu->dram_size - off)
+    return NULL;
+  return emu->dram + off;
 }
 
 /*
- * Fetch-Decode-Execute Cycle
+ * Self-modifying code support: a store that touches a page holding cached
+ * instructions drops every cache entry from that page. `page` is the page
+ * index within RAM. The cache is direct-mapped on the PC, so only the slots
+ * of the page's own halfwords need a look, plus the one of an instruction
+ * straddling into it from the last halfword of the previous page.
  */
-bool emu_step(Emulator *emu) {
+static void invalidate_code_page(Emulator *emu, uint64_t page) {
+  uint64_t first = emu->dram_base + (page << PAGE_SHIFT) - 2;
+  for (uint64_t i = 0; i <= PAGE_SIZE / 2; i++) {
+    uint64_t pc = first + 2 * i;
+    DecodeCacheEntry *e = &emu->icache[(pc >> 1) & (DECODE_CACHE_SIZE - 1)];
+    if (e->pc == pc && (i > 0 || e->insn.len == 4))
+      e->pc = DECODE_CACHE_EMPTY;
+  }
+  emu->code_pages[page] = 0;
+}
+
+void emu_invalidate_range(Emulator *emu, uint64_t addr, uint64_t len) {
+  if (len == 0)
+    return;
+  uint64_t off = addr - emu->dram_base;
+  for (uint64_t page = off >> PAGE_SHIFT;
+       page <= (off + len - 1) >> PAGE_SHIFT; page++) {
+    if (emu->code_pages[page])
+      invalidate_code_page(emu, page);
+  }
+}
+
+static inline bool mem_read(Emulator *emu, uint64_t addr, int size,
+                            uint64_t *out) {
+  uint64_t off = addr - emu->dram_base;
+  if (off > emu->dram_size - size) {
+    if (bus_read(emu, addr, size, out))
+      return true;
+    printf("Load access fault at %016" PRIx64 "\n", addr);
+    return false;
+  }
+  uint64_t val = 0;
+  memcpy(&val, &emu->dram[off], size); // little-endian host
+  *out = val;
+  return true;
+}
+
+/*
+ * Also returns false (without a fault) for the store that signals the end
+ * of a test through `tohost` or a test-finisher device.
+ */
+static inline bool mem_write(Emulator *emu, uint64_t addr, int size,
+                             uint64_t val) {
+  if (emu->trace) {
+    emu->trace_mem_size = size;
+    emu->trace_mem_addr = addr;
+    emu->trace_mem_val = val;
+  }
+  uint64_t off = addr - emu->dram_base;
+  if (off > emu->dram_size - size) {
+    if (bus_write(emu, addr, size, val))
+      return !emu->tohost_value;
+    printf("Store access fault at %016" PRIx64 "\n", addr);
+    return false;
+  }
+  uint64_t first = off >> PAGE_SHIFT;
+  uint64_t last = (off + size - 1) >> PAGE_SHIFT;
+  if (emu->code_pages[first])
+    invalidate_code_page(emu, first);
+  if (last != first && emu->code_pages[last])
+    invalidate_code_page(emu, last);
+  memcpy(&emu->dram[off], &val, size);
+
+  if (addr == emu->tohost && val != 0) {
+    emu->tohost_value = val;
+    return false;
+  }
+  return true;
+}
+
+static inline bool fetch16(Emulator *emu, uint64_t addr, uint16_t *out) {
+  uint64_t off = addr - emu->dram_base;
+  if (off > emu->dram_size - 2) {
+    // Code in ROM, or zeros from unmapped memory; never from devices
+    const uint8_t *rom = bus_rom_ptr(emu, addr, 2);
+    if (rom)
+      memcpy(out, rom, 2);
+    else if (emu->machine.unmapped_zero && !bus_rom_ptr(emu, addr, 0))
+      *out = 0;
+    else
+      return false;
+    return true;
+  }
+  memcpy(out, &emu->dram[off], 2);
+  return true;
+}
+
+// Note that [pc, pc + len) holds cached code, if it is in RAM (ROM is never
+// written, so it needs no tracking)
+static inline void mark_code(Emulator *emu, uint64_t pc) {
+  uint64_t off = pc - emu->dram_base;
+  if (off < emu->dram_size)
+    emu->code_pages[off >> PAGE_SHIFT] = 1;
+}
+
+/*
+ * Fetch + decode.
+ *
+ * Instructions are 2-byte aligned and either 16 bits (RVC, low bits != 11)
+ * or 32 bits. A 32-bit instruction may start in the last halfword of a page,
+ * so its two parcels are fetched (and bounds-checked) separately and both
+ * pages are marked as holding code.
+ */
+static bool fetch_decode(Emulator *emu, uint64_t pc, Insn *out) {
+  uint16_t lo, hi;
+
+  if ((pc & 1) || !fetch16(emu, pc, &lo)) {
+    printf("PC out of bounds: %016" PRIx64 "\n", pc);
+    return false;
+  }
+
+  if ((lo & 0x3) != 0x3) {
+    *out = decode_compressed(lo, emu->cpu.xlen);
+    mark_code(emu, pc);
+    return true;
+  }
+
+  if (!fetch16(emu, pc + 2, &hi)) {
+    printf("PC out of bounds: %016" PRIx64 "\n", pc + 2);
+    return false;
+  }
+  *out = decode((uint32_t)lo | ((uint32_t)hi << 16), emu->cpu.xlen);
+  mark_code(emu, pc);
+  mark_code(emu, pc + 2);
+  return true;
+}
+
+static inline Insn *lookup_insn(Emulator *emu, uint64_t pc) {
+  DecodeCacheEntry *e = &emu->icache[(pc >> 1) & (DECODE_CACHE_SIZE - 1)];
+  if (e->pc != pc) {
+    if (!fetch_decode(emu, pc, &e->insn)) {
+      e->pc = DECODE_CACHE_EMPTY;
+      return NULL;
+    }
+    e->pc = pc;
+  }
+  return &e->insn;
+}
+
+static inline uint64_t sext32(uint64_t v) { return (int64_t)(int32_t)v; }
+
+static inline uint64_t mulh(int64_t a, int64_t b) {
+  return (uint64_t)(((__int128)a * (__int128)b) >> 64);
+}
+
+static inline uint64_t mulhsu(int64_t a, uint64_t b) {
+  return (uint64_t)(((__int128)a * (unsigned __int128)b) >> 64);
+}
+
+static inline uint64_t mulhu(uint64_t a, uint64_t b) {
+  return (uint64_t)(((unsigned __int128)a * (unsigned __int128)b) >> 64);
+}
+
+/*
+ * Read-modify-write part of an AMO. For the .W forms `old` and `src` are
+ * already sign-extended from 32 bits; MINU/MAXU compare the low 32 bits.
+ */
+static inline uint64_t amo_apply(int64_t funct5, uint64_t old, uint64_t src,
+                                 bool word) {
+  uint64_t uo = word ? (uint32_t)old : old;
+  uint64_t us = word ? (uint32_t)src : src;
+  switch (funct5) {
+  case AMO_SWAP: return src;
+  case AMO_ADD: return old + src;
+  case AMO_XOR: return old ^ src;
+  case AMO_AND: return old & src;
+  case AMO_OR: return old | src;
+  case AMO_MIN: return (int64_t)old < (int64_t)src ? old : src;
+  case AMO_MAX: return (int64_t)old > (int64_t)src ? old : src;
+  case AMO_MINU: return uo < us ? old : src;
+  case AMO_MAXU: return uo > us ? old : src;
+  }
+  return old;
+}
+
+// ============================================================================
+// Loop idioms
+// ============================================================================
+
+/*
+ * Fill and copy loops (clearing BSS or a page table, copying .data) run as
+ * one host memset/memmove instead of instruction by instruction. A loop is
+ * recognized at its first memory instruction, in the two shapes compilers
+ * and hand-written start code use, with the element size W matching the
+ * pointer increment:
+ *
+ *   bottom-tested                     top-tested
+ *                                     top: beq  p, end, exit   (or bgeu)
+ *   loop: [l<W> t, a(src)]                 [l<W> t, a(src)]
+ *         s<W>  v, b(dst)                  s<W>  v, b(dst)
+ *         addi  dst, dst, W                addi  dst, dst, W
+ *         [addi src, src, W]               [addi src, src, W]
+ *         bne   p, end, loop (or bltu)     j     top
+ *
+ * where p is one of the bumped pointers. The result is architecturally
+ * exact: memory, the pointers, the loaded register, pc and instret end up as
+ * if every iteration had run. Whenever that cannot be guaranteed cheaply the
+ * loop simply runs normally, which also yields the precise fault and the
+ * partial progress before it:
+ *   - either range leaves RAM (devices, ROM, access faults) or covers tohost,
+ *   - the destination overlaps the loop's own code or, for a copy, lies
+ *     ahead of the source within the copied length (a forward element copy
+ *     then differs from memmove),
+ *   - the exit test would never fire, or wrap (e.g. bne with end < p).
+ * Loops must sit in one page, so a write to their code drops the whole
+ * pattern from the decode cache. Idioms are skipped while tracing. One step
+ * runs at most LOOP_IDIOM_MAX_INSNS worth of iterations and stops at the top
+ * of the next one, so pending interrupts are taken, and --max-insns and
+ * snapshot points overshot, within that many instructions.
+ */
+enum { IDIOM_UNCHECKED = 0, IDIOM_NONE, IDIOM_LOOP };
+
+#define LOOP_IDIOM_MAX_INSNS (1 << 16)
+
+static inline int load_width(uint8_t op) {
+  switch (op) {
+  case INSN_LB: case INSN_LBU: return 1;
+  case INSN_LH: case INSN_LHU: return 2;
+  case INSN_LW: case INSN_LWU: return 4;
+  case INSN_LD: return 8;
+  default: return 0;
+  }
+}
+
+static inline int store_width(uint8_t op) {
+  return op >= INSN_SB && op <= INSN_SD ? 1 << (op - INSN_SB) : 0;
+}
+
+/* The cached instruction at `pc`, if it is in RAM on the page of `base` */
+static Insn *peek_insn(Emulator *emu, uint64_t pc, uint64_t base) {
+  if ((pc ^ base) >> PAGE_SHIFT || !emu_guest_ptr(emu, pc, 4))
+    return NULL;
+  return lookup_insn(emu, pc);
+}
+
+static bool match_loop_idiom(Emulator *emu, const Insn *first, uint64_t pc,
+                             LoopIdiom *m) {
+  memset(m, 0, sizeof(*m));
+  uint64_t at = pc;
+  const Insn *in = first;
+
+  if (load_width(in->op)) {
+    m->copy = true;
+    m->load = *in;
+    at += in->len;
+    if (!(in = peek_insn(emu, at, pc)))
+      return false;
+  }
+  int w = store_width(in->op);
+  if (!w || in->rs1 == 0)
+    return false;
+  m->store = *in;
+  at += in->len;
+  m->insns = m->copy ? 4 : 2;
+  if (m->copy) {
+    const Insn *l = &m->load;
+    if (load_width(l->op) != w || l->rd == 0 || in->rs2 != l->rd ||
+        l->rd == l->rs1 || l->rd == in->rs1 || l->rs1 == in->rs1)
+      return false;
+  } else if (in->rs2 == in->rs1) {
+    return false;
+  }
+
+  // Pointer increments, in either order
+  bool bumped_dst = false, bumped_src = !m->copy;
+  for (int i = m->copy ? 2 : 1; i > 0; i--) {
+    if (!(in = peek_insn(emu, at, pc)) || in->op != INSN_ADDI ||
+        in->rd != in->rs1 || in->imm != w)
+      return false;
+    if (in->rd == m->store.rs1 && !bumped_dst)
+      bumped_dst = true;
+    else if (m->copy && in->rd == m->load.rs1 && !bumped_src)
+      bumped_src = true;
+    else
+      return false;
+    at += in->len;
+  }
+
+  // Back edge, and the exit test at the bottom or the top of the loop
+  if (!(in = peek_insn(emu, at, pc)))
+    return false;
+  const Insn *test;
+  if ((in->op == INSN_BNE || in->op == INSN_BLTU) && at + in->imm == pc) {
+    test = in;
+    m->lo = pc;
+    m->hi = at + in->len;
+    m->exit_pc = m->hi;
+    m->insns += 1;
+  } else if (in->op == INSN_JAL && in->rd == 0) {
+    uint64_t top = at + in->imm;
+    if (!(test = peek_insn(emu, top, pc)) || top + test->len != pc ||
+        (test->op != INSN_BEQ && test->op != INSN_BGEU))
+      return false;
+    m->lo = top;
+    m->hi = at + in->len;
+    m->exit_pc = top + test->imm;
+    if (m->exit_pc >= m->lo && m->exit_pc < m->hi)
+      return false;
+    m->insns += 2;
+  } else {
+    return false;
+  }
+
+  m->ordered = test->op == INSN_BLTU || test->op == INSN_BGEU;
+  uint8_t dst = m->store.rs1, src = m->copy ? m->load.rs1 : dst;
+  if (test->rs1 == dst || test->rs1 == src) {
+    m->cmp = test->rs1;
+    m->end = test->rs2;
+  } else if (!m->ordered && (test->rs2 == dst || test->rs2 == src)) {
+    m->cmp = test->rs2;
+    m->end = test->rs1;
+  } else {
+    return false;
+  }
+  return m->end != dst && m->end != src && !(m->copy && m->end == m->load.rd);
+}
+
+static inline bool ranges_overlap(uint64_t a, uint64_t alen, uint64_t b,
+                                  uint64_t blen) {
+  return a < b + blen && b < a + alen;
+}
+
+/* Run (a chunk of) the loop starting at `in`; false to execute normally. */
+static bool run_loop_idiom(Emulator *emu, Insn *in) {
   CPU *cpu = &emu->cpu;
+  uint64_t *x = cpu->x;
+  LoopIdiom *loop = &emu->loops[(cpu->pc >> 1) & (LOOP_CACHE_SIZE - 1)];
 
-  // 1. Fetch
-  if (cpu->pc >= DRAM_SIZE) {
-    printf("PC out of bounds: %016llx\n", cpu->pc);
+  if (in->idiom == IDIOM_UNCHECKED || loop->pc != cpu->pc) {
+    LoopIdiom found;
+    if (cpu->xlen != 64 || !match_loop_idiom(emu, in, cpu->pc, &found)) {
+      in->idiom = IDIOM_NONE;
+      return false;
+    }
+    found.pc = cpu->pc;
+    *loop = found;
+    in->idiom = IDIOM_LOOP;
+  }
+  const LoopIdiom *m = loop;
+
+  // Iteration count from the exit test, bounded per step
+  int w = store_width(m->store.op);
+  uint64_t p = x[m->cmp], end = x[m->end];
+  if (end <= p || (!m->ordered && (end - p) % w))
+    return false;
+  uint64_t n = (end - p + w - 1) / w;
+  if (n > emu->dram_size / w)
     return false;
+  bool done = n <= LOOP_IDIOM_MAX_INSNS / m->insns;
+  if (!done)
+    n = LOOP_IDIOM_MAX_INSNS / m->insns;
+  uint64_t len = n * w;
+
+  uint64_t dst_addr = x[m->store.rs1] + m->store.imm;
+  uint8_t *dst = emu_guest_ptr(emu, dst_addr, len);
+  if (!dst || ranges_overlap(dst_addr, len, m->lo, m->hi - m->lo) ||
+      (emu->tohost && ranges_overlap(dst_addr, len, emu->tohost, 8)))
+    return false;
+
+  if (m->copy) {
+    uint64_t src_addr = x[m->load.rs1] + m->load.imm;
+    const uint8_t *src = emu_guest_ptr(emu, src_addr, len);
+    if (!src || (dst_addr > src_addr && dst_addr - src_addr < len))
+      return false;
+    // The last element is loaded before any store could reach it
+    uint64_t last = 0;
+    memcpy(&last, src + len - w, w);
+    memmove(dst, src, len);
+    switch (m->load.op) {
+    case INSN_LB: last = (int64_t)(int8_t)last; break;
+    case INSN_LH: last = (int64_t)(int16_t)last; break;
+    case INSN_LW: last = sext32(last); break;
+    }
+    x[m->load.rd] = last;
+    x[m->load.rs1] += len;
+  } else {
+    uint64_t v = x[m->store.rs2];
+    uint64_t mask = w == 8 ? UINT64_MAX : (1ULL << (w * 8)) - 1;
+    if ((v & mask) == ((v & 0xFF) * 0x0101010101010101ULL & mask)) {
+      memset(dst, (int)(v & 0xFF), len);
+    } else {
+      for (uint64_t i = 0; i < len; i += w)
+        memcpy(dst + i, &v, w);
+    }
+  }
+  x[m->store.rs1] += len;
+  emu_invalidate_range(emu, dst_addr, len);
+
+  if (done)
+    cpu->pc = m->exit_pc;
+  cpu->instret += n * m->insns;
+  return true;
+}
+
+/*
+ * Fetch-Decode-Execute Cycle
+ */
+void emu_trace_commit(Emulator *emu, const Insn *in, uint64_t pc) {
+  int w = emu->cpu.xlen / 4; // hex digits per XLEN value
+  uint64_t xmask = emu->cpu.xlen == 32 ? UINT32_MAX : UINT64_MAX;
+  FILE *f = emu->trace;
+
+  fprintf(f, "0x%0*" PRIx64 " (0x%0*x)", w, pc, in->len == 2 ? 4 : 8,
+          in->raw);
+  if (in->rd != 0 && insn_writes_rd(in->op))
+    fprintf(f, " x%d 0x%0*" PRIx64, in->rd, w, emu->cpu.x[in->rd] & xmask);
+  if (insn_writes_frd(in->op))
+    fprintf(f, " f%d 0x%016" PRIx64, in->rd, emu->cpu.f[in->rd]);
+  if (emu->trace_mem_size) {
+    int bits = emu->trace_mem_size * 8;
+    uint64_t val = bits == 64 ? emu->trace_mem_val
+                              : emu->trace_mem_val & ((1ULL << bits) - 1);
+    fprintf(f, " mem 0x%0*" PRIx64 " 0x%0*" PRIx64, w,
+            emu->trace_mem_addr & xmask, emu->trace_mem_size * 2, val);
+    emu->trace_mem_size = 0;
   }
+  fputc('\n', f);
+}
+
+bool emu_step(Emulator *emu) {
+  CPU *cpu = &emu->cpu;
+  uint64_t *x = cpu->x;
+  uint64_t pc = cpu->pc;
 
-  // RISC-V instructions are 32-bit (4 bytes)
-  uint32_t inst = *(uint32_t *)&emu->dram[cpu->pc];
+  // Interrupts are taken between instructions. mip only changes on a CSR or
+  // device write, so this is one test on the common path.
+  if ((cpu->mip & cpu->mie) && cpu_interrupt(cpu))
+    return true;
 
-  // 2. Decode
-  uint32_t opcode = inst & 0x7F;        // opcode is in bits [6:0]
-  uint32_t rd = (inst >> 7) & 0x1F;     // destination register [11:7]
-  uint32_t funct3 = (inst >> 12) & 0x7; // funct3 [14:12]
-  uint32_t rs1 = (inst >> 15) & 0x1F;   // source register 1 [19:15]
-  // I-type immediate (sign extended)
-  int32_t imm_i = (int32_t)inst >> 20; // bits [31:20]
+  // 1. Fetch + 2. Decode (cached)
+  Insn *in = lookup_insn(emu, cpu->pc);
+  if (!in)
+    return false;
+  if (in->idiom != IDIOM_NONE && !emu->trace && run_loop_idiom(emu, in))
+    return true;
 
-  printf("\n--------------\nopcode=%02x rd=%02x funct3=%x rs1=%02x imm_i=%d\n",
-         opcode, rd, funct3, rs1, imm_i);
+#ifdef DEBUG_TRACE_EXECUTION
+  printf("\n--------------\n%016" PRIx64 ": %-7s rd=%02d rs1=%02d rs2=%02d "
+         "imm=%" PRId64 " (%s %08x)\n",
+         cpu->pc, insn_name(in->op), in->rd, in->rs1, in->rs2, in->imm,
+         in->len == 2 ? "rvc" : "raw", in->raw);
+#endif
 
   // 3. Execute
-  if (inst == 0) {
-    printf("Halt hit at %016llx\n", cpu->pc);
+  uint64_t rs1 = x[in->rs1];
+  uint64_t rs2 = x[in->rs2];
+  uint64_t next_pc = cpu->pc + in->len;
+  uint64_t xmask = cpu->xlen == 32 ? UINT32_MAX : UINT64_MAX;
+  uint64_t addr = (rs1 + in->imm) & xmask;
+  uint64_t val;
+
+  switch (in->op) {
+  case INSN_HALT:
+    printf("Halt hit at %016" PRIx64 "\n", cpu->pc);
     return false;
+
+  case INSN_LUI: x[in->rd] = in->imm; break;
+  case INSN_AUIPC: x[in->rd] = cpu->pc + in->imm; break;
+
+  case INSN_JAL:
+    x[in->rd] = next_pc;
+    next_pc = cpu->pc + in->imm;
+    break;
+  case INSN_JALR:
+    x[in->rd] = next_pc;
+    next_pc = addr & ~1ULL;
+    break;
+
+  case INSN_BEQ: if (rs1 == rs2) next_pc = cpu->pc + in->imm; break;
+  case INSN_BNE: if (rs1 != rs2) next_pc = cpu->pc + in->imm; break;
+  case INSN_BLT: if ((int64_t)rs1 < (int64_t)rs2) next_pc = cpu->pc + in->imm; break;
+  case INSN_BGE: if ((int64_t)rs1 >= (int64_t)rs2) next_pc = cpu->pc + in->imm; break;
+  case INSN_BLTU: if (rs1 < rs2) next_pc = cpu->pc + in->imm; break;
+  case INSN_BGEU: if (rs1 >= rs2) next_pc = cpu->pc + in->imm; break;
+
+  case INSN_LB:
+    if (!mem_read(emu, addr, 1, &val)) return false;
+    x[in->rd] = (int64_t)(int8_t)val;
+    break;
+  case INSN_LH:
+    if (!mem_read(emu, addr, 2, &val)) return false;
+    x[in->rd] = (int64_t)(int16_t)val;
+    break;
+  case INSN_LW:
+    if (!mem_read(emu, addr, 4, &val)) return false;
+    x[in->rd] = sext32(val);
+    break;
+  case INSN_LD:
+    if (!mem_read(emu, addr, 8, &val)) return false;
+    x[in->rd] = val;
+    break;
+  case INSN_LBU:
+    if (!mem_read(emu, addr, 1, &val)) return false;
+    x[in->rd] = val;
+    break;
+  case INSN_LHU:
+    if (!mem_read(emu, addr, 2, &val)) return false;
+    x[in->rd] = val;
+    break;
+  case INSN_LWU:
+    if (!mem_read(emu, addr, 4, &val)) return false;
+    x[in->rd] = val;
+    break;
+
+  case INSN_SB: if (!mem_write(emu, addr, 1, rs2)) return false; break;
+  case INSN_SH: if (!mem_write(emu, addr, 2, rs2)) return false; break;
+  case INSN_SW: if (!mem_write(emu, addr, 4, rs2)) return false; break;
+  case INSN_SD: if (!mem_write(emu, addr, 8, rs2)) return false; break;
+
+  case INSN_FLW:
+  case INSN_FLD:
+    if (!fp_enabled(cpu))
+      goto illegal;
+    if (!mem_read(emu, addr, in->op == INSN_FLW ? 4 : 8, &val)) return false;
+    cpu->f[in->rd] = in->op == INSN_FLW ? fp_box32(val) : val;
+    cpu->mstatus |= MSTATUS_FS;
+    break;
+  case INSN_FSW:
+  case INSN_FSD:
+    if (!fp_enabled(cpu))
+      goto illegal;
+    if (!mem_write(emu, addr, in->op == INSN_FSW ? 4 : 8, cpu->f[in->rs2]))
+      return false;
+    break;
+
+  case INSN_ADDI: x[in->rd] = rs1 + in->imm; break;
+  case INSN_SLTI: x[in->rd] = (int64_t)rs1 < in->imm; break;
+  case INSN_SLTIU: x[in->rd] = rs1 < (uint64_t)in->imm; break;
+  case INSN_XORI: x[in->rd] = rs1 ^ in->imm; break;
+  case INSN_ORI: x[in->rd] = rs1 | in->imm; break;
+  case INSN_ANDI: x[in->rd] = rs1 & in->imm; break;
+  case INSN_SLLI: x[in->rd] = rs1 << in->imm; break;
+  case INSN_SRLI: x[in->rd] = rs1 >> in->imm; break;
+  case INSN_SRAI: x[in->rd] = (int64_t)rs1 >> in->imm; break;
+
+  case INSN_ADD: x[in->rd] = rs1 + rs2; break;
+  case INSN_SUB: x[in->rd] = rs1 - rs2; break;
+  case INSN_SLL: x[in->rd] = rs1 << (rs2 & 0x3F); break;
+  case INSN_SLT: x[in->rd] = (int64_t)rs1 < (int64_t)rs2; break;
+  case INSN_SLTU: x[in->rd] = rs1 < rs2; break;
+  case INSN_XOR: x[in->rd] = rs1 ^ rs2; break;
+  case INSN_SRL: x[in->rd] = rs1 >> (rs2 & 0x3F); break;
+  case INSN_SRA: x[in->rd] = (int64_t)rs1 >> (rs2 & 0x3F); break;
+  case INSN_OR: x[in->rd] = rs1 | rs2; break;
+  case INSN_AND: x[in->rd] = rs1 & rs2; break;
+
+  case INSN_ADDIW: x[in->rd] = sext32(rs1 + in->imm); break;
+  case INSN_SLLIW: x[in->rd] = sext32((uint32_t)rs1 << in->imm); break;
+  case INSN_SRLIW: x[in->rd] = sext32((uint32_t)rs1 >> in->imm); break;
+  case INSN_SRAIW: x[in->rd] = sext32((int32_t)rs1 >> in->imm); break;
+  case INSN_ADDW: x[in->rd] = sext32(rs1 + rs2); break;
+  case INSN_SUBW: x[in->rd] = sext32(rs1 - rs2); break;
+  case INSN_SLLW: x[in->rd] = sext32((uint32_t)rs1 << (rs2 & 0x1F)); break;
+  case INSN_SRLW: x[in->rd] = sext32((uint32_t)rs1 >> (rs2 & 0x1F)); break;
+  case INSN_SRAW: x[in->rd] = sext32((int32_t)rs1 >> (rs2 & 0x1F)); break;
+
+  case INSN_MUL: x[in->rd] = rs1 * rs2; break;
+  case INSN_MULH: x[in->rd] = mulh(rs1, rs2); break;
+  case INSN_MULHSU: x[in->rd] = mulhsu(rs1, rs2); break;
+  case INSN_MULHU: x[in->rd] = mulhu(rs1, rs2); break;
+  case INSN_DIV:
+    if (rs2 == 0)
+      x[in->rd] = UINT64_MAX;
+    else if ((int64_t)rs1 == INT64_MIN && (int64_t)rs2 == -1)
+      x[in->rd] = rs1;
+    else
+      x[in->rd] = (int64_t)rs1 / (int64_t)rs2;
+    break;
+  case INSN_DIVU: x[in->rd] = rs2 == 0 ? UINT64_MAX : rs1 / rs2; break;
+  case INSN_REM:
+    if (rs2 == 0)
+      x[in->rd] = rs1;
+    else if ((int64_t)rs1 == INT64_MIN && (int64_t)rs2 == -1)
+      x[in->rd] = 0;
+    else
+      x[in->rd] = (int64_t)rs1 % (int64_t)rs2;
+    break;
+  case INSN_REMU: x[in->rd] = rs2 == 0 ? rs1 : rs1 % rs2; break;
+  case INSN_MULW: x[in->rd] = sext32(rs1 * rs2); break;
+  case INSN_DIVW: {
+    int32_t a = rs1, b = rs2;
+    if (b == 0)
+      x[in->rd] = UINT64_MAX;
+    else if (a == INT32_MIN && b == -1)
+      x[in->rd] = sext32(a);
+    else
+      x[in->rd] = sext32(a / b);
+    break;
+  }
+  case INSN_DIVUW: {
+    uint32_t a = rs1, b = rs2;
+    x[in->rd] = b == 0 ? UINT64_MAX : sext32(a / b);
+    break;
   }
+  case INSN_REMW: {
+    int32_t a = rs1, b = rs2;
+    if (b == 0)
+      x[in->rd] = sext32(a);
+    else if (a == INT32_MIN && b == -1)
+      x[in->rd] = 0;
+    else
+      x[in->rd] = sext32(a % b);
+    break;
+  }
+  case INSN_REMUW: {
+    uint32_t a = rs1, b = rs2;
+    x[in->rd] = sext32(b == 0 ? a : a % b);
+    break;
+  }
+  case INSN_MULH32:
+    x[in->rd] = ((int64_t)(int32_t)rs1 * (int32_t)rs2) >> 32;
+    break;
+  case INSN_MULHSU32:
+    x[in->rd] = ((int64_t)(int32_t)rs1 * (uint32_t)rs2) >> 32;
+    break;
+  case INSN_MULHU32:
+    x[in->rd] = ((uint64_t)(uint32_t)rs1 * (uint32_t)rs2) >> 32;
+    break;
 
-  bool executed = false;
-  switch (opcode) {
-  case 0x13:           // OP-IMM (ADDI, etc)
-    if (funct3 == 0) { // ADDI
-      uint64_t val = (rs1 == 0 ? 0 : cpu->x[rs1]) + (int64_t)imm_i;
-      if (rd != 0)
-        cpu->x[rd] = val;
-      executed = true;
+  case INSN_LR_W:
+  case INSN_LR_D: {
+    int size = in->op == INSN_LR_W ? 4 : 8;
+    addr = rs1 & xmask;
+    if (!mem_read(emu, addr, size, &val)) return false;
+    x[in->rd] = size == 4 ? sext32(val) : val;
+    cpu->reservation = addr;
+    cpu->reservation_valid = true;
+    break;
+  }
+  case INSN_SC_W:
+  case INSN_SC_D: {
+    int size = in->op == INSN_SC_W ? 4 : 8;
+    addr = rs1 & xmask;
+    if (cpu->reservation_valid && cpu->reservation == addr) {
+      if (!mem_write(emu, addr, size, rs2)) return false;
+      x[in->rd] = 0;
+    } else {
+      x[in->rd] = 1;
     }
+    cpu->reservation_valid = false;
+    break;
+  }
+  case INSN_AMO_W:
+    addr = rs1 & xmask;
+    if (!mem_read(emu, addr, 4, &val)) return false;
+    val = sext32(val);
+    if (!mem_write(emu, addr, 4, amo_apply(in->imm, val, sext32(rs2), true)))
+      return false;
+    x[in->rd] = val;
     break;
-  case 0x73:                  // SYSTEM
-    if (inst == 0x00000073) { // ECALL
-      printf("ECALL triggered at PC=%016llx\n", cpu->pc);
-      executed = true;
+  case INSN_AMO_D:
+    if (!mem_read(emu, rs1, 8, &val)) return false;
+    if (!mem_write(emu, rs1, 8, amo_apply(in->imm, val, rs2, false)))
+      return false;
+    x[in->rd] = val;
+    break;
+
+  case INSN_CSRRW:
+  case INSN_CSRRS:
+  case INSN_CSRRC:
+  case INSN_CSRRWI:
+  case INSN_CSRRSI:
+  case INSN_CSRRCI: {
+    uint16_t csr = in->imm;
+    bool swap = in->op == INSN_CSRRW || in->op == INSN_CSRRWI;
+    bool set = in->op == INSN_CSRRS || in->op == INSN_CSRRSI;
+    uint64_t src = in->op >= INSN_CSRRWI ? in->rs1 : rs1; // zimm or register
+    uint64_t old = 0;
+    // CSRRW to x0 does not read; CSRRS/CSRRC with x0 / zimm 0 do not write
+    if ((!swap || in->rd != 0) && !csr_read(cpu, csr, &old))
+      goto illegal;
+    if (swap || in->rs1 != 0) {
+      if (!csr_write(cpu, csr, swap ? src : set ? old | src : old & ~src))
+        goto illegal;
     }
+    x[in->rd] = old;
     break;
   }
 
-  if (!executed) {
-    printf("Unknown instruction %08x at %016llx\n", inst, cpu->pc);
+  case INSN_MRET:
+    if (cpu->mode != MODE_MACHINE)
+      goto illegal;
+    cpu_mret(cpu);
+    next_pc = cpu->pc;
+    break;
+  case INSN_SRET:
+    if (cpu->mode < MODE_SUPERVISOR)
+      goto illegal;
+    cpu_sret(cpu);
+    next_pc = cpu->pc;
+    break;
+  case INSN_SFENCE_VMA:
+    if (cpu->mode < MODE_SUPERVISOR)
+      goto illegal;
+    break; // no MMU, nothing cached to flush
+  case INSN_WFI:
+    // Devices complete synchronously, so whatever the guest waits for is
+    // already pending (or never comes): a nop is a valid WFI
+    break;
+
+  case INSN_FENCE:
+    // Single hart, in-order: nothing to order. FENCE.I is covered by the
+    // store-side decode cache invalidation.
+    break;
+
+  case INSN_ECALL:
+    if (emu->pk.enabled && cpu->mode == MODE_USER) {
+      // Proxy kernel: the syscall is serviced on the host
+      pk_syscall(emu);
+      if (emu->pk.exited)
+        return false;
+      break;
+    }
+    if (cpu_trap(cpu, CAUSE_ECALL_U + cpu->mode, 0)) {
+      next_pc = cpu->pc;
+      break;
+    }
+    printf("ECALL triggered at PC=%016" PRIx64 "\n", cpu->pc);
+    break;
+
+  case INSN_EBREAK:
+    if (cpu_trap(cpu, CAUSE_BREAKPOINT, cpu->pc)) {
+      next_pc = cpu->pc;
+      break;
+    }
+    printf("EBREAK hit at %016" PRIx64 "\n", cpu->pc);
+    return false;
+
+  default:
+    if (in->op >= INSN_FP_FIRST && fp_execute(cpu, in))
+      break;
+  illegal:
+    if (cpu_trap(cpu, CAUSE_ILLEGAL_INSN, in->raw)) {
+      next_pc = cpu->pc;
+      break;
+    }
+    printf("Unknown instruction %08x at %016" PRIx64 "\n", in->raw, cpu->pc);
     return false;
   }
 
+  x[0] = 0; // x0 is hardwired to zero, undo any write to it
+  if (cpu->xlen == 32) {
+    // RV32 runs on the RV64 datapath: results and the PC wrap at 32 bits
+    x[in->rd] = sext32(x[in->rd]);
+    next_pc &= UINT32_MAX;
+  }
+
+  if (emu->trace)
+    emu_trace_commit(emu, in, pc);
+
   // Update PC
-  cpu->pc += 4;
+  cpu->pc = next_pc;
+  cpu->instret++;
   return true;
 }
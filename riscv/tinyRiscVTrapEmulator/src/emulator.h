@@ -1,23 +1,120 @@
 #ifndef EMULATOR_H
 #define EMULATOR_H
 
+#include "bus.h"
 #include "cpu.h"
+#include "decode.h"
+#include "pk.h"
+#include "replay.h"
 #include <stddef.h>
+#include <stdio.h>
 
 /*
  * The Bus / Memory interface.
- * For this tiny emulator, we can just have a fixed size memory array.
- * We treat 0x0 as the start of RAM.
+ * For this tiny emulator, we can just have a flat memory array at
+ * [dram_base, dram_base + dram_size). The demo and the proxy kernel put RAM
+ * at 0; bare-metal programs get it from a machine profile. The array
+ * is reserved with mmap, so a large RAM only costs host memory for the pages
+ * the guest touches. Anything outside RAM goes to the machine profile's
+ * regions (bus.h).
  */
-#define DRAM_SIZE (1024 * 1024) // 1MB RAM
+#define DRAM_SIZE (1024 * 1024) // 1MB RAM, default for the demo program
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+
+/*
+ * Decode cache.
+ * Direct-mapped on the (2-byte aligned) PC. Each entry holds the predecoded
+ * instruction, so the fetch/decode cost is only paid the first time a PC is
+ * executed. Stores into a page that holds cached code invalidate it.
+ */
+#define DECODE_CACHE_SIZE 4096 // entries, must be a power of two
 
 typedef struct {
+  uint64_t pc; // tag, DECODE_CACHE_EMPTY when unused
+  Insn insn;
+} DecodeCacheEntry;
+
+#define DECODE_CACHE_EMPTY UINT64_MAX
+
+/*
+ * Loop idioms (see emulator.c) matched so far, direct-mapped on the PC of the
+ * loop's first memory instruction. The decode cache entry at that PC records
+ * whether it starts a loop, so the match runs once per decode; a write to the
+ * loop's code drops the entry and with it the claim on the slot.
+ */
+#define LOOP_CACHE_SIZE 64 // entries, must be a power of two
+
+typedef struct {
+  uint64_t pc;       // tag: the loop's first memory instruction
+  bool copy;         // load + store, else a fill
+  Insn load, store;  // load is unused for a fill
+  uint8_t cmp, end;  // exit test: registers p and end
+  bool ordered;      // bltu/bgeu exit test, else (in)equality
+  int insns;         // instructions retired per iteration
+  uint64_t lo, hi;   // code of the loop
+  uint64_t exit_pc;
+} LoopIdiom;
+
+typedef struct Emulator {
   CPU cpu;
-  uint8_t dram[DRAM_SIZE];
+  DecodeCacheEntry icache[DECODE_CACHE_SIZE];
+  LoopIdiom loops[LOOP_CACHE_SIZE];
+  uint8_t *code_pages; // 1 if the page has cached code
+  uint8_t *dram;
+  uint64_t dram_base;
+  uint64_t dram_size;
+
+  // HTIF-style test signature: the first nonzero store to `tohost` stops
+  // the emulator. 1 means pass, (n << 1) | 1 means test n failed.
+  uint64_t tohost; // guest address, 0 if unused
+  uint64_t tohost_value;
+
+  Machine machine; // ROMs and devices around RAM
+  FILE *console;   // UART output, NULL to discard
+  int console_in;  // host fd for UART input, -1 for none
+  int uart_rx;     // received byte waiting in the UART, -1 if none
+  uint8_t *disk;   // virtio-blk image mapping, NULL for none
+  uint64_t disk_size;
+  bool disk_ro;
+
+  // Commit trace, one line per retired instruction (see emu_trace_commit)
+  FILE *trace;
+  int trace_mem_size; // store seen during this step, 0 if none
+  uint64_t trace_mem_addr;
+  uint64_t trace_mem_val;
+
+  ProxyKernel pk;
+  Replay replay; // record / replay of host inputs
 } Emulator;
 
-void emu_init(Emulator *emu);
+bool emu_init(Emulator *emu, uint64_t dram_base, uint64_t dram_size);
+void emu_free(Emulator *emu);
 bool emu_step(Emulator *emu); // Returns false if halted/error
 void emu_load_program(Emulator *emu, const uint8_t *code, size_t size);
+void emu_flush_decode_cache(Emulator *emu);
+
+/*
+ * Commit trace line for the instruction at `pc`, shared with the Go
+ * riscv_cpu model (its write-back stage) so the two can be diffed with
+ * tools/tracediff:
+ *
+ *   <pc> (<insn>)[ x<rd> <value>][ mem <addr> <value>]
+ *
+ * All numbers are 0x-prefixed lowercase hex; pc, addresses and register
+ * values are XLEN/4 digits wide, the store value is two digits per byte
+ * stored and a compressed instruction is four digits. Writes to x0 are not
+ * listed.
+ */
+void emu_trace_commit(Emulator *emu, const Insn *in, uint64_t pc);
+
+/*
+ * Host pointer for guest range [addr, addr + len), or NULL if any of it is
+ * outside RAM. Writing through it bypasses decode cache invalidation; call
+ * emu_invalidate_range() afterwards.
+ */
+uint8_t *emu_guest_ptr(Emulator *emu, uint64_t addr, uint64_t len);
+void emu_invalidate_range(Emulator *emu, uint64_t addr, uint64_t len);
 
 #endif
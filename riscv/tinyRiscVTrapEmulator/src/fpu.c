@@ -0,0 +1,397 @@
+#include "fpu.h"
+#include <fenv.h>
+#include <math.h>
+#include <string.h>
+
+// GCC has no FENV_ACCESS; the Makefile builds with -frounding-math instead
+#ifdef __clang__
+#pragma STDC FENV_ACCESS ON
+#endif
+
+#define F32_CANON 0x7FC00000U
+#define F64_CANON 0x7FF8000000000000ULL
+#define F32_SIGN 0x80000000U
+#define F64_SIGN 0x8000000000000000ULL
+
+static const int host_rounding[8] = {
+    [RM_RNE] = FE_TONEAREST, [RM_RTZ] = FE_TOWARDZERO,
+    [RM_RDN] = FE_DOWNWARD,  [RM_RUP] = FE_UPWARD,
+    [RM_RMM] = FE_TONEAREST, // closest host mode
+    [5] = FE_TONEAREST,      [6] = FE_TONEAREST, // reserved
+    [7] = FE_TONEAREST,
+};
+
+static inline int frm(const CPU *cpu) { return (cpu->fcsr >> FRM_SHIFT) & 7; }
+
+// ============================================================================
+// Bit-level helpers
+// ============================================================================
+
+static inline float f32(uint32_t bits) {
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+static inline uint32_t bits32(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  return bits;
+}
+
+static inline double f64(uint64_t bits) {
+  double d;
+  memcpy(&d, &bits, sizeof(d));
+  return d;
+}
+
+static inline uint64_t bits64(double d) {
+  uint64_t bits;
+  memcpy(&bits, &d, sizeof(bits));
+  return bits;
+}
+
+static inline bool nan32(uint32_t b) { return (b & ~F32_SIGN) > 0x7F800000U; }
+static inline bool snan32(uint32_t b) { return nan32(b) && !(b & 0x00400000U); }
+
+static inline bool nan64(uint64_t b) {
+  return (b & ~F64_SIGN) > 0x7FF0000000000000ULL;
+}
+static inline bool snan64(uint64_t b) {
+  return nan64(b) && !(b & 0x0008000000000000ULL);
+}
+
+/* Single-precision operand: improperly boxed values read as the canonical NaN */
+static inline uint32_t unbox(uint64_t reg) {
+  return (reg >> 32) == 0xFFFFFFFFU ? (uint32_t)reg : F32_CANON;
+}
+
+static inline void set_s(CPU *cpu, int rd, float r) {
+  cpu->f[rd] = fp_box32(isnan(r) ? F32_CANON : bits32(r));
+}
+
+static inline void set_d(CPU *cpu, int rd, double r) {
+  cpu->f[rd] = isnan(r) ? F64_CANON : bits64(r);
+}
+
+/* FCLASS result for an IEEE value with the given field widths */
+static uint64_t fclass(uint64_t bits, int exp_bits, int frac_bits) {
+  bool neg = (bits >> (exp_bits + frac_bits)) & 1;
+  uint64_t exp = (bits >> frac_bits) & ((1ULL << exp_bits) - 1);
+  uint64_t frac = bits & ((1ULL << frac_bits) - 1);
+
+  if (exp == (1ULL << exp_bits) - 1) {
+    if (frac == 0)
+      return neg ? 1 << 0 : 1 << 7;            // -inf / +inf
+    return frac >> (frac_bits - 1) ? 1 << 9 : 1 << 8; // quiet / signaling
+  }
+  if (exp == 0) {
+    if (frac == 0)
+      return neg ? 1 << 3 : 1 << 4; // -0 / +0
+    return neg ? 1 << 2 : 1 << 5;   // subnormal
+  }
+  return neg ? 1 << 1 : 1 << 6; // normal
+}
+
+/*
+ * FMIN/FMAX: a NaN operand loses to a number, -0 is below +0, and only a
+ * signaling NaN raises invalid. For equal numbers the bits are identical
+ * except for the zero signs, hence the AND/OR.
+ */
+static uint32_t minmax32(CPU *cpu, uint32_t a, uint32_t b, bool max) {
+  if (snan32(a) || snan32(b))
+    cpu->fcsr |= FFLAGS_NV;
+  if (nan32(a))
+    return nan32(b) ? F32_CANON : b;
+  if (nan32(b))
+    return a;
+  if (f32(a) == f32(b))
+    return max ? a & b : a | b;
+  return (f32(a) < f32(b)) != max ? a : b;
+}
+
+static uint64_t minmax64(CPU *cpu, uint64_t a, uint64_t b, bool max) {
+  if (snan64(a) || snan64(b))
+    cpu->fcsr |= FFLAGS_NV;
+  if (nan64(a))
+    return nan64(b) ? F64_CANON : b;
+  if (nan64(b))
+    return a;
+  if (f64(a) == f64(b))
+    return max ? a & b : a | b;
+  return (f64(a) < f64(b)) != max ? a : b;
+}
+
+/* The host flags inf * 0 + qNaN as valid, RISC-V as invalid */
+static inline void fma_check(CPU *cpu, double a, double b) {
+  if ((isinf(a) && b == 0) || (a == 0 && isinf(b)))
+    cpu->fcsr |= FFLAGS_NV;
+}
+
+// ============================================================================
+// Conversion to integer
+// ============================================================================
+
+/* Round to an integral value in mode `rm`, without touching host flags. */
+static double round_integral(double x, int rm) {
+  switch (rm) {
+  case RM_RTZ: return trunc(x);
+  case RM_RDN: return floor(x);
+  case RM_RUP: return ceil(x);
+  case RM_RMM: return round(x);
+  default: { // RNE: x - trunc(x) is exact
+    double t = trunc(x);
+    double frac = fabs(x - t);
+    if (frac > 0.5 || (frac == 0.5 && fmod(t, 2.0) != 0))
+      t += copysign(1.0, x);
+    return t;
+  }
+  }
+}
+
+/*
+ * FCVT.{W,WU,L,LU}: out-of-range values and NaN saturate and raise invalid
+ * (the host would return its "integer indefinite" instead). 32-bit results
+ * are sign-extended, also for WU.
+ */
+static uint64_t fcvt_int(CPU *cpu, double x, int rm, bool is_signed,
+                         int bits) {
+  double hi = is_signed ? ldexp(1.0, bits - 1) : ldexp(1.0, bits);
+  double lo = is_signed ? -hi : 0.0;
+  uint64_t max = is_signed     ? (1ULL << (bits - 1)) - 1
+                 : bits == 64 ? UINT64_MAX
+                              : (1ULL << bits) - 1;
+  uint64_t min = is_signed ? ~max : 0;
+  uint64_t v;
+
+  if (isnan(x)) {
+    cpu->fcsr |= FFLAGS_NV;
+    v = max;
+  } else {
+    double r = round_integral(x, rm);
+    if (r < lo) {
+      cpu->fcsr |= FFLAGS_NV;
+      v = min;
+    } else if (r >= hi) {
+      cpu->fcsr |= FFLAGS_NV;
+      v = max;
+    } else {
+      if (r != x)
+        cpu->fcsr |= FFLAGS_NX;
+      v = is_signed ? (uint64_t)(int64_t)r : (uint64_t)r;
+    }
+  }
+  return bits == 32 ? (uint64_t)(int64_t)(int32_t)v : v;
+}
+
+// ============================================================================
+// Execution
+// ============================================================================
+
+#define S(r) f32(unbox(cpu->f[r]))
+#define D(r) f64(cpu->f[r])
+
+/* Ops that never round: sign injection, min/max, moves, compares, class */
+static bool exec_exact(CPU *cpu, const Insn *in) {
+  uint64_t *f = cpu->f;
+  uint64_t *x = cpu->x;
+  uint32_t a32 = unbox(f[in->rs1]), b32 = unbox(f[in->rs2]);
+  uint64_t a64 = f[in->rs1], b64 = f[in->rs2];
+
+  switch (in->op) {
+  case INSN_FSGNJ_S:
+    f[in->rd] = fp_box32((a32 & ~F32_SIGN) | (b32 & F32_SIGN));
+    break;
+  case INSN_FSGNJN_S:
+    f[in->rd] = fp_box32((a32 & ~F32_SIGN) | (~b32 & F32_SIGN));
+    break;
+  case INSN_FSGNJX_S: f[in->rd] = fp_box32(a32 ^ (b32 & F32_SIGN)); break;
+  case INSN_FMIN_S: f[in->rd] = fp_box32(minmax32(cpu, a32, b32, false)); break;
+  case INSN_FMAX_S: f[in->rd] = fp_box32(minmax32(cpu, a32, b32, true)); break;
+  case INSN_FMV_X_W: x[in->rd] = (int64_t)(int32_t)a64; break; // raw bits
+  case INSN_FMV_W_X: f[in->rd] = fp_box32((uint32_t)x[in->rs1]); break;
+  case INSN_FCLASS_S: x[in->rd] = fclass(a32, 8, 23); break;
+  case INSN_FEQ_S:
+    if (snan32(a32) || snan32(b32))
+      cpu->fcsr |= FFLAGS_NV;
+    x[in->rd] = !nan32(a32) && !nan32(b32) && f32(a32) == f32(b32);
+    break;
+  case INSN_FLT_S:
+  case INSN_FLE_S:
+    if (nan32(a32) || nan32(b32)) {
+      cpu->fcsr |= FFLAGS_NV;
+      x[in->rd] = 0;
+    } else {
+      x[in->rd] = in->op == INSN_FLT_S ? f32(a32) < f32(b32)
+                                       : f32(a32) <= f32(b32);
+    }
+    break;
+
+  case INSN_FSGNJ_D: f[in->rd] = (a64 & ~F64_SIGN) | (b64 & F64_SIGN); break;
+  case INSN_FSGNJN_D: f[in->rd] = (a64 & ~F64_SIGN) | (~b64 & F64_SIGN); break;
+  case INSN_FSGNJX_D: f[in->rd] = a64 ^ (b64 & F64_SIGN); break;
+  case INSN_FMIN_D: f[in->rd] = minmax64(cpu, a64, b64, false); break;
+  case INSN_FMAX_D: f[in->rd] = minmax64(cpu, a64, b64, true); break;
+  case INSN_FMV_X_D: x[in->rd] = a64; break;
+  case INSN_FMV_D_X: f[in->rd] = x[in->rs1]; break;
+  case INSN_FCLASS_D: x[in->rd] = fclass(a64, 11, 52); break;
+  case INSN_FEQ_D:
+    if (snan64(a64) || snan64(b64))
+      cpu->fcsr |= FFLAGS_NV;
+    x[in->rd] = !nan64(a64) && !nan64(b64) && f64(a64) == f64(b64);
+    break;
+  case INSN_FLT_D:
+  case INSN_FLE_D:
+    if (nan64(a64) || nan64(b64)) {
+      cpu->fcsr |= FFLAGS_NV;
+      x[in->rd] = 0;
+    } else {
+      x[in->rd] = in->op == INSN_FLT_D ? f64(a64) < f64(b64)
+                                       : f64(a64) <= f64(b64);
+    }
+    break;
+
+  default:
+    return false;
+  }
+  return true;
+}
+
+/* Ops that round in the host's current mode */
+static bool exec_rounded(CPU *cpu, const Insn *in) {
+  uint64_t *x = cpu->x;
+  int rd = in->rd;
+
+  switch (in->op) {
+  case INSN_FADD_S: set_s(cpu, rd, S(in->rs1) + S(in->rs2)); break;
+  case INSN_FSUB_S: set_s(cpu, rd, S(in->rs1) - S(in->rs2)); break;
+  case INSN_FMUL_S: set_s(cpu, rd, S(in->rs1) * S(in->rs2)); break;
+  case INSN_FDIV_S: set_s(cpu, rd, S(in->rs1) / S(in->rs2)); break;
+  case INSN_FSQRT_S: set_s(cpu, rd, sqrtf(S(in->rs1))); break;
+  case INSN_FMADD_S:
+  case INSN_FMSUB_S:
+  case INSN_FNMSUB_S:
+  case INSN_FNMADD_S: {
+    float a = S(in->rs1), b = S(in->rs2), c = S(in->rs3);
+    fma_check(cpu, a, b);
+    if (in->op == INSN_FNMSUB_S || in->op == INSN_FNMADD_S)
+      a = -a;
+    if (in->op == INSN_FMSUB_S || in->op == INSN_FNMADD_S)
+      c = -c;
+    set_s(cpu, rd, fmaf(a, b, c));
+    break;
+  }
+  case INSN_FCVT_S_W: set_s(cpu, rd, (float)(int32_t)x[in->rs1]); break;
+  case INSN_FCVT_S_WU: set_s(cpu, rd, (float)(uint32_t)x[in->rs1]); break;
+  case INSN_FCVT_S_L: set_s(cpu, rd, (float)(int64_t)x[in->rs1]); break;
+  case INSN_FCVT_S_LU: set_s(cpu, rd, (float)x[in->rs1]); break;
+  case INSN_FCVT_S_D: set_s(cpu, rd, (float)D(in->rs1)); break;
+
+  case INSN_FADD_D: set_d(cpu, rd, D(in->rs1) + D(in->rs2)); break;
+  case INSN_FSUB_D: set_d(cpu, rd, D(in->rs1) - D(in->rs2)); break;
+  case INSN_FMUL_D: set_d(cpu, rd, D(in->rs1) * D(in->rs2)); break;
+  case INSN_FDIV_D: set_d(cpu, rd, D(in->rs1) / D(in->rs2)); break;
+  case INSN_FSQRT_D: set_d(cpu, rd, sqrt(D(in->rs1))); break;
+  case INSN_FMADD_D:
+  case INSN_FMSUB_D:
+  case INSN_FNMSUB_D:
+  case INSN_FNMADD_D: {
+    double a = D(in->rs1), b = D(in->rs2), c = D(in->rs3);
+    fma_check(cpu, a, b);
+    if (in->op == INSN_FNMSUB_D || in->op == INSN_FNMADD_D)
+      a = -a;
+    if (in->op == INSN_FMSUB_D || in->op == INSN_FNMADD_D)
+      c = -c;
+    set_d(cpu, rd, fma(a, b, c));
+    break;
+  }
+  case INSN_FCVT_D_W: set_d(cpu, rd, (double)(int32_t)x[in->rs1]); break;
+  case INSN_FCVT_D_WU: set_d(cpu, rd, (double)(uint32_t)x[in->rs1]); break;
+  case INSN_FCVT_D_L: set_d(cpu, rd, (double)(int64_t)x[in->rs1]); break;
+  case INSN_FCVT_D_LU: set_d(cpu, rd, (double)x[in->rs1]); break;
+  case INSN_FCVT_D_S: set_d(cpu, rd, (double)S(in->rs1)); break;
+
+  default:
+    return false;
+  }
+  return true;
+}
+
+bool fp_execute(CPU *cpu, const Insn *in) {
+  if (!fp_enabled(cpu))
+    return false;
+  cpu->mstatus |= MSTATUS_FS; // dirty
+
+  if (exec_exact(cpu, in))
+    return true;
+
+  int rm = in->rm == RM_DYN ? frm(cpu) : in->rm;
+  if (rm > RM_RMM)
+    return false; // reserved rounding mode
+
+  // Conversions to integer round explicitly in `rm`
+  switch (in->op) {
+  case INSN_FCVT_W_S: cpu->x[in->rd] = fcvt_int(cpu, S(in->rs1), rm, true, 32); return true;
+  case INSN_FCVT_WU_S: cpu->x[in->rd] = fcvt_int(cpu, S(in->rs1), rm, false, 32); return true;
+  case INSN_FCVT_L_S: cpu->x[in->rd] = fcvt_int(cpu, S(in->rs1), rm, true, 64); return true;
+  case INSN_FCVT_LU_S: cpu->x[in->rd] = fcvt_int(cpu, S(in->rs1), rm, false, 64); return true;
+  case INSN_FCVT_W_D: cpu->x[in->rd] = fcvt_int(cpu, D(in->rs1), rm, true, 32); return true;
+  case INSN_FCVT_WU_D: cpu->x[in->rd] = fcvt_int(cpu, D(in->rs1), rm, false, 32); return true;
+  case INSN_FCVT_L_D: cpu->x[in->rd] = fcvt_int(cpu, D(in->rs1), rm, true, 64); return true;
+  case INSN_FCVT_LU_D: cpu->x[in->rd] = fcvt_int(cpu, D(in->rs1), rm, false, 64); return true;
+  }
+
+  // Everything else uses the host mode, which already follows frm unless
+  // the instruction carries a different static mode
+  int host_mode = host_rounding[frm(cpu)];
+  bool switch_mode = host_rounding[rm] != host_mode;
+  if (switch_mode)
+    fesetround(host_rounding[rm]);
+  bool ok = exec_rounded(cpu, in);
+  if (switch_mode)
+    fesetround(host_mode);
+  return ok;
+}
+
+// ============================================================================
+// fcsr and the host FP environment
+// ============================================================================
+
+void fp_sync_flags(CPU *cpu) {
+  int host = fetestexcept(FE_ALL_EXCEPT);
+  if (!host)
+    return;
+  if (host & FE_INEXACT)
+    cpu->fcsr |= FFLAGS_NX;
+  if (host & FE_UNDERFLOW)
+    cpu->fcsr |= FFLAGS_UF;
+  if (host & FE_OVERFLOW)
+    cpu->fcsr |= FFLAGS_OF;
+  if (host & FE_DIVBYZERO)
+    cpu->fcsr |= FFLAGS_DZ;
+  if (host & FE_INVALID)
+    cpu->fcsr |= FFLAGS_NV;
+  feclearexcept(FE_ALL_EXCEPT);
+}
+
+uint32_t fp_read_fcsr(CPU *cpu) {
+  fp_sync_flags(cpu);
+  return cpu->fcsr;
+}
+
+void fp_write_fcsr(CPU *cpu, uint32_t val) {
+  feclearexcept(FE_ALL_EXCEPT); // replaced by the written flags
+  cpu->fcsr = val & 0xFF;
+  fesetround(host_rounding[frm(cpu)]);
+  cpu->mstatus |= MSTATUS_FS;
+}
+
+void fp_enter(CPU *cpu) {
+  feclearexcept(FE_ALL_EXCEPT);
+  fesetround(host_rounding[frm(cpu)]);
+}
+
+void fp_leave(CPU *cpu) {
+  fp_sync_flags(cpu);
+  fesetround(FE_TONEAREST);
+}
@@ -0,0 +1,72 @@
+#ifndef FPU_H
+#define FPU_H
+#include "cpu.h"
+#include "decode.h"
+#include <stdint.h>
+
+/*
+ * F and D extensions, executed with the host's floating point.
+ *
+ * Single-precision values live NaN-boxed in the 64-bit f registers (upper
+ * 32 bits all ones); a single read from a register that is not properly
+ * boxed is the canonical NaN. Arithmetic is the plain C operator on
+ * float/double, so it compiles to the matching host SSE instruction; only
+ * NaN results need fixing up (RISC-V always returns the canonical NaN).
+ *
+ * Rounding: while a guest runs, the host rounding mode follows `frm`, so
+ * the usual dynamic-rounding instruction needs no mode switch. An
+ * instruction with a different static rounding mode switches the host mode
+ * around itself. RMM (ties to max magnitude) has no host equivalent and
+ * rounds to nearest-even in arithmetic; float-to-integer conversions
+ * implement every mode exactly.
+ *
+ * Exception flags are accrued lazily: host operations raise them in the
+ * host FPU's sticky status as a side effect, and they are only collected
+ * into `fcsr` when the guest reads fflags/fcsr or the run ends
+ * (fp_sync_flags). The few cases the host does not flag the RISC-V way
+ * (comparisons, min/max, conversions to integer) set the bits in `fcsr`
+ * directly.
+ *
+ * Host FP state is per thread, so a run loop must bracket emu_step() calls
+ * with fp_enter() / fp_leave(), and the emulator must not do host floating
+ * point in between.
+ */
+
+#define FFLAGS_NX 0x01 // inexact
+#define FFLAGS_UF 0x02 // underflow
+#define FFLAGS_OF 0x04 // overflow
+#define FFLAGS_DZ 0x08 // divide by zero
+#define FFLAGS_NV 0x10 // invalid
+#define FFLAGS_MASK 0x1F
+#define FRM_SHIFT 5
+
+#define RM_RNE 0
+#define RM_RTZ 1
+#define RM_RDN 2
+#define RM_RUP 3
+#define RM_RMM 4
+#define RM_DYN 7
+
+static inline bool fp_enabled(const CPU *cpu) {
+  return (cpu->mstatus & MSTATUS_FS) != 0;
+}
+
+/* Execute an OP-FP / FMA instruction. Returns false if it is illegal. */
+bool fp_execute(CPU *cpu, const Insn *in);
+
+void fp_enter(CPU *cpu);
+void fp_leave(CPU *cpu);
+
+/* Collect the host's accrued exception flags into cpu->fcsr. */
+void fp_sync_flags(CPU *cpu);
+
+/* fcsr as the guest sees it / a guest write to fcsr (fflags and frm). */
+uint32_t fp_read_fcsr(CPU *cpu);
+void fp_write_fcsr(CPU *cpu, uint32_t val);
+
+/* NaN-boxing for FLW and FMV.W.X */
+static inline uint64_t fp_box32(uint32_t bits) {
+  return 0xFFFFFFFF00000000ULL | bits;
+}
+
+#endif // FPU_H
@@ -0,0 +1,328 @@
+#include "loader.h"
+#include "emulator.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * ELF on-disk structures (little-endian). Spelled out here instead of
+ * using <elf.h>, which is not available on macOS. ELF32 files are widened
+ * to the 64-bit layout as they are read.
+ */
+typedef struct {
+  uint8_t e_ident[16];
+  uint16_t e_type;
+  uint16_t e_machine;
+  uint32_t e_version;
+  uint64_t e_entry;
+  uint64_t e_phoff;
+  uint64_t e_shoff;
+  uint32_t e_flags;
+  uint16_t e_ehsize;
+  uint16_t e_phentsize;
+  uint16_t e_phnum;
+  uint16_t e_shentsize;
+  uint16_t e_shnum;
+  uint16_t e_shstrndx;
+} Elf64Ehdr;
+
+typedef struct {
+  uint32_t p_type;
+  uint32_t p_flags;
+  uint64_t p_offset;
+  uint64_t p_vaddr;
+  uint64_t p_paddr;
+  uint64_t p_filesz;
+  uint64_t p_memsz;
+  uint64_t p_align;
+} Elf64Phdr;
+
+typedef struct {
+  uint32_t sh_name;
+  uint32_t sh_type;
+  uint64_t sh_flags;
+  uint64_t sh_addr;
+  uint64_t sh_offset;
+  uint64_t sh_size;
+  uint32_t sh_link;
+  uint32_t sh_info;
+  uint64_t sh_addralign;
+  uint64_t sh_entsize;
+} Elf64Shdr;
+
+typedef struct {
+  uint32_t st_name;
+  uint8_t st_info;
+  uint8_t st_other;
+  uint16_t st_shndx;
+  uint64_t st_value;
+  uint64_t st_size;
+} Elf64Sym;
+
+typedef struct {
+  uint8_t e_ident[16];
+  uint16_t e_type;
+  uint16_t e_machine;
+  uint32_t e_version;
+  uint32_t e_entry;
+  uint32_t e_phoff;
+  uint32_t e_shoff;
+  uint32_t e_flags;
+  uint16_t e_ehsize;
+  uint16_t e_phentsize;
+  uint16_t e_phnum;
+  uint16_t e_shentsize;
+  uint16_t e_shnum;
+  uint16_t e_shstrndx;
+} Elf32Ehdr;
+
+typedef struct {
+  uint32_t p_type;
+  uint32_t p_offset;
+  uint32_t p_vaddr;
+  uint32_t p_paddr;
+  uint32_t p_filesz;
+  uint32_t p_memsz;
+  uint32_t p_flags;
+  uint32_t p_align;
+} Elf32Phdr;
+
+typedef struct {
+  uint32_t sh_name;
+  uint32_t sh_type;
+  uint32_t sh_flags;
+  uint32_t sh_addr;
+  uint32_t sh_offset;
+  uint32_t sh_size;
+  uint32_t sh_link;
+  uint32_t sh_info;
+  uint32_t sh_addralign;
+  uint32_t sh_entsize;
+} Elf32Shdr;
+
+typedef struct {
+  uint32_t st_name;
+  uint32_t st_value;
+  uint32_t st_size;
+  uint8_t st_info;
+  uint8_t st_other;
+  uint16_t st_shndx;
+} Elf32Sym;
+
+#define ELFCLASS32 1
+#define ELFCLASS64 2
+#define ELFDATA2LSB 1
+#define ET_EXEC 2
+#define EM_RISCV 243
+#define PT_LOAD 1
+#define PT_PHDR 6
+#define SHT_SYMTAB 2
+
+static uint8_t *read_file(const char *path, size_t *size) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t *data = malloc(len > 0 ? len : 1);
+  if (!data || fread(data, 1, len, f) != (size_t)len) {
+    fprintf(stderr, "%s: read failed\n", path);
+    free(data);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+  *size = len;
+  return data;
+}
+
+/* Readers for the class-dependent structures; `p` must be in bounds. */
+static void read_phdr(const uint8_t *p, bool is32, Elf64Phdr *ph) {
+  if (!is32) {
+    memcpy(ph, p, sizeof(*ph));
+    return;
+  }
+  Elf32Phdr p32;
+  memcpy(&p32, p, sizeof(p32));
+  *ph = (Elf64Phdr){p32.p_type,  p32.p_flags,  p32.p_offset, p32.p_vaddr,
+                    p32.p_paddr, p32.p_filesz, p32.p_memsz,  p32.p_align};
+}
+
+static void read_shdr(const uint8_t *p, bool is32, Elf64Shdr *sh) {
+  if (!is32) {
+    memcpy(sh, p, sizeof(*sh));
+    return;
+  }
+  Elf32Shdr s32;
+  memcpy(&s32, p, sizeof(s32));
+  *sh = (Elf64Shdr){s32.sh_name,   s32.sh_type,   s32.sh_flags,
+                    s32.sh_addr,   s32.sh_offset, s32.sh_size,
+                    s32.sh_link,   s32.sh_info,   s32.sh_addralign,
+                    s32.sh_entsize};
+}
+
+static void read_sym(const uint8_t *p, bool is32, Elf64Sym *sym) {
+  if (!is32) {
+    memcpy(sym, p, sizeof(*sym));
+    return;
+  }
+  Elf32Sym s32;
+  memcpy(&s32, p, sizeof(s32));
+  *sym = (Elf64Sym){s32.st_name,  s32.st_info,  s32.st_other,
+                    s32.st_shndx, s32.st_value, s32.st_size};
+}
+
+static bool read_ehdr(const uint8_t *data, size_t size, Elf64Ehdr *eh) {
+  if (size >= 5 && data[4] == ELFCLASS32 && size >= sizeof(Elf32Ehdr)) {
+    Elf32Ehdr e32;
+    memcpy(&e32, data, sizeof(e32));
+    memcpy(eh->e_ident, e32.e_ident, sizeof(eh->e_ident));
+    eh->e_type = e32.e_type;
+    eh->e_machine = e32.e_machine;
+    eh->e_version = e32.e_version;
+    eh->e_entry = e32.e_entry;
+    eh->e_phoff = e32.e_phoff;
+    eh->e_shoff = e32.e_shoff;
+    eh->e_flags = e32.e_flags;
+    eh->e_ehsize = e32.e_ehsize;
+    eh->e_phentsize = e32.e_phentsize;
+    eh->e_phnum = e32.e_phnum;
+    eh->e_shentsize = e32.e_shentsize;
+    eh->e_shnum = e32.e_shnum;
+    eh->e_shstrndx = e32.e_shstrndx;
+    return true;
+  }
+  if (size < sizeof(Elf64Ehdr))
+    return false;
+  memcpy(eh, data, sizeof(*eh));
+  return true;
+}
+
+/*
+ * Address of the `tohost` symbol (riscv-tests / HTIF convention), or 0.
+ * Stripped binaries simply have no symbol table.
+ */
+static uint64_t find_tohost(const uint8_t *data, size_t size,
+                            const Elf64Ehdr *eh) {
+  bool is32 = eh->e_ident[4] == ELFCLASS32;
+  size_t shsize = is32 ? sizeof(Elf32Shdr) : sizeof(Elf64Shdr);
+  size_t symsize = is32 ? sizeof(Elf32Sym) : sizeof(Elf64Sym);
+  if (eh->e_shoff == 0 || eh->e_shentsize != shsize ||
+      eh->e_shoff + (uint64_t)eh->e_shnum * shsize > size)
+    return 0;
+
+  for (int i = 0; i < eh->e_shnum; i++) {
+    Elf64Shdr sh, strtab;
+    read_shdr(data + eh->e_shoff + (uint64_t)i * shsize, is32, &sh);
+    if (sh.sh_type != SHT_SYMTAB || sh.sh_link >= eh->e_shnum ||
+        sh.sh_offset + sh.sh_size > size)
+      continue;
+    read_shdr(data + eh->e_shoff + (uint64_t)sh.sh_link * shsize, is32,
+              &strtab);
+    if (strtab.sh_offset + strtab.sh_size > size)
+      continue;
+
+    for (uint64_t off = 0; off + symsize <= sh.sh_size; off += symsize) {
+      Elf64Sym sym;
+      read_sym(data + sh.sh_offset + off, is32, &sym);
+      const char *name = (const char *)data + strtab.sh_offset + sym.st_name;
+      if (sym.st_name + sizeof("tohost") <= strtab.sh_size &&
+          strcmp(name, "tohost") == 0)
+        return sym.st_value;
+    }
+  }
+  return 0;
+}
+
+/* Parse `path` into `info`, and copy its segments into `emu` unless NULL. */
+static bool parse_elf(Emulator *emu, const char *path, ElfInfo *info) {
+  size_t size;
+  uint8_t *data = read_file(path, &size);
+  if (!data)
+    return false;
+
+  Elf64Ehdr eh;
+  if (size < 4 || memcmp(data, "\x7f" "ELF", 4) != 0 ||
+      !read_ehdr(data, size, &eh)) {
+    fprintf(stderr, "%s: not an ELF file\n", path);
+    goto fail;
+  }
+  bool is32 = eh.e_ident[4] == ELFCLASS32;
+  if ((!is32 && eh.e_ident[4] != ELFCLASS64) ||
+      eh.e_ident[5] != ELFDATA2LSB || eh.e_machine != EM_RISCV ||
+      eh.e_type != ET_EXEC) {
+    fprintf(stderr, "%s: not a little-endian RISC-V executable\n", path);
+    goto fail;
+  }
+  size_t phsize = is32 ? sizeof(Elf32Phdr) : sizeof(Elf64Phdr);
+  if (eh.e_phentsize < phsize ||
+      eh.e_phoff + (uint64_t)eh.e_phnum * eh.e_phentsize > size) {
+    fprintf(stderr, "%s: truncated program headers\n", path);
+    goto fail;
+  }
+
+  memset(info, 0, sizeof(*info));
+  info->entry = eh.e_entry;
+  info->phnum = eh.e_phnum;
+  info->phentsize = eh.e_phentsize;
+  info->lo = UINT64_MAX;
+  info->xlen = is32 ? 32 : 64;
+  info->tohost = find_tohost(data, size, &eh);
+
+  for (int i = 0; i < eh.e_phnum; i++) {
+    Elf64Phdr ph;
+    read_phdr(data + eh.e_phoff + (uint64_t)i * eh.e_phentsize, is32, &ph);
+
+    if (ph.p_type == PT_PHDR)
+      info->phdr = ph.p_vaddr;
+    if (ph.p_type != PT_LOAD || ph.p_memsz == 0)
+      continue;
+
+    if (ph.p_filesz > ph.p_memsz || ph.p_offset + ph.p_filesz > size) {
+      fprintf(stderr, "%s: malformed segment %d\n", path, i);
+      goto fail;
+    }
+    if (emu) {
+      uint8_t *dst = emu_guest_ptr(emu, ph.p_vaddr, ph.p_memsz);
+      if (!dst)
+        dst = bus_rom_ptr(emu, ph.p_vaddr, ph.p_memsz);
+      if (!dst) {
+        fprintf(stderr, "%s: segment %d [%llx, %llx) outside RAM and ROM\n",
+                path, i, ph.p_vaddr, ph.p_vaddr + ph.p_memsz);
+        goto fail;
+      }
+      memcpy(dst, data + ph.p_offset, ph.p_filesz);
+      memset(dst + ph.p_filesz, 0, ph.p_memsz - ph.p_filesz);
+    }
+
+    // Program headers usually sit at the start of the first segment
+    if (!info->phdr && eh.e_phoff >= ph.p_offset &&
+        eh.e_phoff < ph.p_offset + ph.p_filesz)
+      info->phdr = ph.p_vaddr + (eh.e_phoff - ph.p_offset);
+
+    if (ph.p_vaddr < info->lo)
+      info->lo = ph.p_vaddr;
+    if (ph.p_vaddr + ph.p_memsz > info->hi)
+      info->hi = ph.p_vaddr + ph.p_memsz;
+  }
+
+  free(data);
+  if (emu)
+    emu_flush_decode_cache(emu);
+  return true;
+
+fail:
+  free(data);
+  return false;
+}
+
+bool elf_probe(const char *path, ElfInfo *info) {
+  return parse_elf(NULL, path, info);
+}
+
+bool elf_load(Emulator *emu, const char *path, ElfInfo *info) {
+  return parse_elf(emu, path, info);
+}
@@ -0,0 +1,28 @@
+#ifndef LOADER_H
+#define LOADER_H
+#include <stdint.h>
+
+struct Emulator;
+
+/*
+ * Minimal ELF loader for statically linked RISC-V executables (ELF64, or
+ * ELF32 for RV32). Only PT_LOAD segments are copied into guest memory (RAM
+ * or a ROM region); no relocation, no dynamic linking.
+ */
+typedef struct {
+  uint64_t entry;
+  uint64_t phdr; // guest address of the program headers (for AT_PHDR)
+  uint16_t phnum;
+  uint16_t phentsize;
+  uint64_t lo; // lowest loaded address
+  uint64_t hi; // end of the highest segment (initial program break)
+  uint64_t tohost; // address of the `tohost` symbol, 0 if there is none
+  int xlen;        // 32 for ELF32, 64 for ELF64
+} ElfInfo;
+
+bool elf_load(struct Emulator *emu, const char *path, ElfInfo *info);
+
+/* Read the headers (and symbols) only, without loading anything. */
+bool elf_probe(const char *path, ElfInfo *info);
+
+#endif // LOADER_H
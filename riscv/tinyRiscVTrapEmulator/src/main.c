@@ -1,25 +1,320 @@
+#include "batch.h"
 #include "cpu.h"
 #include "emulator.h"
+#include "fpu.h"
+#include "snapshot.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static int usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s                      run the built-in demo program\n"
+          "       %s --pk [run options] prog [args...]\n"
+          "                                  run a static RISC-V Linux binary\n"
+          "                                  (--replay: prog optional, taken "
+          "from the log)\n"
+          "       %s --batch [-j jobs] [--max-insns n] [--report out.csv]\n"
+          "                [-v] prog...      run programs in parallel, report "
+          "pass/fail\n"
+          "       %s --machine name|file [run options] [--disk image]\n"
+          "                [--dump addr words] [--trace out] prog.elf\n"
+          "                                  run bare-metal firmware on a "
+          "machine profile\n"
+          "       %s --restore snap [run options] [--disk image]\n"
+          "                [--dump addr words] [--trace out]\n"
+          "                                  resume a machine snapshot\n"
+          "run options: [--max-insns n] [--record log | --replay log]\n"
+          "             [--snapshot n file]  (--pk also takes --restore snap "
+          "instead of prog)\n",
+          prog, prog, prog, prog, prog);
+  return 2;
+}
+
+/* Options shared by --pk and --machine runs */
+typedef struct {
+  uint64_t max_insns;
+  const char *record, *replay; // input log, see replay.h
+  const char *restore;         // start from this snapshot
+  const char *snapshot;        // save a snapshot here...
+  uint64_t snapshot_at;        // ...once this many instructions retired
+  char **argv, **envp;         // --pk program, for the --record log
+} RunOptions;
+
+/* Number of arguments a run option at argv[i] takes up, 0 if not one. */
+static int parse_run_option(int argc, char **argv, int i, RunOptions *o) {
+  const char *opt = argv[i];
+  if (i + 2 < argc && strcmp(opt, "--snapshot") == 0) {
+    o->snapshot_at = strtoull(argv[i + 1], NULL, 0);
+    o->snapshot = argv[i + 2];
+    return 3;
+  }
+  if (i + 1 >= argc)
+    return 0;
+  if (strcmp(opt, "--max-insns") == 0)
+    o->max_insns = strtoull(argv[i + 1], NULL, 0);
+  else if (strcmp(opt, "--record") == 0 && !o->replay)
+    o->record = argv[i + 1];
+  else if (strcmp(opt, "--replay") == 0 && !o->record)
+    o->replay = argv[i + 1];
+  else if (strcmp(opt, "--restore") == 0)
+    o->restore = argv[i + 1];
+  else
+    return 0;
+  return 2;
+}
+
+/*
+ * Run the guest until it stops or retires max_insns instructions, taking the
+ * snapshot on the way. Returns false if a replay diverged.
+ */
+static bool run_guest(Emulator *emu, const RunOptions *o) {
+  if (o->record &&
+      !replay_open(emu, o->record, REPLAY_RECORD, o->argv, o->envp))
+    return false;
+  if (o->replay && !replay_open(emu, o->replay, REPLAY_PLAY, NULL, NULL))
+    return false;
+
+  uint64_t snapshot_at = o->snapshot ? o->snapshot_at : UINT64_MAX;
+  bool running = !emu->replay.diverged;
+  fp_enter(&emu->cpu);
+  while (running && emu->cpu.instret < o->max_insns) {
+    if (emu->cpu.instret >= snapshot_at) {
+      snapshot_save(emu, o->snapshot);
+      snapshot_at = UINT64_MAX;
+    }
+    running = emu_step(emu) && !emu->replay.diverged;
+  }
+  fp_leave(&emu->cpu);
+  if (snapshot_at != UINT64_MAX)
+    fprintf(stderr, "snapshot: run ended at instret %llu, before %llu\n",
+            emu->cpu.instret, snapshot_at);
+  return replay_close(emu);
+}
+
+/*
+ * Proxy-kernel mode: run a user program, servicing its syscalls on the host.
+ * The emulator's exit status is the guest's. A replay loads the program
+ * with the recorded environment, and with the recorded arguments unless
+ * new ones are given.
+ */
+static int run_pk(int argc, char **argv) {
+  static Emulator emu;
+  RunOptions opt = {.max_insns = UINT64_MAX};
+  int i = 0, n;
+  while (i < argc && (n = parse_run_option(argc, argv, i, &opt)))
+    i += n;
+  if (opt.restore ? i != argc : i == argc && !opt.replay)
+    return -1;
+
+  if (opt.restore) {
+    if (!snapshot_restore(&emu, opt.restore))
+      return 1;
+  } else {
+    ReplayArgs logged = {0};
+    if (opt.replay && !replay_read_args(opt.replay, &logged))
+      return 1;
+    int nargs = i < argc ? argc - i : logged.argc;
+    char **args = i < argc ? argv + i : logged.argv;
+    char **env = opt.replay ? logged.envp : environ;
+    if (!emu_init(&emu, 0, PK_DRAM_SIZE)) {
+      replay_free_args(&logged);
+      return 1;
+    }
+    bool ok = pk_load(&emu, nargs, args, env);
+    replay_free_args(&logged);
+    if (!ok) {
+      emu_free(&emu);
+      return 1;
+    }
+    opt.argv = argv + i; // for --record
+    opt.envp = environ;
+  }
+
+  fflush(stdout); // guest output goes straight to fd 1
+  bool replay_ok = run_guest(&emu, &opt);
+
+  int code = emu.pk.exit_code;
+  if (!emu.pk.exited) {
+    fprintf(stderr, "pk: guest stopped without exit at pc=%llx\n",
+            emu.cpu.pc);
+    code = 1;
+  }
+  if (!replay_ok)
+    code = 1;
+  pk_close_all(&emu);
+  emu_free(&emu);
+  return code & 0xFF; // as the shell would see it
+}
+
+static int run_batch(int argc, char **argv) {
+  BatchOptions opt = {0};
+  int i = 0;
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+      opt.jobs = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--max-insns") == 0 && i + 1 < argc)
+      opt.max_insns = strtoull(argv[++i], NULL, 0);
+    else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc)
+      opt.report = argv[++i];
+    else if (strcmp(argv[i], "-v") == 0)
+      opt.verbose = true;
+    else
+      return -1;
+  }
+  if (i == argc)
+    return -1;
+  return batch_run(argc - i, argv + i, &opt) == 0 ? 0 : 1;
+}
+
+/*
+ * Bare-metal mode: boot firmware on a machine profile (see bus.h) and run
+ * it until it halts, reports through tohost/syscon, or faults.
+ */
+static int run_machine(int argc, char **argv) {
+  const char *profile = NULL, *trace = NULL, *disk = NULL;
+  RunOptions opt = {.max_insns = UINT64_MAX};
+  uint64_t dump_addr = 0, dump_words = 0;
+  int i = 0, n;
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    if ((n = parse_run_option(argc, argv, i, &opt)))
+      i += n - 1;
+    else if (strcmp(argv[i], "--machine") == 0 && i + 1 < argc)
+      profile = argv[++i];
+    else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+      trace = argv[++i];
+    else if (strcmp(argv[i], "--disk") == 0 && i + 1 < argc)
+      disk = argv[++i];
+    else if (strcmp(argv[i], "--dump") == 0 && i + 2 < argc) {
+      dump_addr = strtoull(argv[++i], NULL, 0);
+      dump_words = strtoull(argv[++i], NULL, 0);
+    } else
+      return -1;
+  }
+  if (opt.restore ? profile || i != argc : !profile || i + 1 != argc)
+    return -1;
+  if (disk && (opt.record || opt.replay || opt.snapshot || opt.restore)) {
+    // Disk reads are neither logged nor saved: the run would not repeat
+    fprintf(stderr, "--disk cannot be combined with --record, --replay, "
+                    "--snapshot or --restore\n");
+    return 1;
+  }
+
+  static Emulator emu;
+  if (opt.restore) {
+    if (!snapshot_restore(&emu, opt.restore))
+      return 1;
+  } else {
+    Machine machine;
+    ElfInfo info;
+    if (!machine_load(&machine, profile) || !emu_init_machine(&emu, &machine))
+      return 1;
+    if (!elf_load(&emu, argv[i], &info)) {
+      emu_free(&emu);
+      return 1;
+    }
+    emu.cpu.xlen = info.xlen;
+    if (!machine.reset_pc)
+      emu.cpu.pc = info.entry;
+    emu.tohost = info.tohost;
+  }
+  emu.console_in = STDIN_FILENO;
+  if (disk && !virtio_blk_attach(&emu, disk)) {
+    emu_free(&emu);
+    return 1;
+  }
+  if (trace) {
+    emu.trace = strcmp(trace, "-") == 0 ? stdout : fopen(trace, "w");
+    if (!emu.trace) {
+      perror(trace);
+      emu_free(&emu);
+      return 1;
+    }
+  }
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  bool replay_ok = run_guest(&emu, &opt);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+
+  fflush(stdout);
+  fprintf(stderr, "%s: %llu instructions in %.3f s (%.1f MIPS), pc=%llx\n",
+          emu.machine.name, emu.cpu.instret, secs,
+          secs > 0 ? emu.cpu.instret / secs / 1e6 : 0.0, emu.cpu.pc);
+  int code = 0;
+  if (emu.tohost_value) {
+    code = emu.tohost_value == 1 ? 0 : 1;
+    if (code)
+      fprintf(stderr, "FAIL (test case %llu)\n", emu.tohost_value >> 1);
+    else
+      fprintf(stderr, "PASS\n");
+  }
+  if (!replay_ok)
+    code = 1;
+
+  for (uint64_t w = 0; w < dump_words; w++) {
+    uint64_t addr = dump_addr + w * 4;
+    const uint8_t *p = emu_guest_ptr(&emu, addr, 4);
+    if (!p)
+      p = bus_rom_ptr(&emu, addr, 4);
+    if (!p) {
+      printf("%08llx: <unmapped>\n", addr);
+      continue;
+    }
+    uint32_t word;
+    memcpy(&word, p, 4);
+    printf("%08llx: %08x\n", addr, word);
+  }
+
+  emu_free(&emu);
+  return code;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    if (strcmp(argv[1], "--pk") == 0 && argc > 2) {
+      int status = run_pk(argc - 2, argv + 2);
+      return status < 0 ? usage(argv[0]) : status;
+    }
+    if (strcmp(argv[1], "--batch") == 0) {
+      int status = run_batch(argc - 2, argv + 2);
+      return status < 0 ? usage(argv[0]) : status;
+    }
+    if (strcmp(argv[1], "--machine") == 0 ||
+        strcmp(argv[1], "--restore") == 0) {
+      int status = run_machine(argc - 1, argv + 1);
+      return status < 0 ? usage(argv[0]) : status;
+    }
+    return usage(argv[0]);
+  }
 
-int main() {
   printf("RISC-V Trap Emulator initializing...\n");
 
   Emulator emu;
-  emu_init(&emu);
+  if (!emu_init(&emu, 0, DRAM_SIZE))
+    return 1;
 
-  // Manual "Assembly"
+  // Manual "Assembly", as 16-bit parcels so 32-bit and compressed (RVC)
+  // instructions can be mixed
   // ADDI x1, x0, 10  (0x00A00093)
   // ADDI x2, x1, 5   (0x00508113)
+  // C.ADDI x2, 3     (0x010D)
   // ECALL            (0x00000073)
-  uint32_t program[] = {
-      0x00A00093, // ADDI x1, x0, 10
+  uint16_t program[] = {
+      0x0093, 0x00A0, // ADDI x1, x0, 10
+      //
+      0x8113, 0x0050, // ADDI x2, x1, 5
       //
-      0x00508113, // ADDI x2, x1, 5
+      0x010D, // C.ADDI x2, 3
       //
-      0x00000073, // ECALL
+      0x0073, 0x0000, // ECALL
       //
-      0x00000000 // halt
+      0x0000 // halt
   };
 
   emu_load_program(&emu, (uint8_t *)program, sizeof(program));
@@ -33,5 +328,6 @@ int main() {
   }
 
   printf("Done.\n");
+  emu_free(&emu);
   return 0;
 }
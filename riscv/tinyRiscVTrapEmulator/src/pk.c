@@ -0,0 +1,661 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS, openat, ... under -std=c23 on glibc
+#include "pk.h"
+#include "emulator.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Linux RISC-V (asm-generic) syscall numbers. Both musl and newlib's
+ * libgloss use these.
+ */
+#define SYS_ioctl 29
+#define SYS_openat 56
+#define SYS_close 57
+#define SYS_lseek 62
+#define SYS_read 63
+#define SYS_write 64
+#define SYS_readv 65
+#define SYS_writev 66
+#define SYS_newfstatat 79
+#define SYS_fstat 80
+#define SYS_exit 93
+#define SYS_exit_group 94
+#define SYS_set_tid_address 96
+#define SYS_set_robust_list 99
+#define SYS_clock_gettime 113
+#define SYS_rt_sigaction 134
+#define SYS_rt_sigprocmask 135
+#define SYS_gettimeofday 169
+#define SYS_getpid 172
+#define SYS_brk 214
+#define SYS_munmap 215
+#define SYS_mmap 222
+#define SYS_mprotect 226
+
+// Guest (Linux) flag values; the host may use different numbers (macOS)
+#define LINUX_AT_FDCWD -100
+#define LINUX_AT_EMPTY_PATH 0x1000
+#define LINUX_O_CREAT 0100
+#define LINUX_O_EXCL 0200
+#define LINUX_O_TRUNC 01000
+#define LINUX_O_APPEND 02000
+#define LINUX_O_NONBLOCK 04000
+#define LINUX_O_DIRECTORY 0200000
+#define LINUX_O_CLOEXEC 02000000
+#define LINUX_MAP_FIXED 0x10
+#define LINUX_MAP_ANONYMOUS 0x20
+
+// Auxiliary vector tags
+#define AT_NULL 0
+#define AT_PHDR 3
+#define AT_PHENT 4
+#define AT_PHNUM 5
+#define AT_PAGESZ 6
+#define AT_ENTRY 9
+#define AT_RANDOM 25
+
+#define PAGE_ROUND_UP(x) (((x) + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1))
+
+// ============================================================================
+// File descriptors
+// ============================================================================
+
+static int host_fd(ProxyKernel *pk, uint64_t fd) {
+  return fd < PK_MAX_FDS ? pk->fds[fd] : -1;
+}
+
+static int64_t alloc_fd(ProxyKernel *pk, int hostfd) {
+  for (int i = 0; i < PK_MAX_FDS; i++) {
+    if (pk->fds[i] < 0) {
+      pk->fds[i] = hostfd;
+      return i;
+    }
+  }
+  close(hostfd);
+  return -EMFILE;
+}
+
+void pk_close_all(Emulator *emu) {
+  ProxyKernel *pk = &emu->pk;
+  for (int i = 0; i < PK_MAX_FDS; i++) {
+    if (pk->fds[i] > 2) // the emulator's own stdio stays open
+      close(pk->fds[i]);
+    pk->fds[i] = -1;
+  }
+}
+
+static int host_open_flags(uint64_t f) {
+  int flags = f & 3; // O_RDONLY / O_WRONLY / O_RDWR agree everywhere
+  if (f & LINUX_O_CREAT) flags |= O_CREAT;
+  if (f & LINUX_O_EXCL) flags |= O_EXCL;
+  if (f & LINUX_O_TRUNC) flags |= O_TRUNC;
+  if (f & LINUX_O_APPEND) flags |= O_APPEND;
+  if (f & LINUX_O_NONBLOCK) flags |= O_NONBLOCK;
+  if (f & LINUX_O_DIRECTORY) flags |= O_DIRECTORY;
+  if (f & LINUX_O_CLOEXEC) flags |= O_CLOEXEC;
+  return flags;
+}
+
+static int host_dirfd(ProxyKernel *pk, int64_t dirfd) {
+  return dirfd == LINUX_AT_FDCWD ? AT_FDCWD : host_fd(pk, dirfd);
+}
+
+// NUL-terminated guest string, or NULL if it runs off the end of RAM
+static const char *guest_str(Emulator *emu, uint64_t addr) {
+  const char *s = (const char *)emu_guest_ptr(emu, addr, 1); // addr in RAM
+  if (!s)
+    return NULL;
+  uint64_t max = emu->dram_base + emu->dram_size - addr;
+  return memchr(s, 0, max) ? s : NULL;
+}
+
+// ============================================================================
+// struct stat (asm-generic layout, 128 bytes)
+// ============================================================================
+
+static void put64(uint8_t *p, uint64_t v) { memcpy(p, &v, 8); }
+static void put32(uint8_t *p, uint32_t v) { memcpy(p, &v, 4); }
+
+static void put_stat(uint8_t *dst, const struct stat *st) {
+  memset(dst, 0, 128);
+  put64(dst + 0, st->st_dev);
+  put64(dst + 8, st->st_ino);
+  put32(dst + 16, st->st_mode);
+  put32(dst + 20, st->st_nlink);
+  put32(dst + 24, st->st_uid);
+  put32(dst + 28, st->st_gid);
+  put64(dst + 32, st->st_rdev);
+  put64(dst + 48, st->st_size);
+  put32(dst + 56, st->st_blksize);
+  put64(dst + 64, st->st_blocks);
+  put64(dst + 72, st->st_atime);
+  put64(dst + 88, st->st_mtime);
+  put64(dst + 104, st->st_ctime);
+}
+
+// ============================================================================
+// Syscalls
+// ============================================================================
+
+// Syscalls return -errno in host numbering; pk_syscall hands the guest the
+// Linux number (they differ past ERANGE on macOS: ENOSYS, ELOOP, ...)
+static int64_t host_ret(int64_t r) { return r < 0 ? -(int64_t)errno : r; }
+
+static const struct {
+  int host, guest;
+} errno_map[] = {
+    {EPERM, 1},    {ENOENT, 2},       {ESRCH, 3},      {EINTR, 4},
+    {EIO, 5},      {ENXIO, 6},        {E2BIG, 7},      {ENOEXEC, 8},
+    {EBADF, 9},    {ECHILD, 10},      {EAGAIN, 11},    {ENOMEM, 12},
+    {EACCES, 13},  {EFAULT, 14},      {EBUSY, 16},     {EEXIST, 17},
+    {EXDEV, 18},   {ENODEV, 19},      {ENOTDIR, 20},   {EISDIR, 21},
+    {EINVAL, 22},  {ENFILE, 23},      {EMFILE, 24},    {ENOTTY, 25},
+    {ETXTBSY, 26}, {EFBIG, 27},       {ENOSPC, 28},    {ESPIPE, 29},
+    {EROFS, 30},   {EMLINK, 31},      {EPIPE, 32},     {EDOM, 33},
+    {ERANGE, 34},  {EDEADLK, 35},     {ENAMETOOLONG, 36}, {ENOLCK, 37},
+    {ENOSYS, 38},  {ENOTEMPTY, 39},   {ELOOP, 40},     {EOVERFLOW, 75},
+    {EOPNOTSUPP, 95}, {ETIMEDOUT, 110},
+};
+
+/* Linux (asm-generic) number for a host errno; EIO if it has none here */
+static int64_t linux_errno(int e) {
+  for (size_t i = 0; i < sizeof(errno_map) / sizeof(errno_map[0]); i++)
+    if (errno_map[i].host == e)
+      return errno_map[i].guest;
+  return 5;
+}
+
+// Guest memory filled with host data: logged when recording (replay.h)
+static void guest_written(Emulator *emu, uint64_t addr, uint64_t len) {
+  emu_invalidate_range(emu, addr, len);
+  replay_log_mem(emu, addr, len);
+}
+
+static int64_t sys_rw(Emulator *emu, int nr, uint64_t fd, uint64_t buf,
+                      uint64_t len) {
+  int hfd = host_fd(&emu->pk, fd);
+  if (hfd < 0)
+    return -EBADF;
+  uint8_t *p = emu_guest_ptr(emu, buf, len);
+  if (!p)
+    return -EFAULT;
+  if (nr == SYS_write)
+    return host_ret(write(hfd, p, len));
+  ssize_t r = read(hfd, p, len);
+  if (r > 0)
+    guest_written(emu, buf, r);
+  return host_ret(r);
+}
+
+static int64_t sys_rwv(Emulator *emu, int nr, uint64_t fd, uint64_t iov_addr,
+                       uint64_t iovcnt) {
+  int hfd = host_fd(&emu->pk, fd);
+  if (hfd < 0)
+    return -EBADF;
+  if (iovcnt > 64)
+    return -EINVAL;
+  const uint8_t *giov = emu_guest_ptr(emu, iov_addr, iovcnt * 16);
+  if (!giov)
+    return -EFAULT;
+
+  // Point the host iovecs straight at guest RAM
+  struct iovec iov[64];
+  for (uint64_t i = 0; i < iovcnt; i++) {
+    uint64_t base, len;
+    memcpy(&base, giov + i * 16, 8);
+    memcpy(&len, giov + i * 16 + 8, 8);
+    iov[i].iov_base = emu_guest_ptr(emu, base, len);
+    iov[i].iov_len = len;
+    if (!iov[i].iov_base && len)
+      return -EFAULT;
+  }
+  if (nr == SYS_writev)
+    return host_ret(writev(hfd, iov, iovcnt));
+
+  ssize_t r = readv(hfd, iov, iovcnt);
+  for (uint64_t i = 0; i < iovcnt && r > 0; i++) {
+    uint64_t base;
+    memcpy(&base, giov + i * 16, 8);
+    guest_written(emu, base, iov[i].iov_len);
+  }
+  return host_ret(r);
+}
+
+static int64_t sys_openat(Emulator *emu, int64_t dirfd, uint64_t path,
+                          uint64_t flags, uint64_t mode) {
+  const char *p = guest_str(emu, path);
+  if (!p)
+    return -EFAULT;
+  int hdir = host_dirfd(&emu->pk, dirfd);
+  if (hdir == -1)
+    return -EBADF;
+  int hfd = openat(hdir, p, host_open_flags(flags), (mode_t)mode);
+  if (hfd < 0)
+    return -errno;
+  return alloc_fd(&emu->pk, hfd);
+}
+
+static int64_t sys_close(Emulator *emu, uint64_t fd) {
+  int hfd = host_fd(&emu->pk, fd);
+  if (hfd < 0)
+    return -EBADF;
+  emu->pk.fds[fd] = -1;
+  // Never close the emulator's own stdio
+  return hfd > 2 ? host_ret(close(hfd)) : 0;
+}
+
+static int64_t sys_fstatat(Emulator *emu, int64_t dirfd, uint64_t path,
+                           uint64_t st_addr, uint64_t flags) {
+  uint8_t *dst = emu_guest_ptr(emu, st_addr, 128);
+  if (!dst)
+    return -EFAULT;
+  const char *p = path ? guest_str(emu, path) : "";
+  if (!p)
+    return -EFAULT;
+
+  struct stat st;
+  int r;
+  if (p[0] == '\0' && (flags & LINUX_AT_EMPTY_PATH || path == 0)) {
+    int hfd = host_fd(&emu->pk, dirfd);
+    if (hfd < 0)
+      return -EBADF;
+    r = fstat(hfd, &st);
+  } else {
+    int hdir = host_dirfd(&emu->pk, dirfd);
+    if (hdir == -1)
+      return -EBADF;
+    r = fstatat(hdir, p, &st, 0);
+  }
+  if (r < 0)
+    return -errno;
+  put_stat(dst, &st);
+  guest_written(emu, st_addr, 128);
+  return 0;
+}
+
+static int64_t sys_clock_gettime(Emulator *emu, uint64_t clk, uint64_t ts) {
+  uint8_t *dst = emu_guest_ptr(emu, ts, 16);
+  if (!dst)
+    return -EFAULT;
+  clockid_t id;
+  switch (clk) {
+  case 0: id = CLOCK_REALTIME; break;
+  case 2:
+  case 3: id = CLOCK_PROCESS_CPUTIME_ID; break;
+  default: id = CLOCK_MONOTONIC; break; // MONOTONIC, _RAW, BOOTTIME, ...
+  }
+  struct timespec t;
+  if (clock_gettime(id, &t) < 0)
+    return -errno;
+  put64(dst, t.tv_sec);
+  put64(dst + 8, t.tv_nsec);
+  guest_written(emu, ts, 16);
+  return 0;
+}
+
+static int64_t sys_gettimeofday(Emulator *emu, uint64_t tv) {
+  uint8_t *dst = emu_guest_ptr(emu, tv, 16);
+  if (!dst)
+    return -EFAULT;
+  struct timeval t;
+  gettimeofday(&t, NULL);
+  put64(dst, t.tv_sec);
+  put64(dst + 8, t.tv_usec);
+  guest_written(emu, tv, 16);
+  return 0;
+}
+
+static int64_t sys_brk(Emulator *emu, uint64_t addr) {
+  ProxyKernel *pk = &emu->pk;
+  if (addr < pk->brk_start || addr > pk->mmap_top)
+    return pk->brk; // failure: report the unchanged break
+  if (addr > pk->brk) // memory handed out again must read as zero
+    memset(emu_guest_ptr(emu, pk->brk, addr - pk->brk), 0, addr - pk->brk);
+  pk->brk = addr;
+  return addr;
+}
+
+/*
+ * Mappings come out of [mmap_top, stack_top - PK_STACK_SIZE). Memory
+ * returned by munmap is zeroed there and then, so neither a hole nor the
+ * fresh pages below mmap_top (untouched host memory) need clearing when
+ * they are handed out again.
+ */
+
+/* Forget the part of every hole that overlaps [base, base + len). */
+static void holes_take(ProxyKernel *pk, uint64_t base, uint64_t len) {
+  for (int i = 0; i < pk->nholes; i++) {
+    PkRange h = pk->holes[i];
+    if (h.base >= base + len || h.base + h.len <= base)
+      continue;
+    uint64_t below = base > h.base ? base - h.base : 0;
+    uint64_t above_base = base + len, h_end = h.base + h.len;
+    pk->holes[i].len = below;
+    if (h_end > above_base && pk->nholes < PK_MAX_HOLES)
+      pk->holes[pk->nholes++] = (PkRange){above_base, h_end - above_base};
+    // (a full table drops the upper part: it is never reused)
+  }
+  for (int i = 0; i < pk->nholes;) {
+    if (pk->holes[i].len == 0)
+      pk->holes[i] = pk->holes[--pk->nholes];
+    else
+      i++;
+  }
+}
+
+/* Zero [base, base + len) and give it back to the mmap area. */
+static void mmap_release(Emulator *emu, uint64_t base, uint64_t len) {
+  ProxyKernel *pk = &emu->pk;
+  memset(emu_guest_ptr(emu, base, len), 0, len);
+  emu_invalidate_range(emu, base, len);
+
+  // Coalesce with the holes it overlaps or touches
+  for (int i = 0; i < pk->nholes;) {
+    PkRange h = pk->holes[i];
+    if (h.base > base + len || h.base + h.len < base) {
+      i++;
+      continue;
+    }
+    uint64_t end = h.base + h.len > base + len ? h.base + h.len : base + len;
+    base = h.base < base ? h.base : base;
+    len = end - base;
+    pk->holes[i] = pk->holes[--pk->nholes];
+  }
+  if (base == pk->mmap_top)
+    pk->mmap_top += len;
+  else if (pk->nholes < PK_MAX_HOLES)
+    pk->holes[pk->nholes++] = (PkRange){base, len};
+  // (a full table drops the range: it is never reused)
+}
+
+/*
+ * Take [base, base + len) for a new mapping, at addr if MAP_FIXED. Only the
+ * bookkeeping: the caller fills the range.
+ *
+ * A fixed mapping may only replace memory the program has already: below
+ * the break, or in the mmap area. Between the two it would be invisible to
+ * brk and to later mmaps, which could then hand the same pages out again.
+ */
+static int64_t mmap_reserve(Emulator *emu, uint64_t addr, uint64_t len,
+                            uint64_t flags) {
+  ProxyKernel *pk = &emu->pk;
+  if (flags & LINUX_MAP_FIXED) {
+    uint64_t end = addr + len;
+    if (addr % PAGE_SIZE)
+      return -EINVAL;
+    if (end < addr || !emu_guest_ptr(emu, addr, len))
+      return -ENOMEM;
+    if (addr >= pk->mmap_top && end <= pk->stack_top - PK_STACK_SIZE)
+      holes_take(pk, addr, len);
+    else if (end > pk->brk)
+      return -ENOMEM;
+    return addr;
+  }
+  // First fit among the holes, else fresh pages below mmap_top
+  for (int i = 0; i < pk->nholes; i++) {
+    PkRange *h = &pk->holes[i];
+    if (h->len < len)
+      continue;
+    uint64_t base = h->base;
+    h->base += len;
+    h->len -= len;
+    if (h->len == 0)
+      *h = pk->holes[--pk->nholes];
+    return base;
+  }
+  if (pk->mmap_top - pk->brk < len)
+    return -ENOMEM;
+  pk->mmap_top -= len;
+  return pk->mmap_top;
+}
+
+static int64_t sys_mmap(Emulator *emu, uint64_t addr, uint64_t len,
+                        uint64_t flags, int64_t fd, uint64_t off) {
+  len = PAGE_ROUND_UP(len);
+  if (len == 0)
+    return -EINVAL;
+  int hfd = -1;
+  if (!(flags & LINUX_MAP_ANONYMOUS) && (hfd = host_fd(&emu->pk, fd)) < 0)
+    return -EBADF;
+
+  int64_t base = mmap_reserve(emu, addr, len, flags);
+  if (base < 0)
+    return base;
+  uint8_t *p = emu_guest_ptr(emu, base, len);
+  if (flags & LINUX_MAP_FIXED)
+    memset(p, 0, len);
+  if (hfd < 0) {
+    emu_invalidate_range(emu, base, len);
+    return base;
+  }
+  int64_t ret = pread(hfd, p, len, off) < 0 ? -errno : base;
+  if (ret < 0 && !(flags & LINUX_MAP_FIXED)) {
+    mmap_release(emu, base, len);
+    return ret;
+  }
+  // The whole range, so a replay need not zero the tail
+  guest_written(emu, base, len);
+  return ret;
+}
+
+static int64_t sys_munmap(Emulator *emu, uint64_t addr, uint64_t len) {
+  ProxyKernel *pk = &emu->pk;
+  len = PAGE_ROUND_UP(len);
+  if (addr % PAGE_SIZE || len == 0)
+    return -EINVAL;
+  // Only the mmap area is managed; unmapping elsewhere is a no-op
+  if (addr >= pk->mmap_top && addr + len >= addr &&
+      addr + len <= pk->stack_top - PK_STACK_SIZE)
+    mmap_release(emu, addr, len);
+  return 0;
+}
+
+/*
+ * A replayed file mapping gets its contents from the log, but must still
+ * come out of the mmap area where the recorded one did.
+ */
+static void mmap_replayed(Emulator *emu, int64_t ret, uint64_t addr,
+                          uint64_t len, uint64_t flags) {
+  if (ret >= 0 && mmap_reserve(emu, addr, PAGE_ROUND_UP(len), flags) != ret)
+    replay_diverge(emu, "mmap placed the mapping elsewhere");
+}
+
+/*
+ * Syscalls whose result depends on the host, and so go through replay.h:
+ * the number is in a7, mmap flags in a3.
+ */
+static bool host_dependent(const uint64_t *x) {
+  switch (x[17]) {
+  case SYS_read: case SYS_write: case SYS_readv: case SYS_writev:
+  case SYS_openat: case SYS_close: case SYS_lseek:
+  case SYS_fstat: case SYS_newfstatat:
+  case SYS_clock_gettime: case SYS_gettimeofday:
+    return true;
+  case SYS_mmap:
+    return !(x[13] & LINUX_MAP_ANONYMOUS); // file contents
+  default:
+    return false;
+  }
+}
+
+void pk_syscall(Emulator *emu) {
+  uint64_t *x = emu->cpu.x;
+  uint64_t a0 = x[10], a1 = x[11], a2 = x[12], a3 = x[13], a4 = x[14],
+           a5 = x[15];
+  uint64_t nr = x[17];
+  int64_t ret;
+
+  if (emu->replay.mode == REPLAY_PLAY && host_dependent(x)) {
+    // The host is not consulted, but console output is still shown
+    bool console = a0 == 1 || a0 == 2;
+    if (nr == SYS_write && console)
+      sys_rw(emu, nr, a0, a1, a2);
+    else if (nr == SYS_writev && console)
+      sys_rwv(emu, nr, a0, a1, a2);
+    x[10] = replay_syscall(emu, nr);
+    if (nr == SYS_mmap)
+      mmap_replayed(emu, x[10], a0, a1, a3);
+    return;
+  }
+
+  switch (nr) {
+  case SYS_read:
+  case SYS_write: ret = sys_rw(emu, nr, a0, a1, a2); break;
+  case SYS_readv:
+  case SYS_writev: ret = sys_rwv(emu, nr, a0, a1, a2); break;
+  case SYS_openat: ret = sys_openat(emu, a0, a1, a2, a3); break;
+  case SYS_close: ret = sys_close(emu, a0); break;
+  case SYS_lseek: {
+    int hfd = host_fd(&emu->pk, a0);
+    ret = hfd < 0 ? -EBADF : host_ret(lseek(hfd, a1, a2));
+    break;
+  }
+  case SYS_fstat: ret = sys_fstatat(emu, a0, 0, a1, LINUX_AT_EMPTY_PATH); break;
+  case SYS_newfstatat: ret = sys_fstatat(emu, a0, a1, a2, a3); break;
+  case SYS_clock_gettime: ret = sys_clock_gettime(emu, a0, a1); break;
+  case SYS_gettimeofday: ret = sys_gettimeofday(emu, a0); break;
+  case SYS_brk: ret = sys_brk(emu, a0); break;
+  case SYS_mmap: ret = sys_mmap(emu, a0, a1, a3, a4, a5); break;
+  case SYS_munmap: ret = sys_munmap(emu, a0, a1); break;
+
+  case SYS_exit:
+  case SYS_exit_group:
+    emu->pk.exited = true;
+    emu->pk.exit_code = (int)a0;
+    return;
+
+  // Single-threaded, signal-free guest: accept and ignore
+  case SYS_mprotect:
+  case SYS_set_robust_list:
+  case SYS_rt_sigaction:
+  case SYS_rt_sigprocmask: ret = 0; break;
+  case SYS_set_tid_address:
+  case SYS_getpid: ret = 1; break;
+  case SYS_ioctl: ret = -ENOTTY; break;
+
+  default:
+    fprintf(stderr, "pk: unimplemented syscall %llu at pc=%llx\n", nr,
+            emu->cpu.pc);
+    ret = -ENOSYS;
+    break;
+  }
+
+  if (ret < 0 && ret > -4096)
+    ret = -linux_errno(-ret);
+  if (host_dependent(x))
+    replay_log_syscall(emu, nr, ret);
+  x[10] = ret;
+}
+
+// ============================================================================
+// Program loading and initial stack
+// ============================================================================
+
+/*
+ * Linux initial stack, from sp upwards:
+ *
+ *   argc
+ *   argv[0] ... argv[argc-1], NULL
+ *   envp[0] ... NULL
+ *   auxv (tag, value) pairs ... AT_NULL
+ *   ... padding, AT_RANDOM bytes, argument and environment strings
+ */
+bool pk_load(Emulator *emu, int argc, char **argv, char **envp) {
+  ProxyKernel *pk = &emu->pk;
+  ElfInfo info;
+
+  if (!elf_load(emu, argv[0], &info))
+    return false;
+  if (info.xlen != 64) {
+    fprintf(stderr, "%s: the proxy kernel only runs RV64 programs\n",
+            argv[0]);
+    return false;
+  }
+
+  pk->enabled = true;
+  emu->cpu.mstatus |= MSTATUS_FS_INITIAL; // as Linux starts user programs
+  pk->exited = false;
+  pk->exit_code = 0;
+  for (int i = 0; i < PK_MAX_FDS; i++)
+    pk->fds[i] = i < 3 ? i : -1;
+
+  pk->brk_start = pk->brk = PAGE_ROUND_UP(info.hi);
+  pk->stack_top = emu->dram_base + emu->dram_size;
+  pk->mmap_top = pk->stack_top - PK_STACK_SIZE;
+  pk->nholes = 0;
+
+  int envc = 0;
+  while (envp && envp[envc])
+    envc++;
+
+  // Strings at the very top of the stack: the environment, then the
+  // arguments above it
+  uint64_t argbytes = 0, envbytes = 0;
+  for (int i = 0; i < argc; i++)
+    argbytes += strlen(argv[i]) + 1;
+  for (int i = 0; i < envc; i++)
+    envbytes += strlen(envp[i]) + 1;
+  if (argbytes + envbytes > PK_STACK_SIZE)
+    goto too_big;
+  uint64_t env_strs = pk->stack_top - argbytes - envbytes;
+  uint64_t arg_strs = env_strs + envbytes;
+
+  // 16 "random" bytes for the libc stack protector; fixed so runs repeat
+  uint64_t random_addr = (env_strs - 16) & ~15ULL;
+
+  uint64_t auxv[][2] = {
+      {AT_PHDR, info.phdr},       {AT_PHENT, info.phentsize},
+      {AT_PHNUM, info.phnum},     {AT_PAGESZ, PAGE_SIZE},
+      {AT_ENTRY, info.entry},     {AT_RANDOM, random_addr},
+      {AT_NULL, 0},
+  };
+  size_t nauxv = sizeof(auxv) / sizeof(auxv[0]);
+  uint64_t words = 1 + (argc + 1) + (envc + 1) + 2 * nauxv;
+  uint64_t sp = (random_addr - words * 8) & ~15ULL;
+  // As execve does, refuse what does not fit the stack
+  if (pk->stack_top - sp > PK_STACK_SIZE)
+    goto too_big;
+
+  memcpy(emu_guest_ptr(emu, random_addr, 16), "tinyRiscVTrapEmu", 16);
+  uint8_t *p = emu_guest_ptr(emu, sp, words * 8);
+  put64(p, argc);
+  p += 8;
+  for (int i = 0; i < argc; i++, p += 8) {
+    size_t n = strlen(argv[i]) + 1;
+    memcpy(emu_guest_ptr(emu, arg_strs, n), argv[i], n);
+    put64(p, arg_strs);
+    arg_strs += n;
+  }
+  put64(p, 0);
+  p += 8;
+  for (int i = 0; i < envc; i++, p += 8) {
+    size_t n = strlen(envp[i]) + 1;
+    memcpy(emu_guest_ptr(emu, env_strs, n), envp[i], n);
+    put64(p, env_strs);
+    env_strs += n;
+  }
+  put64(p, 0);
+  p += 8;
+  for (size_t i = 0; i < nauxv; i++, p += 16) {
+    put64(p, auxv[i][0]);
+    put64(p + 8, auxv[i][1]);
+  }
+
+  CPU *cpu = &emu->cpu;
+  cpu->pc = info.entry;
+  cpu->x[2] = sp; // sp
+  cpu->mode = MODE_USER;
+  return true;
+
+too_big:
+  fprintf(stderr, "%s: arguments and environment: %s\n", argv[0],
+          strerror(E2BIG));
+  return false;
+}
@@ -0,0 +1,55 @@
+#ifndef PK_H
+#define PK_H
+#include "loader.h"
+#include <stdint.h>
+
+struct Emulator;
+
+/*
+ * Proxy kernel.
+ *
+ * Runs a statically linked Linux/newlib RISC-V program in U-mode and
+ * services its ECALLs on the host, the way riscv-pk or qemu-user do.
+ * Guest buffers are handed to host read()/write() directly (guest RAM is
+ * host memory), so file I/O costs no extra copy.
+ *
+ * Guest memory layout (RAM starts at 0):
+ *
+ *   0 ........ ELF segments | brk heap --->      <--- mmap | stack | top
+ *
+ * munmap zeroes a range and keeps it as a hole; mmap reuses holes before
+ * taking fresh pages from the mmap area, which grows down.
+ */
+#define PK_DRAM_SIZE (1ULL << 30) // 1 GB, reserved lazily by the host
+#define PK_STACK_SIZE (8 * 1024 * 1024)
+#define PK_MAX_FDS 64
+#define PK_MAX_HOLES 64
+
+typedef struct {
+  uint64_t base, len;
+} PkRange;
+
+typedef struct {
+  bool enabled;
+  bool exited;
+  int exit_code;
+
+  uint64_t brk_start;
+  uint64_t brk;
+  uint64_t mmap_top; // mappings grow down from here
+  PkRange holes[PK_MAX_HOLES]; // unmapped, zeroed ranges above mmap_top
+  int nholes;
+  uint64_t stack_top;
+
+  int fds[PK_MAX_FDS]; // guest fd -> host fd, -1 if closed
+} ProxyKernel;
+
+/* Load `argv[0]`, build the initial user stack and switch the CPU to U-mode. */
+bool pk_load(struct Emulator *emu, int argc, char **argv, char **envp);
+
+/* Handle an ECALL from U-mode. Arguments in a0-a5, number in a7. */
+void pk_syscall(struct Emulator *emu);
+
+void pk_close_all(struct Emulator *emu);
+
+#endif // PK_H
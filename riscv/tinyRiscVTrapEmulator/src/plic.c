@@ -0,0 +1,100 @@
+#include "plic.h"
+#include "emulator.h"
+
+#define PLIC_PENDING 0x1000
+#define PLIC_ENABLE 0x2000
+#define PLIC_ENABLE_STRIDE 0x80
+#define PLIC_CONTEXT 0x200000
+#define PLIC_CONTEXT_STRIDE 0x1000
+
+/* The source context c would get on a claim, 0 if none. */
+static int best_source(const Plic *p, int c) {
+  uint32_t ready = p->pending & p->enable[c];
+  int best = 0;
+  uint32_t best_priority = p->threshold[c];
+  for (int s = 1; s < PLIC_SOURCES; s++) {
+    if (((ready >> s) & 1) && p->priority[s] > best_priority) {
+      best = s;
+      best_priority = p->priority[s];
+    }
+  }
+  return best;
+}
+
+/* Drive the hart's external interrupt lines from the contexts. */
+static void update(Emulator *emu) {
+  const Plic *p = &emu->machine.plic;
+  uint64_t mip = emu->cpu.mip & ~(MIP_MEIP | MIP_SEIP);
+  if (best_source(p, 0))
+    mip |= MIP_MEIP;
+  if (best_source(p, 1))
+    mip |= MIP_SEIP;
+  emu->cpu.mip = mip;
+}
+
+void plic_set_irq(Emulator *emu, int source, bool level) {
+  Plic *p = &emu->machine.plic;
+  uint32_t bit = 1u << source;
+  if (level)
+    p->level |= bit;
+  else
+    p->level &= ~bit;
+  if (!(p->claimed & bit))
+    p->pending = (p->pending & ~bit) | (p->level & bit);
+  update(emu);
+}
+
+uint32_t plic_read(Emulator *emu, uint64_t off) {
+  Plic *p = &emu->machine.plic;
+  if (off < 4 * PLIC_SOURCES)
+    return p->priority[off / 4];
+  if (off == PLIC_PENDING)
+    return p->pending;
+  if (off >= PLIC_ENABLE &&
+      off < PLIC_ENABLE + PLIC_ENABLE_STRIDE * PLIC_CONTEXTS) {
+    uint64_t c = (off - PLIC_ENABLE) / PLIC_ENABLE_STRIDE;
+    return off % PLIC_ENABLE_STRIDE == 0 ? p->enable[c] : 0;
+  }
+  if (off >= PLIC_CONTEXT &&
+      off < PLIC_CONTEXT + PLIC_CONTEXT_STRIDE * PLIC_CONTEXTS) {
+    uint64_t c = (off - PLIC_CONTEXT) / PLIC_CONTEXT_STRIDE;
+    switch (off % PLIC_CONTEXT_STRIDE) {
+    case 0:
+      return p->threshold[c];
+    case 4: { // claim
+      int s = best_source(p, c);
+      p->pending &= ~(1u << s);
+      p->claimed |= s ? 1u << s : 0;
+      update(emu);
+      return s;
+    }
+    }
+  }
+  return 0;
+}
+
+void plic_write(Emulator *emu, uint64_t off, uint32_t val) {
+  Plic *p = &emu->machine.plic;
+  if (off < 4 * PLIC_SOURCES) {
+    if (off >= 4) // source 0 does not exist
+      p->priority[off / 4] = val & 7;
+  } else if (off >= PLIC_ENABLE &&
+             off < PLIC_ENABLE + PLIC_ENABLE_STRIDE * PLIC_CONTEXTS) {
+    if (off % PLIC_ENABLE_STRIDE == 0)
+      p->enable[(off - PLIC_ENABLE) / PLIC_ENABLE_STRIDE] = val & ~1u;
+  } else if (off >= PLIC_CONTEXT &&
+             off < PLIC_CONTEXT + PLIC_CONTEXT_STRIDE * PLIC_CONTEXTS) {
+    uint64_t c = (off - PLIC_CONTEXT) / PLIC_CONTEXT_STRIDE;
+    if (off % PLIC_CONTEXT_STRIDE == 0) {
+      p->threshold[c] = val & 7;
+    } else if (off % PLIC_CONTEXT_STRIDE == 4 && val > 0 &&
+               val < PLIC_SOURCES) { // complete
+      uint32_t bit = 1u << val;
+      p->claimed &= ~bit;
+      p->pending |= p->level & bit;
+    }
+  } else {
+    return; // pending bits are read-only
+  }
+  update(emu);
+}
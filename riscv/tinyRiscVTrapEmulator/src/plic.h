@@ -0,0 +1,42 @@
+#ifndef PLIC_H
+#define PLIC_H
+#include <stdint.h>
+
+struct Emulator;
+
+/*
+ * Platform-level interrupt controller, laid out like QEMU virt's (and the
+ * SiFive one) for a single hart:
+ *
+ *   0x000000 + 4 * n          priority of source n (0 = never interrupts)
+ *   0x001000                  pending bits, sources 0..31
+ *   0x002000 + 0x80 * c       enable bits of context c
+ *   0x200000 + 0x1000 * c     priority threshold of context c
+ *   0x200004 + 0x1000 * c     claim (read) / complete (write)
+ *
+ * Context 0 is the hart's M-mode and drives mip.MEIP, context 1 is S-mode
+ * and drives mip.SEIP. Sources are level-triggered: a source is pending
+ * while its device holds the line up and it is not claimed; completing it
+ * makes it pending again if the line is still up.
+ */
+#define PLIC_SIZE 0x4000000
+#define PLIC_SOURCES 32 // source 0 means "none"
+#define PLIC_CONTEXTS 2
+
+typedef struct {
+  uint32_t priority[PLIC_SOURCES];
+  uint32_t level;   // lines devices are holding up
+  uint32_t pending;
+  uint32_t claimed; // claimed and not completed yet
+  uint32_t enable[PLIC_CONTEXTS];
+  uint32_t threshold[PLIC_CONTEXTS];
+} Plic;
+
+/* Register access, `off` relative to the PLIC base. */
+uint32_t plic_read(struct Emulator *emu, uint64_t off);
+void plic_write(struct Emulator *emu, uint64_t off, uint32_t val);
+
+/* A device raises (level true) or lowers its interrupt line. */
+void plic_set_irq(struct Emulator *emu, int source, bool level);
+
+#endif // PLIC_H
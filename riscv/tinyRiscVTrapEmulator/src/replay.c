@@ -0,0 +1,321 @@
+#define _DEFAULT_SOURCE // getline on glibc
+#include "replay.h"
+#include "emulator.h"
+#include "snapshot.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOG_HEADER "# risc replay log v2\n"
+
+// ============================================================================
+// Reading the log
+// ============================================================================
+
+/* Load the next event into r; false at the end of the log. */
+static bool next_event(Replay *r) {
+  r->have_event = false;
+  while (getline(&r->line, &r->cap, r->log) >= 0) {
+    if (r->line[0] == '#' || r->line[0] == '\n')
+      continue;
+    char *p = r->line;
+    int n = 0;
+    if (sscanf(p, "%7s %" SCNx64 " %n", r->kind, &r->when, &n) != 2)
+      break;
+    p += n;
+    // arg, env: (data); start: digest; uart: byte; mem: addr (+ data);
+    // sys: nr, ret; end: pc, digest
+    int nargs = strcmp(r->kind, "sys") == 0 || strcmp(r->kind, "end") == 0
+                    ? 2
+                : strcmp(r->kind, "arg") == 0 || strcmp(r->kind, "env") == 0
+                    ? 0
+                    : 1;
+    for (int i = 0; i < nargs; i++) {
+      char *end;
+      r->args[i] = strtoull(p, &end, 16);
+      if (end == p)
+        goto bad;
+      p = end;
+    }
+    r->data = p + strspn(p, " ");
+    r->have_event = true;
+    return true;
+  }
+bad:
+  if (!feof(r->log))
+    fprintf(stderr, "%s: malformed event: %s", r->path, r->line);
+  return false;
+}
+
+void replay_diverge(Emulator *emu, const char *what) {
+  Replay *r = &emu->replay;
+  if (r->diverged)
+    return;
+  r->diverged = true;
+  // instret in hex, as in the log
+  fprintf(stderr, "replay: diverged at instret %" PRIx64 ", pc=%" PRIx64
+                  ": %s",
+          emu->cpu.instret, emu->cpu.pc, what);
+  if (r->have_event)
+    fprintf(stderr, " (log has %s at %" PRIx64 ")", r->kind, r->when);
+  fputc('\n', stderr);
+}
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+/* Decode the hex bytes of an event into dst (hex_len(hex) bytes). */
+static size_t hex_len(const char *hex) { return strcspn(hex, " \n") / 2; }
+
+static bool hex_decode(uint8_t *dst, const char *hex) {
+  size_t len = hex_len(hex);
+  for (size_t i = 0; i < len; i++) {
+    int hi = hex_digit(hex[2 * i]), lo = hex_digit(hex[2 * i + 1]);
+    if (hi < 0 || lo < 0)
+      return false;
+    dst[i] = (uint8_t)(hi << 4 | lo);
+  }
+  return true;
+}
+
+static void log_hex(FILE *log, const uint8_t *p, size_t len) {
+  for (size_t i = 0; i < len; i++)
+    fprintf(log, "%02x", p[i]);
+  fputc('\n', log);
+}
+
+/* Apply a logged guest memory write. */
+static bool apply_mem(Emulator *emu, uint64_t addr, const char *hex) {
+  size_t len = hex_len(hex);
+  uint8_t *dst = emu_guest_ptr(emu, addr, len);
+  if (!dst || !hex_decode(dst, hex))
+    return false;
+  emu_invalidate_range(emu, addr, len);
+  return true;
+}
+
+// ============================================================================
+// Open / close
+// ============================================================================
+
+static void log_strings(Replay *r, uint64_t now, const char *kind,
+                        char **strs) {
+  for (; strs && *strs; strs++) {
+    fprintf(r->log, "%s %" PRIx64 " ", kind, now);
+    log_hex(r->log, (const uint8_t *)*strs, strlen(*strs));
+  }
+}
+
+bool replay_open(Emulator *emu, const char *path, ReplayMode mode,
+                 char **argv, char **envp) {
+  Replay *r = &emu->replay;
+  memset(r, 0, sizeof(*r));
+  r->path = path;
+  r->log = fopen(path, mode == REPLAY_RECORD ? "w" : "r");
+  if (!r->log) {
+    perror(path);
+    return false;
+  }
+  r->mode = mode;
+  if (mode == REPLAY_RECORD) {
+    fputs(LOG_HEADER, r->log);
+    log_strings(r, emu->cpu.instret, "arg", argv);
+    log_strings(r, emu->cpu.instret, "env", envp);
+    fprintf(r->log, "start %" PRIx64 " %016" PRIx64 "\n", emu->cpu.instret,
+            emu_state_digest(emu));
+    return true;
+  }
+
+  // Starting from a snapshot: skip what happened before it
+  while (next_event(r) && r->when < emu->cpu.instret &&
+         strcmp(r->kind, "end") != 0)
+    ;
+  // Arguments and environment were used to load the program already
+  while (r->have_event &&
+         (strcmp(r->kind, "arg") == 0 || strcmp(r->kind, "env") == 0))
+    next_event(r);
+  // Starting where the recording did: the initial state must match (for the
+  // proxy kernel that includes arguments and environment on the stack)
+  if (r->have_event && strcmp(r->kind, "start") == 0) {
+    if (r->args[0] != emu_state_digest(emu))
+      replay_diverge(emu, "starting state differs from the recording");
+    next_event(r);
+  }
+  return true;
+}
+
+/* Append a decoded string to a NULL-terminated array. */
+static bool push_string(char ***strs, int *n, const char *hex) {
+  char **grown = realloc(*strs, (*n + 2) * sizeof(char *));
+  if (!grown)
+    return false;
+  *strs = grown;
+  size_t len = hex_len(hex);
+  char *s = malloc(len + 1);
+  if (!s || !hex_decode((uint8_t *)s, hex)) {
+    free(s);
+    grown[*n] = NULL;
+    return false;
+  }
+  s[len] = '\0';
+  grown[(*n)++] = s;
+  grown[*n] = NULL;
+  return true;
+}
+
+bool replay_read_args(const char *path, ReplayArgs *args) {
+  Replay r = {.path = path, .log = fopen(path, "r")};
+  memset(args, 0, sizeof(*args));
+  if (!r.log) {
+    perror(path);
+    return false;
+  }
+  int envc = 0;
+  bool ok = true;
+  // They lead the log, ahead of the start line
+  while (ok && next_event(&r)) {
+    if (strcmp(r.kind, "arg") == 0)
+      ok = push_string(&args->argv, &args->argc, r.data);
+    else if (strcmp(r.kind, "env") == 0)
+      ok = push_string(&args->envp, &envc, r.data);
+    else
+      break;
+  }
+  if (!ok)
+    fprintf(stderr, "%s: malformed event: %s", path, r.line);
+  fclose(r.log);
+  free(r.line);
+  if (ok && args->argc == 0) {
+    fprintf(stderr, "%s: no program arguments in the log (recorded from a "
+                    "snapshot? replay it with --restore)\n",
+            path);
+    ok = false;
+  }
+  if (!ok)
+    replay_free_args(args);
+  return ok;
+}
+
+void replay_free_args(ReplayArgs *args) {
+  for (int i = 0; args->argv && args->argv[i]; i++)
+    free(args->argv[i]);
+  for (int i = 0; args->envp && args->envp[i]; i++)
+    free(args->envp[i]);
+  free(args->argv);
+  free(args->envp);
+  memset(args, 0, sizeof(*args));
+}
+
+bool replay_close(Emulator *emu) {
+  Replay *r = &emu->replay;
+  if (r->mode == REPLAY_OFF)
+    return true;
+
+  uint64_t digest = emu_state_digest(emu);
+  bool ok = true;
+  if (r->mode == REPLAY_RECORD) {
+    fprintf(r->log, "end %" PRIx64 " %" PRIx64 " %016" PRIx64 "\n",
+            emu->cpu.instret, emu->cpu.pc, digest);
+    ok = fclose(r->log) == 0;
+    if (!ok)
+      perror(r->path);
+  } else {
+    if (!r->diverged) {
+      if (!r->have_event || strcmp(r->kind, "end") != 0)
+        replay_diverge(emu, "run ended before the recording did");
+      else if (r->when != emu->cpu.instret || r->args[0] != emu->cpu.pc ||
+               r->args[1] != digest)
+        replay_diverge(emu, "final state differs from the recording");
+    }
+    ok = !r->diverged;
+    if (ok)
+      fprintf(stderr, "replay: matches the recording (%" PRIu64
+                      " instructions)\n",
+              emu->cpu.instret);
+    fclose(r->log);
+  }
+  free(r->line);
+  r->mode = REPLAY_OFF;
+  return ok;
+}
+
+// ============================================================================
+// Inputs
+// ============================================================================
+
+bool replay_uart_input(Emulator *emu, uint8_t *byte) {
+  Replay *r = &emu->replay;
+  uint64_t now = emu->cpu.instret;
+
+  if (r->mode == REPLAY_PLAY) {
+    if (!r->have_event || strcmp(r->kind, "uart") != 0)
+      return false;
+    if (r->when < now) {
+      replay_diverge(emu, "a recorded UART byte was not read");
+      return false;
+    }
+    if (r->when > now)
+      return false;
+    *byte = (uint8_t)r->args[0];
+    next_event(r);
+    return true;
+  }
+
+  if (emu->console_in < 0)
+    return false;
+  struct pollfd p = {.fd = emu->console_in, .events = POLLIN};
+  if (poll(&p, 1, 0) <= 0)
+    return false;
+  if (read(emu->console_in, byte, 1) != 1) {
+    emu->console_in = -1; // end of input
+    return false;
+  }
+  if (r->mode == REPLAY_RECORD)
+    fprintf(r->log, "uart %" PRIx64 " %02x\n", now, *byte);
+  return true;
+}
+
+void replay_log_mem(Emulator *emu, uint64_t addr, uint64_t len) {
+  Replay *r = &emu->replay;
+  const uint8_t *p = emu_guest_ptr(emu, addr, len);
+  if (r->mode != REPLAY_RECORD || !p || len == 0)
+    return;
+  fprintf(r->log, "mem %" PRIx64 " %" PRIx64 " ", emu->cpu.instret, addr);
+  log_hex(r->log, p, len);
+}
+
+void replay_log_syscall(Emulator *emu, uint64_t nr, int64_t ret) {
+  Replay *r = &emu->replay;
+  if (r->mode == REPLAY_RECORD)
+    fprintf(r->log, "sys %" PRIx64 " %" PRIx64 " %" PRIx64 "\n",
+            emu->cpu.instret, nr, (uint64_t)ret);
+}
+
+int64_t replay_syscall(Emulator *emu, uint64_t nr) {
+  Replay *r = &emu->replay;
+  uint64_t now = emu->cpu.instret;
+
+  while (r->have_event && strcmp(r->kind, "mem") == 0 && r->when == now) {
+    if (!apply_mem(emu, r->args[0], r->data)) {
+      replay_diverge(emu, "logged memory write is outside RAM");
+      return -EFAULT;
+    }
+    next_event(r);
+  }
+  if (!r->have_event || strcmp(r->kind, "sys") != 0 || r->when != now ||
+      r->args[0] != nr) {
+    replay_diverge(emu, "syscall not in the recording");
+    return -ENOSYS;
+  }
+  int64_t ret = (int64_t)r->args[1];
+  next_event(r);
+  return ret;
+}
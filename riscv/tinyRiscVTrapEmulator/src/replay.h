@@ -0,0 +1,99 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+#include <stdint.h>
+#include <stdio.h>
+
+struct Emulator;
+
+/*
+ * Deterministic record / replay.
+ *
+ * A guest run is a pure function of its starting state and of the inputs
+ * it takes from the host: bytes arriving on the UART and, under the proxy
+ * kernel, the results of host syscalls (file contents, clocks, ...).
+ * `cycle` and `time` count retired instructions, so time needs no logging.
+ *
+ * Recording writes every such input to a log, stamped with the instruction
+ * count (instret) at which the guest took it. Replaying feeds the guest from
+ * the log instead of the host, so the run repeats bit for bit, and checks at
+ * every input that the guest is still on the recorded path. A replay may
+ * start from a snapshot (snapshot.h) taken during the recording or an
+ * earlier replay; events before the snapshot are skipped.
+ *
+ * The log is text, one event per line, numbers in hex:
+ *
+ *   arg <instret> <bytes>             proxy kernel: a program argument
+ *   env <instret> <bytes>             proxy kernel: an environment string
+ *   start <instret> <digest>          state the recording started from
+ *   uart <instret> <byte>             byte read from the UART
+ *   mem <instret> <addr> <bytes>      guest memory written by the next sys
+ *   sys <instret> <nr> <ret>          proxy-kernel syscall and its result
+ *   end <instret> <pc> <digest>       where the recording stopped
+ *
+ * Digests are emu_state_digest(); a replay must start from the recorded
+ * state or from a snapshot. The proxy kernel's initial stack holds the
+ * program's arguments and environment, so they are logged too and a replay
+ * rebuilds the stack from the log (replay_read_args) rather than from the
+ * host it runs on.
+ */
+typedef enum { REPLAY_OFF, REPLAY_RECORD, REPLAY_PLAY } ReplayMode;
+
+typedef struct {
+  ReplayMode mode;
+  FILE *log;
+  const char *path;
+  bool diverged; // replay left the recorded path; the run should stop
+
+  // REPLAY_PLAY: the next unconsumed event
+  bool have_event;
+  char kind[8];
+  uint64_t when;
+  uint64_t args[3];
+  char *data; // mem: hex bytes, in `line`
+  char *line;
+  size_t cap;
+} Replay;
+
+/*
+ * Start recording to / replaying from `path`. A proxy-kernel recording
+ * passes the NULL-terminated arguments and environment the program was
+ * loaded with; others pass NULL.
+ */
+bool replay_open(struct Emulator *emu, const char *path, ReplayMode mode,
+                 char **argv, char **envp);
+
+/* Arguments and environment of a proxy-kernel recording */
+typedef struct {
+  int argc;
+  char **argv, **envp; // NULL-terminated
+} ReplayArgs;
+
+/* Read them from the log at `path`; false if it has none. */
+bool replay_read_args(const char *path, ReplayArgs *args);
+void replay_free_args(ReplayArgs *args);
+
+/* Leave the recorded path: report where, and stop the run. */
+void replay_diverge(struct Emulator *emu, const char *what);
+
+/*
+ * Finish: a recording gets its end line; a replay is checked against it.
+ * Returns false if the replay diverged.
+ */
+bool replay_close(struct Emulator *emu);
+
+/*
+ * UART input: the next received byte, if one arrives now. Reads the host
+ * console (and logs it) or, when replaying, the log.
+ */
+bool replay_uart_input(struct Emulator *emu, uint8_t *byte);
+
+/*
+ * Proxy kernel. While recording, a host-dependent syscall logs the guest
+ * memory it wrote, then its result. While replaying, replay_syscall applies
+ * the logged memory writes and returns the logged result instead.
+ */
+void replay_log_mem(struct Emulator *emu, uint64_t addr, uint64_t len);
+void replay_log_syscall(struct Emulator *emu, uint64_t nr, int64_t ret);
+int64_t replay_syscall(struct Emulator *emu, uint64_t nr);
+
+#endif // REPLAY_H
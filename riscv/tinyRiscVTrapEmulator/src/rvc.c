@@ -0,0 +1,268 @@
+#include "decode.h"
+
+/*
+ * RVC (compressed instruction) expansion.
+ *
+ * Every 16-bit instruction is a short form of an existing 32-bit one, so we
+ * rebuild the full encoding and let decode() handle it. The work is done
+ * once per instruction when it enters the decode cache; after that a
+ * compressed instruction executes exactly like its 32-bit twin.
+ *
+ * Quadrants are selected by bits [1:0] (00, 01, 10; 11 = 32-bit) and the
+ * instruction within a quadrant by funct3 in bits [15:13].
+ *
+ * RV32 reuses a few RV64-only slots: C.LD/C.SD/C.LDSP/C.SDSP become
+ * C.FLW/C.FSW/C.FLWSP/C.FSWSP and C.ADDIW becomes C.JAL. The other RV64-only
+ * forms (C.ADDW, C.SUBW, shamt[5] = 1) expand as usual and are rejected by
+ * decode() for RV32.
+ */
+
+#define OPC_LOAD 0x03
+#define OPC_LOAD_FP 0x07
+#define OPC_OP_IMM 0x13
+#define OPC_OP_IMM_32 0x1B
+#define OPC_STORE 0x23
+#define OPC_STORE_FP 0x27
+#define OPC_OP 0x33
+#define OPC_LUI 0x37
+#define OPC_OP_32 0x3B
+#define OPC_BRANCH 0x63
+#define OPC_JALR 0x67
+#define OPC_JAL 0x6F
+
+static uint32_t enc_r(uint32_t opc, uint32_t rd, uint32_t f3, uint32_t rs1,
+                      uint32_t rs2, uint32_t f7) {
+  return (f7 << 25) | (rs2 << 20) | (rs1 << 15) | (f3 << 12) | (rd << 7) | opc;
+}
+
+static uint32_t enc_i(uint32_t opc, uint32_t rd, uint32_t f3, uint32_t rs1,
+                      int32_t imm) {
+  return ((uint32_t)(imm & 0xFFF) << 20) | (rs1 << 15) | (f3 << 12) |
+         (rd << 7) | opc;
+}
+
+static uint32_t enc_s(uint32_t opc, uint32_t f3, uint32_t rs1, uint32_t rs2,
+                      int32_t imm) {
+  return ((uint32_t)((imm >> 5) & 0x7F) << 25) | (rs2 << 20) | (rs1 << 15) |
+         (f3 << 12) | ((uint32_t)(imm & 0x1F) << 7) | opc;
+}
+
+static uint32_t enc_b(uint32_t f3, uint32_t rs1, uint32_t rs2, int32_t imm) {
+  return ((uint32_t)((imm >> 12) & 0x1) << 31) |
+         ((uint32_t)((imm >> 5) & 0x3F) << 25) | (rs2 << 20) | (rs1 << 15) |
+         (f3 << 12) | ((uint32_t)((imm >> 1) & 0xF) << 8) |
+         ((uint32_t)((imm >> 11) & 0x1) << 7) | OPC_BRANCH;
+}
+
+static uint32_t enc_j(uint32_t rd, int32_t imm) {
+  return ((uint32_t)((imm >> 20) & 0x1) << 31) |
+         ((uint32_t)((imm >> 1) & 0x3FF) << 21) |
+         ((uint32_t)((imm >> 11) & 0x1) << 20) |
+         ((uint32_t)((imm >> 12) & 0xFF) << 12) | (rd << 7) | OPC_JAL;
+}
+
+// Extract bits [hi:lo] of x
+static inline uint32_t bits(uint32_t x, int hi, int lo) {
+  return (x >> lo) & ((1u << (hi - lo + 1)) - 1);
+}
+
+// Sign-extend the low `width` bits of x
+static inline int32_t sext(uint32_t x, int width) {
+  return (int32_t)(x << (32 - width)) >> (32 - width);
+}
+
+static uint32_t expand_q0(uint16_t c, int xlen) {
+  uint32_t rd_ = bits(c, 4, 2) + 8; // rd' / rs2'
+  uint32_t rs1_ = bits(c, 9, 7) + 8;
+
+  // uimm[5:3|7:6] used by C.LD / C.SD / C.FLD / C.FSD
+  uint32_t uimm_d = (bits(c, 12, 10) << 3) | (bits(c, 6, 5) << 6);
+  // uimm[5:3|2|6] used by C.LW / C.SW
+  uint32_t uimm_w =
+      (bits(c, 12, 10) << 3) | (bits(c, 6, 6) << 2) | (bits(c, 5, 5) << 6);
+
+  switch (bits(c, 15, 13)) {
+  case 0: { // C.ADDI4SPN -> addi rd', x2, nzuimm
+    uint32_t imm = (bits(c, 12, 11) << 4) | (bits(c, 10, 7) << 6) |
+                   (bits(c, 6, 6) << 2) | (bits(c, 5, 5) << 3);
+    if (imm == 0)
+      return 0;
+    return enc_i(OPC_OP_IMM, rd_, 0, 2, imm);
+  }
+  case 1: // C.FLD
+    return enc_i(OPC_LOAD_FP, rd_, 3, rs1_, uimm_d);
+  case 2: // C.LW
+    return enc_i(OPC_LOAD, rd_, 2, rs1_, uimm_w);
+  case 3: // C.LD, C.FLW on RV32
+    if (xlen == 32)
+      return enc_i(OPC_LOAD_FP, rd_, 2, rs1_, uimm_w);
+    return enc_i(OPC_LOAD, rd_, 3, rs1_, uimm_d);
+  case 5: // C.FSD
+    return enc_s(OPC_STORE_FP, 3, rs1_, rd_, uimm_d);
+  case 6: // C.SW
+    return enc_s(OPC_STORE, 2, rs1_, rd_, uimm_w);
+  case 7: // C.SD, C.FSW on RV32
+    if (xlen == 32)
+      return enc_s(OPC_STORE_FP, 2, rs1_, rd_, uimm_w);
+    return enc_s(OPC_STORE, 3, rs1_, rd_, uimm_d);
+  }
+  return 0;
+}
+
+// C.J / C.JAL offset: imm[11|4|9:8|10|6|7|3:1|5]
+static int32_t cj_imm(uint16_t c) {
+  return sext((bits(c, 12, 12) << 11) | (bits(c, 11, 11) << 4) |
+                  (bits(c, 10, 9) << 8) | (bits(c, 8, 8) << 10) |
+                  (bits(c, 7, 7) << 6) | (bits(c, 6, 6) << 7) |
+                  (bits(c, 5, 3) << 1) | (bits(c, 2, 2) << 5),
+              12);
+}
+
+static uint32_t expand_q1(uint16_t c, int xlen) {
+  uint32_t rd = bits(c, 11, 7);
+  uint32_t rd_ = bits(c, 9, 7) + 8;
+  uint32_t rs2_ = bits(c, 4, 2) + 8;
+  int32_t imm6 = sext((bits(c, 12, 12) << 5) | bits(c, 6, 2), 6);
+
+  switch (bits(c, 15, 13)) {
+  case 0: // C.ADDI (C.NOP when rd == 0)
+    return enc_i(OPC_OP_IMM, rd, 0, rd, imm6);
+  case 1: // C.ADDIW, C.JAL on RV32
+    if (xlen == 32)
+      return enc_j(1, cj_imm(c));
+    if (rd == 0)
+      return 0;
+    return enc_i(OPC_OP_IMM_32, rd, 0, rd, imm6);
+  case 2: // C.LI -> addi rd, x0, imm
+    return enc_i(OPC_OP_IMM, rd, 0, 0, imm6);
+  case 3:
+    if (rd == 2) { // C.ADDI16SP -> addi x2, x2, nzimm
+      int32_t imm = sext((bits(c, 12, 12) << 9) | (bits(c, 6, 6) << 4) |
+                             (bits(c, 5, 5) << 6) | (bits(c, 4, 3) << 7) |
+                             (bits(c, 2, 2) << 5),
+                         10);
+      if (imm == 0)
+        return 0;
+      return enc_i(OPC_OP_IMM, 2, 0, 2, imm);
+    } else { // C.LUI
+      if (imm6 == 0)
+        return 0;
+      return ((uint32_t)imm6 << 12) | (rd << 7) | OPC_LUI;
+    }
+  case 4: {
+    uint32_t shamt = (bits(c, 12, 12) << 5) | bits(c, 6, 2);
+    switch (bits(c, 11, 10)) {
+    case 0: // C.SRLI
+      return enc_i(OPC_OP_IMM, rd_, 5, rd_, shamt);
+    case 1: // C.SRAI
+      return enc_i(OPC_OP_IMM, rd_, 5, rd_, shamt | 0x400);
+    case 2: // C.ANDI
+      return enc_i(OPC_OP_IMM, rd_, 7, rd_, imm6);
+    case 3:
+      if (bits(c, 12, 12) == 0) {
+        switch (bits(c, 6, 5)) {
+        case 0: // C.SUB
+          return enc_r(OPC_OP, rd_, 0, rd_, rs2_, 0x20);
+        case 1: // C.XOR
+          return enc_r(OPC_OP, rd_, 4, rd_, rs2_, 0);
+        case 2: // C.OR
+          return enc_r(OPC_OP, rd_, 6, rd_, rs2_, 0);
+        case 3: // C.AND
+          return enc_r(OPC_OP, rd_, 7, rd_, rs2_, 0);
+        }
+      } else {
+        switch (bits(c, 6, 5)) {
+        case 0: // C.SUBW
+          return enc_r(OPC_OP_32, rd_, 0, rd_, rs2_, 0x20);
+        case 1: // C.ADDW
+          return enc_r(OPC_OP_32, rd_, 0, rd_, rs2_, 0);
+        }
+      }
+      return 0;
+    }
+    return 0;
+  }
+  case 5: // C.J -> jal x0, imm
+    return enc_j(0, cj_imm(c));
+  case 6:   // C.BEQZ
+  case 7: { // C.BNEZ
+    int32_t imm = sext((bits(c, 12, 12) << 8) | (bits(c, 11, 10) << 3) |
+                           (bits(c, 6, 5) << 6) | (bits(c, 4, 3) << 1) |
+                           (bits(c, 2, 2) << 5),
+                       9);
+    return enc_b(bits(c, 15, 13) == 6 ? 0 : 1, rd_, 0, imm);
+  }
+  }
+  return 0;
+}
+
+static uint32_t expand_q2(uint16_t c, int xlen) {
+  uint32_t rd = bits(c, 11, 7);
+  uint32_t rs2 = bits(c, 6, 2);
+
+  // uimm[5|4:3|8:6] used by C.LDSP / C.FLDSP
+  uint32_t uimm_ld =
+      (bits(c, 12, 12) << 5) | (bits(c, 6, 5) << 3) | (bits(c, 4, 2) << 6);
+  // uimm[5:3|8:6] used by C.SDSP / C.FSDSP
+  uint32_t uimm_sd = (bits(c, 12, 10) << 3) | (bits(c, 9, 7) << 6);
+  // uimm[5|4:2|7:6] used by C.LWSP / C.FLWSP
+  uint32_t uimm_lw =
+      (bits(c, 12, 12) << 5) | (bits(c, 6, 4) << 2) | (bits(c, 3, 2) << 6);
+  // uimm[5:2|7:6] used by C.SWSP / C.FSWSP
+  uint32_t uimm_sw = (bits(c, 12, 9) << 2) | (bits(c, 8, 7) << 6);
+
+  switch (bits(c, 15, 13)) {
+  case 0: { // C.SLLI
+    uint32_t shamt = (bits(c, 12, 12) << 5) | bits(c, 6, 2);
+    return enc_i(OPC_OP_IMM, rd, 1, rd, shamt);
+  }
+  case 1: // C.FLDSP
+    return enc_i(OPC_LOAD_FP, rd, 3, 2, uimm_ld);
+  case 2: // C.LWSP
+    if (rd == 0)
+      return 0;
+    return enc_i(OPC_LOAD, rd, 2, 2, uimm_lw);
+  case 3: // C.LDSP, C.FLWSP on RV32
+    if (xlen == 32)
+      return enc_i(OPC_LOAD_FP, rd, 2, 2, uimm_lw);
+    if (rd == 0)
+      return 0;
+    return enc_i(OPC_LOAD, rd, 3, 2, uimm_ld);
+  case 4:
+    if (bits(c, 12, 12) == 0) {
+      if (rs2 == 0) { // C.JR -> jalr x0, 0(rs1)
+        if (rd == 0)
+          return 0;
+        return enc_i(OPC_JALR, 0, 0, rd, 0);
+      }
+      return enc_r(OPC_OP, rd, 0, 0, rs2, 0); // C.MV -> add rd, x0, rs2
+    }
+    if (rs2 == 0) {
+      if (rd == 0)
+        return 0x00100073; // C.EBREAK
+      return enc_i(OPC_JALR, 1, 0, rd, 0); // C.JALR -> jalr x1, 0(rs1)
+    }
+    return enc_r(OPC_OP, rd, 0, rd, rs2, 0); // C.ADD
+  case 5: // C.FSDSP
+    return enc_s(OPC_STORE_FP, 3, 2, rs2, uimm_sd);
+  case 6: // C.SWSP
+    return enc_s(OPC_STORE, 2, 2, rs2, uimm_sw);
+  case 7: // C.SDSP, C.FSWSP on RV32
+    if (xlen == 32)
+      return enc_s(OPC_STORE_FP, 2, 2, rs2, uimm_sw);
+    return enc_s(OPC_STORE, 3, 2, rs2, uimm_sd);
+  }
+  return 0;
+}
+
+uint32_t rvc_expand(uint16_t inst, int xlen) {
+  switch (inst & 0x3) {
+  case 0:
+    return expand_q0(inst, xlen);
+  case 1:
+    return expand_q1(inst, xlen);
+  case 2:
+    return expand_q2(inst, xlen);
+  }
+  return 0; // not a compressed instruction
+}
@@ -0,0 +1,235 @@
+#define _DEFAULT_SOURCE // mincore on glibc
+#include "snapshot.h"
+#include "emulator.h"
+#include "fpu.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC "RVSNAP2\n"
+#define PAGES_END UINT64_MAX
+
+typedef struct {
+  char magic[8];
+  uint32_t cpu_size, machine_size, pk_size; // layout check
+  uint32_t pk_enabled;
+  uint64_t dram_base, dram_size;
+  uint64_t tohost, tohost_value;
+  int64_t uart_rx; // byte waiting in the UART, -1 if none
+} SnapshotHeader;
+
+// ============================================================================
+// RAM pages
+// ============================================================================
+
+typedef void (*PageFn)(void *ctx, uint64_t index, const uint8_t *page);
+
+static bool page_is_zero(const uint8_t *page) {
+  static const uint8_t zero[PAGE_SIZE];
+  return memcmp(page, zero, PAGE_SIZE) == 0;
+}
+
+/*
+ * Call fn for every RAM page that holds data. Pages the guest never touched
+ * are not resident in the host mapping; skipping them without reading keeps
+ * a 1 GB proxy-kernel RAM cheap to walk.
+ */
+static bool for_each_page(Emulator *emu, PageFn fn, void *ctx) {
+  size_t host_page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t npages = (emu->dram_size + host_page - 1) / host_page;
+  unsigned char *resident = malloc(npages);
+  if (!resident || mincore(emu->dram, emu->dram_size, (void *)resident) < 0) {
+    free(resident);
+    return false;
+  }
+  for (uint64_t i = 0; i < emu->dram_size / PAGE_SIZE; i++) {
+    const uint8_t *page = emu->dram + i * PAGE_SIZE;
+    if ((resident[i * PAGE_SIZE / host_page] & 1) && !page_is_zero(page))
+      fn(ctx, i, page);
+  }
+  free(resident);
+  return true;
+}
+
+// ============================================================================
+// Digest
+// ============================================================================
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+  const uint8_t *p = data;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ p[i]) * FNV_PRIME;
+  return h;
+}
+
+static void hash_page(void *ctx, uint64_t index, const uint8_t *page) {
+  uint64_t *h = ctx;
+  *h = fnv1a(*h, &index, sizeof(index));
+  *h = fnv1a(*h, page, PAGE_SIZE);
+}
+
+/*
+ * Field by field rather than the raw struct: the CPU's padding bytes are not
+ * reliably zero (a struct assignment need not copy them), and must not make
+ * equal states hash differently.
+ */
+static uint64_t hash_cpu(uint64_t h, const CPU *c) {
+#define HASH(field) h = fnv1a(h, &c->field, sizeof(c->field))
+  HASH(x);
+  HASH(pc);
+  HASH(xlen);
+  HASH(f);
+  HASH(fcsr);
+  HASH(stvec);
+  HASH(sepc);
+  HASH(scause);
+  HASH(stval);
+  HASH(sscratch);
+  HASH(satp);
+  HASH(mode);
+  HASH(mstatus);
+  HASH(mtvec);
+  HASH(mepc);
+  HASH(mcause);
+  HASH(mtval);
+  HASH(mscratch);
+  HASH(medeleg);
+  HASH(mideleg);
+  HASH(mie);
+  HASH(mip);
+  HASH(instret);
+  HASH(reservation);
+  HASH(reservation_valid);
+#undef HASH
+  return h;
+}
+
+uint64_t emu_state_digest(Emulator *emu) {
+  fp_sync_flags(&emu->cpu);
+  uint64_t h = hash_cpu(FNV_OFFSET, &emu->cpu);
+  for_each_page(emu, hash_page, &h);
+  return h;
+}
+
+// ============================================================================
+// Save / restore
+// ============================================================================
+
+static void write_page(void *ctx, uint64_t index, const uint8_t *page) {
+  FILE *f = ctx;
+  fwrite(&index, sizeof(index), 1, f);
+  fwrite(page, PAGE_SIZE, 1, f);
+}
+
+bool snapshot_save(Emulator *emu, const char *path) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  fp_sync_flags(&emu->cpu);
+
+  SnapshotHeader h = {
+      .cpu_size = sizeof(CPU),
+      .machine_size = sizeof(Machine),
+      .pk_size = sizeof(ProxyKernel),
+      .pk_enabled = emu->pk.enabled,
+      .dram_base = emu->dram_base,
+      .dram_size = emu->dram_size,
+      .tohost = emu->tohost,
+      .tohost_value = emu->tohost_value,
+      .uart_rx = emu->uart_rx,
+  };
+  memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+  Machine m = emu->machine;
+  for (int i = 0; i < m.nregions; i++)
+    m.regions[i].mem = NULL;
+
+  fwrite(&h, sizeof(h), 1, f);
+  fwrite(&emu->cpu, sizeof(CPU), 1, f);
+  fwrite(&m, sizeof(m), 1, f);
+  fwrite(&emu->pk, sizeof(ProxyKernel), 1, f);
+  for (int i = 0; i < m.nregions; i++)
+    if (m.regions[i].kind == REGION_ROM)
+      fwrite(emu->machine.regions[i].mem, m.regions[i].size, 1, f);
+
+  bool ok = for_each_page(emu, write_page, f);
+  uint64_t end = PAGES_END;
+  fwrite(&end, sizeof(end), 1, f);
+  if (ferror(f) || !ok)
+    ok = false;
+  if (fclose(f) != 0)
+    ok = false;
+  if (!ok)
+    fprintf(stderr, "%s: could not write snapshot\n", path);
+  else
+    fprintf(stderr, "snapshot: %s at instret %llu, pc=%llx\n", path,
+            emu->cpu.instret, emu->cpu.pc);
+  return ok;
+}
+
+static bool read_all(FILE *f, void *dst, size_t len) {
+  return fread(dst, 1, len, f) == len;
+}
+
+bool snapshot_restore(Emulator *emu, const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+
+  SnapshotHeader h;
+  Machine m;
+  if (!read_all(f, &h, sizeof(h)) ||
+      memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0 ||
+      h.cpu_size != sizeof(CPU) || h.machine_size != sizeof(Machine) ||
+      h.pk_size != sizeof(ProxyKernel)) {
+    fprintf(stderr, "%s: not a snapshot from this build\n", path);
+    fclose(f);
+    return false;
+  }
+
+  // The CPU goes in after the RAM is mapped (which resets it)
+  CPU cpu;
+  ProxyKernel pk;
+  bool ok = read_all(f, &cpu, sizeof(cpu)) && read_all(f, &m, sizeof(m)) &&
+            read_all(f, &pk, sizeof(pk));
+  if (ok)
+    ok = h.pk_enabled ? emu_init(emu, h.dram_base, h.dram_size)
+                      : emu_init_machine(emu, &m);
+  if (!ok) {
+    fprintf(stderr, "%s: truncated snapshot\n", path);
+    fclose(f);
+    return false;
+  }
+  emu->cpu = cpu;
+  emu->pk = pk;
+  for (int i = 0; i < PK_MAX_FDS; i++)
+    emu->pk.fds[i] = i < 3 && pk.fds[i] >= 0 ? i : -1;
+  emu->tohost = h.tohost;
+  emu->tohost_value = h.tohost_value;
+  emu->uart_rx = (int)h.uart_rx;
+
+  for (int i = 0; ok && i < emu->machine.nregions; i++) {
+    Region *r = &emu->machine.regions[i];
+    if (r->kind == REGION_ROM)
+      ok = read_all(f, r->mem, r->size);
+  }
+  uint64_t index;
+  while (ok && (ok = read_all(f, &index, sizeof(index))) &&
+         index != PAGES_END) {
+    ok = index < emu->dram_size / PAGE_SIZE &&
+         read_all(f, emu->dram + index * PAGE_SIZE, PAGE_SIZE);
+  }
+  fclose(f);
+  if (!ok) {
+    fprintf(stderr, "%s: truncated snapshot\n", path);
+    emu_free(emu);
+  }
+  return ok;
+}
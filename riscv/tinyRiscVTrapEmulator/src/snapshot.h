@@ -0,0 +1,30 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <stdint.h>
+
+struct Emulator;
+
+/*
+ * Snapshots: the complete guest state (CPU, RAM, ROMs, machine profile,
+ * proxy-kernel bookkeeping, a UART byte not yet read) in one file, so a run can be resumed at an
+ * exact instruction, typically to replay it (replay.h) again and again
+ * under different instrumentation.
+ *
+ * RAM is stored sparsely: only pages that are resident and not all zero.
+ * The format is the emulator's own structs and only meant to be read back by
+ * the same build. Host file descriptors of a proxy-kernel guest cannot be
+ * saved; after a restore only stdin/stdout/stderr are open (a replay does
+ * not touch the host's files anyway).
+ */
+bool snapshot_save(struct Emulator *emu, const char *path);
+
+/* Initialize `emu` from a snapshot, replacing emu_init / emu_init_machine. */
+bool snapshot_restore(struct Emulator *emu, const char *path);
+
+/*
+ * Hash of the architectural state: registers, pc, instret, CSRs and the
+ * contents of every nonzero RAM page. Equal runs give equal digests.
+ */
+uint64_t emu_state_digest(struct Emulator *emu);
+
+#endif // SNAPSHOT_H
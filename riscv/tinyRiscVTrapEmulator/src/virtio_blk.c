@@ -0,0 +1,381 @@
+#include "virtio_blk.h"
+#include "emulator.h"
+#include "plic.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// MMIO registers
+#define VIRTIO_MAGIC 0x000
+#define VIRTIO_VERSION 0x004
+#define VIRTIO_DEVICE_ID 0x008
+#define VIRTIO_VENDOR_ID 0x00c
+#define VIRTIO_DEVICE_FEATURES 0x010
+#define VIRTIO_DEVICE_FEATURES_SEL 0x014
+#define VIRTIO_DRIVER_FEATURES 0x020
+#define VIRTIO_DRIVER_FEATURES_SEL 0x024
+#define VIRTIO_QUEUE_SEL 0x030
+#define VIRTIO_QUEUE_NUM_MAX 0x034
+#define VIRTIO_QUEUE_NUM 0x038
+#define VIRTIO_QUEUE_READY 0x044
+#define VIRTIO_QUEUE_NOTIFY 0x050
+#define VIRTIO_INTERRUPT_STATUS 0x060
+#define VIRTIO_INTERRUPT_ACK 0x064
+#define VIRTIO_STATUS 0x070
+#define VIRTIO_QUEUE_DESC_LOW 0x080
+#define VIRTIO_QUEUE_DESC_HIGH 0x084
+#define VIRTIO_QUEUE_DRIVER_LOW 0x090
+#define VIRTIO_QUEUE_DRIVER_HIGH 0x094
+#define VIRTIO_QUEUE_DEVICE_LOW 0x0a0
+#define VIRTIO_QUEUE_DEVICE_HIGH 0x0a4
+#define VIRTIO_CONFIG_GENERATION 0x0fc
+#define VIRTIO_CONFIG 0x100 // virtio_blk_config: u64 capacity first
+
+#define MAGIC_VALUE 0x74726976  // "virt"
+#define VENDOR_QEMU 0x554d4551 // what drivers written for QEMU check for
+#define DEVICE_ID_BLOCK 2
+#define QUEUE_NUM_MAX 1024
+
+#define STATUS_NEEDS_RESET 0x40
+#define INTERRUPT_USED_RING 1
+
+// Features
+#define VIRTIO_BLK_F_RO (1ULL << 5)
+#define VIRTIO_BLK_F_FLUSH (1ULL << 9)
+#define VIRTIO_F_VERSION_1 (1ULL << 32)
+
+// Split virtqueue layout
+#define VIRTQ_DESC_SIZE 16 // u64 addr, u32 len, u16 flags, u16 next
+#define VIRTQ_DESC_F_NEXT 1
+#define VIRTQ_DESC_F_WRITE 2
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+
+// Requests: a 16-byte header (u32 type, u32 reserved, u64 sector), data,
+// then a status byte written by the device
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_T_GET_ID 8
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+#define REQ_HEADER_SIZE 16
+#define BLK_ID "risc-virtio-blk" // GET_ID: up to 20 bytes
+
+// ============================================================================
+// Disk image
+// ============================================================================
+
+bool virtio_blk_attach(Emulator *emu, const char *path) {
+  bool slot = false;
+  for (int i = 0; i < emu->machine.nregions; i++)
+    slot |= emu->machine.regions[i].kind == REGION_VIRTIO_BLK;
+  if (!slot) {
+    fprintf(stderr, "%s: machine %s has no virtio_blk device\n", path,
+            emu->machine.name);
+    return false;
+  }
+
+  bool ro = false;
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    ro = true;
+    fd = open(path, O_RDONLY);
+  }
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(path);
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+  if (st.st_size < VIRTIO_SECTOR_SIZE) {
+    fprintf(stderr, "%s: disk image smaller than one sector\n", path);
+    close(fd);
+    return false;
+  }
+  void *disk = mmap(NULL, st.st_size, PROT_READ | (ro ? 0 : PROT_WRITE),
+                    MAP_SHARED, fd, 0);
+  close(fd); // the mapping keeps the file
+  if (disk == MAP_FAILED) {
+    perror(path);
+    return false;
+  }
+  virtio_blk_detach(emu);
+  emu->disk = disk;
+  emu->disk_size = st.st_size;
+  emu->disk_ro = ro;
+  return true;
+}
+
+void virtio_blk_detach(Emulator *emu) {
+  if (emu->disk)
+    munmap(emu->disk, emu->disk_size);
+  emu->disk = NULL;
+  emu->disk_size = 0;
+}
+
+// ============================================================================
+// Queue processing
+// ============================================================================
+
+static uint16_t get16(const uint8_t *p) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t get32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t get64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+typedef struct {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+} Desc;
+
+static bool read_desc(Emulator *emu, uint16_t i, Desc *d) {
+  const VirtioBlk *v = &emu->machine.blk;
+  if (i >= v->queue_num)
+    return false;
+  const uint8_t *p = emu_guest_ptr(
+      emu, v->desc + (uint64_t)i * VIRTQ_DESC_SIZE, VIRTQ_DESC_SIZE);
+  if (!p)
+    return false;
+  *d = (Desc){get64(p), get32(p + 8), get16(p + 12), get16(p + 14)};
+  return true;
+}
+
+/*
+ * Copy one data buffer between the image and guest RAM. Returns a virtio
+ * status; `*written` counts bytes the device wrote into the guest.
+ */
+static int transfer(Emulator *emu, uint32_t type, uint64_t pos,
+                    const Desc *d, uint32_t *written) {
+  uint8_t *guest = emu_guest_ptr(emu, d->addr, d->len);
+  if (!guest)
+    return VIRTIO_BLK_S_IOERR;
+
+  switch (type) {
+  case VIRTIO_BLK_T_IN:
+    if (!(d->flags & VIRTQ_DESC_F_WRITE) || pos > emu->disk_size ||
+        d->len > emu->disk_size - pos)
+      return VIRTIO_BLK_S_IOERR;
+    memcpy(guest, emu->disk + pos, d->len);
+    emu_invalidate_range(emu, d->addr, d->len);
+    *written += d->len;
+    return VIRTIO_BLK_S_OK;
+  case VIRTIO_BLK_T_OUT:
+    if (emu->disk_ro || (d->flags & VIRTQ_DESC_F_WRITE) ||
+        pos > emu->disk_size || d->len > emu->disk_size - pos)
+      return VIRTIO_BLK_S_IOERR;
+    memcpy(emu->disk + pos, guest, d->len);
+    return VIRTIO_BLK_S_OK;
+  case VIRTIO_BLK_T_GET_ID: {
+    uint32_t n = d->len < sizeof(BLK_ID) ? d->len : sizeof(BLK_ID);
+    memcpy(guest, BLK_ID, n);
+    emu_invalidate_range(emu, d->addr, n);
+    *written += n;
+    return VIRTIO_BLK_S_OK;
+  }
+  default:
+    return VIRTIO_BLK_S_UNSUPP;
+  }
+}
+
+/*
+ * Run the request whose chain starts at descriptor `head`. Returns false if
+ * the chain itself is malformed (the device then needs a reset); a bad
+ * request is reported in its status byte. `*written` is the used length.
+ */
+static bool run_request(Emulator *emu, uint16_t head, uint32_t *written) {
+  const VirtioBlk *v = &emu->machine.blk;
+  Desc d;
+  const uint8_t *hdr;
+  if (!read_desc(emu, head, &d) || d.len < REQ_HEADER_SIZE ||
+      !(hdr = emu_guest_ptr(emu, d.addr, REQ_HEADER_SIZE)))
+    return false;
+  uint32_t type = get32(hdr);
+  uint64_t pos = get64(hdr + 8) * VIRTIO_SECTOR_SIZE;
+
+  // Everything up to the last descriptor is data; the status byte is the
+  // last byte of the last one
+  int status = VIRTIO_BLK_S_OK;
+  *written = 0;
+  for (uint32_t n = 0; n < v->queue_num; n++) {
+    if (!(d.flags & VIRTQ_DESC_F_NEXT))
+      return false;
+    if (!read_desc(emu, d.next, &d))
+      return false;
+    if (!(d.flags & VIRTQ_DESC_F_NEXT)) {
+      uint8_t *st;
+      if (d.len == 0 || !(d.flags & VIRTQ_DESC_F_WRITE) ||
+          !(st = emu_guest_ptr(emu, d.addr + d.len - 1, 1)))
+        return false;
+      Desc data = {d.addr, d.len - 1, d.flags, 0};
+      if (status == VIRTIO_BLK_S_OK && data.len)
+        status = transfer(emu, type, pos, &data, written);
+      if (status == VIRTIO_BLK_S_OK && type == VIRTIO_BLK_T_FLUSH &&
+          msync(emu->disk, emu->disk_size, MS_SYNC) < 0)
+        status = VIRTIO_BLK_S_IOERR;
+      *st = status;
+      emu_invalidate_range(emu, d.addr + d.len - 1, 1);
+      *written += 1;
+      return true;
+    }
+    if (status == VIRTIO_BLK_S_OK)
+      status = transfer(emu, type, pos, &d, written);
+    pos += d.len;
+  }
+  return false; // a loop in the chain
+}
+
+/* Complete everything the driver made available, then interrupt once. */
+static void process_queue(Emulator *emu) {
+  VirtioBlk *v = &emu->machine.blk;
+  uint32_t num = v->queue_num;
+  uint8_t *avail = emu_guest_ptr(emu, v->avail, 4 + 2 * num);
+  uint8_t *used = emu_guest_ptr(emu, v->used, 4 + 8 * num);
+  if (!v->queue_ready || !num || !emu->disk || !avail || !used) {
+    v->status |= STATUS_NEEDS_RESET;
+    return;
+  }
+
+  uint16_t avail_idx = get16(avail + 2);
+  uint16_t used_idx = get16(used + 2);
+  bool done = false;
+  for (; v->last_avail != avail_idx; v->last_avail++, used_idx++) {
+    uint16_t head = get16(avail + 4 + 2 * (v->last_avail % num));
+    uint32_t written;
+    if (!run_request(emu, head, &written)) {
+      v->status |= STATUS_NEEDS_RESET;
+      break;
+    }
+    uint8_t *elem = used + 4 + 8 * (used_idx % num);
+    uint32_t id = head;
+    memcpy(elem, &id, 4);
+    memcpy(elem + 4, &written, 4);
+    done = true;
+  }
+  if (!done)
+    return;
+
+  // Publish the batch: one used index update, one interrupt
+  memcpy(used + 2, &used_idx, 2);
+  emu_invalidate_range(emu, v->used, 4 + 8 * num);
+  if (!(get16(avail) & VIRTQ_AVAIL_F_NO_INTERRUPT)) {
+    v->interrupt_status |= INTERRUPT_USED_RING;
+    plic_set_irq(emu, v->irq, true);
+  }
+}
+
+// ============================================================================
+// Registers
+// ============================================================================
+
+static uint64_t device_features(const Emulator *emu) {
+  return VIRTIO_F_VERSION_1 | VIRTIO_BLK_F_FLUSH |
+         (emu->disk_ro ? VIRTIO_BLK_F_RO : 0);
+}
+
+static void reset(Emulator *emu) {
+  VirtioBlk *v = &emu->machine.blk;
+  *v = (VirtioBlk){.irq = v->irq};
+  plic_set_irq(emu, v->irq, false);
+}
+
+uint32_t virtio_blk_read(Emulator *emu, uint64_t off) {
+  const VirtioBlk *v = &emu->machine.blk;
+  uint64_t capacity = emu->disk_size / VIRTIO_SECTOR_SIZE;
+
+  switch (off) {
+  case VIRTIO_MAGIC: return MAGIC_VALUE;
+  case VIRTIO_VERSION: return 2;
+  case VIRTIO_DEVICE_ID: return emu->disk ? DEVICE_ID_BLOCK : 0;
+  case VIRTIO_VENDOR_ID: return VENDOR_QEMU;
+  case VIRTIO_DEVICE_FEATURES:
+    return v->device_features_sel > 1
+               ? 0
+               : device_features(emu) >> (32 * v->device_features_sel);
+  case VIRTIO_QUEUE_NUM_MAX: return v->queue_sel == 0 ? QUEUE_NUM_MAX : 0;
+  case VIRTIO_QUEUE_READY: return v->queue_sel == 0 && v->queue_ready;
+  case VIRTIO_INTERRUPT_STATUS: return v->interrupt_status;
+  case VIRTIO_STATUS: return v->status;
+  case VIRTIO_CONFIG_GENERATION: return 0;
+  case VIRTIO_CONFIG: return (uint32_t)capacity;
+  case VIRTIO_CONFIG + 4: return capacity >> 32;
+  default: return 0;
+  }
+}
+
+void virtio_blk_write(Emulator *emu, uint64_t off, uint32_t val) {
+  VirtioBlk *v = &emu->machine.blk;
+  // Queue registers only exist for queue 0
+  bool q0 = v->queue_sel == 0;
+
+  switch (off) {
+  case VIRTIO_DEVICE_FEATURES_SEL: v->device_features_sel = val; break;
+  case VIRTIO_DRIVER_FEATURES_SEL: v->driver_features_sel = val; break;
+  case VIRTIO_DRIVER_FEATURES:
+    if (v->driver_features_sel <= 1) {
+      int shift = 32 * v->driver_features_sel;
+      v->driver_features = (v->driver_features & ~(0xFFFFFFFFULL << shift)) |
+                           (uint64_t)val << shift;
+    }
+    break;
+  case VIRTIO_QUEUE_SEL: v->queue_sel = val; break;
+  case VIRTIO_QUEUE_NUM:
+    // A power of two, at most QUEUE_NUM_MAX
+    if (q0 && val && val <= QUEUE_NUM_MAX && (val & (val - 1)) == 0)
+      v->queue_num = val;
+    break;
+  case VIRTIO_QUEUE_READY:
+    if (q0)
+      v->queue_ready = val & 1;
+    break;
+  case VIRTIO_QUEUE_NOTIFY:
+    if (val == 0)
+      process_queue(emu);
+    break;
+  case VIRTIO_INTERRUPT_ACK:
+    v->interrupt_status &= ~val;
+    if (!v->interrupt_status)
+      plic_set_irq(emu, v->irq, false);
+    break;
+  case VIRTIO_STATUS:
+    if (val == 0)
+      reset(emu);
+    else
+      v->status = val;
+    break;
+  // Ring addresses, 64 bits in two halves
+  case VIRTIO_QUEUE_DESC_LOW:
+  case VIRTIO_QUEUE_DESC_HIGH:
+  case VIRTIO_QUEUE_DRIVER_LOW:
+  case VIRTIO_QUEUE_DRIVER_HIGH:
+  case VIRTIO_QUEUE_DEVICE_LOW:
+  case VIRTIO_QUEUE_DEVICE_HIGH: {
+    if (!q0)
+      break;
+    uint64_t *reg = off < VIRTIO_QUEUE_DRIVER_LOW   ? &v->desc
+                    : off < VIRTIO_QUEUE_DEVICE_LOW ? &v->avail
+                                                    : &v->used;
+    int shift = off & 4 ? 32 : 0;
+    *reg = (*reg & ~(0xFFFFFFFFULL << shift)) | (uint64_t)val << shift;
+    break;
+  }
+  }
+}
@@ -0,0 +1,47 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+#include <stdint.h>
+
+struct Emulator;
+
+/*
+ * virtio-mmio block device (virtio 1.x "modern" register layout, version
+ * 2, one split virtqueue), backed by a host disk image.
+ *
+ * The image is mmap'd shared, so a request is a memcpy between the mapping
+ * and guest RAM and writes land in the file through the page cache; FLUSH
+ * is an msync. Requests are processed in full when the guest writes
+ * QueueNotify: every descriptor chain made available since the last
+ * notify is completed, the used ring is published once, and a single
+ * interrupt reports the whole batch (unless the driver set
+ * VIRTQ_AVAIL_F_NO_INTERRUPT).
+ *
+ * Without an image the slot reads as device ID 0 (nothing attached), like
+ * an empty QEMU virtio-mmio slot.
+ */
+#define VIRTIO_MMIO_SIZE 0x1000
+#define VIRTIO_SECTOR_SIZE 512
+
+typedef struct {
+  int irq; // PLIC source
+  uint32_t status;
+  uint32_t device_features_sel;
+  uint32_t driver_features_sel;
+  uint64_t driver_features;
+  uint32_t queue_sel;
+  uint32_t queue_num;
+  uint32_t queue_ready;
+  uint64_t desc, avail, used; // guest addresses of the queue's rings
+  uint16_t last_avail;        // next available ring entry to process
+  uint32_t interrupt_status;
+} VirtioBlk;
+
+/* Map `path` as the disk (read-only if the file is not writable). */
+bool virtio_blk_attach(struct Emulator *emu, const char *path);
+void virtio_blk_detach(struct Emulator *emu);
+
+/* Register access, `off` relative to the device base. */
+uint32_t virtio_blk_read(struct Emulator *emu, uint64_t off);
+void virtio_blk_write(struct Emulator *emu, uint64_t off, uint32_t val);
+
+#endif // VIRTIO_BLK_H
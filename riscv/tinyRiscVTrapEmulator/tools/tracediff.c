@@ -0,0 +1,152 @@
+/*
+ * tracediff: compare two commit traces and stop at the first divergence.
+ *
+ *   tracediff [-c lines] a.trace b.trace
+ *
+ * Traces are the format written by `risc --trace` and by the Go riscv_cpu
+ * model (see emu_trace_commit in src/emulator.h), one retired instruction
+ * per line. Lines that do not start with "0x" are skipped, so a trace may be
+ * mixed with other program output. Either file may be "-" (stdin) or a pipe;
+ * both are read one line at a time, so arbitrarily long runs can be
+ * compared without storing them.
+ *
+ * Exit status: 0 if the traces match, 1 at the first mismatch, 2 on error.
+ */
+#define _DEFAULT_SOURCE // getline on glibc
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_CONTEXT 64
+
+typedef struct {
+  FILE *f;
+  const char *name;
+  char *line;
+  size_t cap;
+} Trace;
+
+/* Next commit line, with trailing whitespace removed; false at EOF. */
+static bool next_commit(Trace *t) {
+  ssize_t n;
+  while ((n = getline(&t->line, &t->cap, t->f)) >= 0) {
+    while (n > 0 && (t->line[n - 1] == '\n' || t->line[n - 1] == '\r' ||
+                     t->line[n - 1] == ' '))
+      t->line[--n] = '\0';
+    if (strncmp(t->line, "0x", 2) == 0)
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Split a commit line into its fields: "pc (insn)", the register write and
+ * the memory write (either may be empty).
+ */
+typedef struct {
+  char head[64];
+  char reg[64];
+  char mem[96];
+} Commit;
+
+static void parse_commit(const char *line, Commit *c) {
+  memset(c, 0, sizeof(*c));
+  const char *reg = strstr(line, " x");
+  if (!reg)
+    reg = strstr(line, " f"); // FP register write
+  const char *mem = strstr(line, " mem ");
+  const char *end = line + strlen(line);
+  const char *head_end = reg ? reg : mem ? mem : end;
+
+  snprintf(c->head, sizeof(c->head), "%.*s", (int)(head_end - line), line);
+  if (reg)
+    snprintf(c->reg, sizeof(c->reg), "%.*s",
+             (int)((mem ? mem : end) - reg - 1), reg + 1);
+  if (mem)
+    snprintf(c->mem, sizeof(c->mem), "%s", mem + 1);
+}
+
+static const char *describe(const char *a, const char *b) {
+  Commit ca, cb;
+  parse_commit(a, &ca);
+  parse_commit(b, &cb);
+  if (strcmp(ca.head, cb.head) != 0)
+    return strncmp(a, b, strcspn(a, " ")) != 0 ? "pc differs"
+                                                : "instruction differs";
+  if (strcmp(ca.reg, cb.reg) != 0)
+    return "register write differs";
+  return "memory write differs";
+}
+
+static int usage(void) {
+  fprintf(stderr, "usage: tracediff [-c lines] a.trace b.trace\n");
+  return 2;
+}
+
+static bool open_trace(Trace *t, const char *path) {
+  t->name = path;
+  t->f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (!t->f)
+    perror(path);
+  return t->f != NULL;
+}
+
+int main(int argc, char **argv) {
+  int context = 5;
+  int i = 1;
+  if (i + 1 < argc && strcmp(argv[i], "-c") == 0) {
+    context = atoi(argv[i + 1]);
+    if (context < 0 || context > MAX_CONTEXT)
+      context = MAX_CONTEXT;
+    i += 2;
+  }
+  if (argc - i != 2)
+    return usage();
+
+  Trace a = {0}, b = {0};
+  if (!open_trace(&a, argv[i]) || !open_trace(&b, argv[i + 1]))
+    return 2;
+
+  // Ring of the last `context` matching lines
+  char *ring[MAX_CONTEXT] = {0};
+  unsigned long long n = 0;
+  int status = 0;
+
+  for (;;) {
+    bool more_a = next_commit(&a);
+    bool more_b = next_commit(&b);
+    if (!more_a && !more_b) {
+      printf("traces match: %llu instructions\n", n);
+      break;
+    }
+
+    if (more_a && more_b && strcmp(a.line, b.line) == 0) {
+      if (context) {
+        free(ring[n % context]);
+        ring[n % context] = strdup(a.line);
+      }
+      n++;
+      continue;
+    }
+
+    // Divergence: show the lead-up, then both sides
+    unsigned long long first = n > (unsigned)context ? n - context : 0;
+    printf("first mismatch at instruction %llu", n + 1);
+    if (more_a && more_b)
+      printf(" (%s)", describe(a.line, b.line));
+    printf("\n");
+    for (unsigned long long k = first; k < n; k++)
+      printf("  %8llu  %s\n", k + 1, ring[k % context]);
+    printf("< %8llu  %s\n", n + 1, more_a ? a.line : "<end of trace>");
+    printf("> %8llu  %s\n", n + 1, more_b ? b.line : "<end of trace>");
+    printf("(< %s, > %s)\n", a.name, b.name);
+    status = 1;
+    break;
+  }
+
+  for (int k = 0; k < MAX_CONTEXT; k++)
+    free(ring[k]);
+  free(a.line);
+  free(b.line);
+  return status;
+}
@@ -6,6 +6,7 @@
  * mapped at address 0x10000000.
  */
 
+#include <stdarg.h>
 #include <stdint.h>
 
 // ============================================================================
@@ -56,35 +57,135 @@ void uart_puts(const char *s) {
   }
 }
 
-// Print a number in hexadecimal
-void uart_put_hex(uint64_t n) {
-  uart_puts("0x");
-  for (int i = 60; i >= 0; i -= 4) {
-    int digit = (n >> i) & 0xF;
-    uart_putc(digit < 10 ? '0' + digit : 'a' + digit - 10);
-  }
+// Print n bytes; kprintf() sends each message with one call
+void uart_putn(const char *s, int n) {
+  for (int i = 0; i < n; i++)
+    uart_putc(s[i]);
 }
 
-// Print a number in decimal
-void uart_put_dec(int64_t n) {
-  if (n < 0) {
-    uart_putc('-');
-    n = -n;
-  }
-  if (n == 0) {
-    uart_putc('0');
-    return;
+// Which hart (CPU core) is running this code
+static inline int cpuid(void) {
+  uint64_t id;
+  asm volatile("csrr %0, mhartid" : "=r"(id));
+  return id;
+}
+
+// ============================================================================
+// kprintf
+// ============================================================================
+//
+// kprintf formats into this hart's buffer, then hands the whole message to
+// the UART with one uart_putn() call: one unit to the driver, so lines from
+// different harts (or from a trap handler) cannot interleave inside it.
+//
+// Formats: %d %u %x %c %s %p %%, 'l' for 64-bit arguments, and a width
+// with optional zero padding ("%5d", "%08x", "%016lx"). %p is 0x and 16
+// hex digits.
+//
+
+#define NCPU 8
+#define KPRINTF_BUF 256 // longer messages go out in pieces
+
+static struct kbuf {
+  char buf[KPRINTF_BUF];
+  int len;
+} kprintf_buf[NCPU];
+
+static void kbuf_putc(struct kbuf *b, char c) {
+  if (b->len == KPRINTF_BUF) {
+    uart_putn(b->buf, b->len);
+    b->len = 0;
   }
+  b->buf[b->len++] = c;
+}
 
-  char buf[20];
+static void kbuf_putnum(struct kbuf *b, uint64_t n, int base, int width,
+                        char pad) {
+  char digits[20];
   int i = 0;
-  while (n > 0) {
-    buf[i++] = '0' + (n % 10);
-    n /= 10;
-  }
-  while (i > 0) {
-    uart_putc(buf[--i]);
+  do {
+    digits[i++] = "0123456789abcdef"[n % base];
+    n /= base;
+  } while (n);
+  while (width-- > i)
+    kbuf_putc(b, pad);
+  while (i > 0)
+    kbuf_putc(b, digits[--i]);
+}
+
+static void kprintf(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+static void kprintf(const char *fmt, ...) {
+  struct kbuf *b = &kprintf_buf[cpuid()];
+  b->len = 0;
+
+  va_list ap;
+  va_start(ap, fmt);
+  for (const char *p = fmt; *p; p++) {
+    if (*p != '%') {
+      kbuf_putc(b, *p);
+      continue;
+    }
+    char pad = ' ';
+    int width = 0, is_long = 0;
+    if (*++p == '0') {
+      pad = '0';
+      p++;
+    }
+    while (*p >= '0' && *p <= '9')
+      width = width * 10 + *p++ - '0';
+    if (*p == 'l') {
+      is_long = 1;
+      p++;
+    }
+    if (*p == '\0')
+      break;
+
+    switch (*p) {
+    case 'd': {
+      int64_t v = is_long ? va_arg(ap, int64_t) : va_arg(ap, int);
+      uint64_t u = v;
+      if (v < 0) {
+        kbuf_putc(b, '-');
+        u = -u;
+        width--;
+      }
+      kbuf_putnum(b, u, 10, width, pad);
+      break;
+    }
+    case 'u':
+    case 'x': {
+      uint64_t u = is_long ? va_arg(ap, uint64_t) : va_arg(ap, unsigned);
+      kbuf_putnum(b, u, *p == 'u' ? 10 : 16, width, pad);
+      break;
+    }
+    case 'p':
+      kbuf_putc(b, '0');
+      kbuf_putc(b, 'x');
+      kbuf_putnum(b, (uint64_t)va_arg(ap, void *), 16, 16, '0');
+      break;
+    case 'c':
+      kbuf_putc(b, (char)va_arg(ap, int));
+      break;
+    case 's': {
+      const char *s = va_arg(ap, const char *);
+      if (!s)
+        s = "(null)";
+      while (*s)
+        kbuf_putc(b, *s++);
+      break;
+    }
+    default: // "%%", and anything unknown is printed as is
+      if (*p != '%')
+        kbuf_putc(b, '%');
+      kbuf_putc(b, *p);
+      break;
+    }
   }
+  va_end(ap);
+
+  uart_putn(b->buf, b->len);
 }
 
 // ============================================================================
@@ -142,34 +243,32 @@ int uart_getline(char *buf, int maxlen) {
 // ============================================================================
 
 void main(void) {
-  uart_puts("\r\n");
-  uart_puts("========================================\r\n");
-  uart_puts("  Bare-Metal RISC-V Hello World\r\n");
-  uart_puts("========================================\r\n");
-  uart_puts("\r\n");
-  uart_puts("UART base address: ");
-  uart_put_hex(UART0_BASE);
-  uart_puts("\r\n\r\n");
-
-  uart_puts("Commands:\r\n");
-  uart_puts("  echo  - Enter echo mode (type, see it back)\r\n");
-  uart_puts("  count - Count keypresses\r\n");
-  uart_puts("  hex   - Show hex codes of keys\r\n");
-  uart_puts("  quit  - Exit to halt\r\n");
-  uart_puts("\r\n");
-  uart_puts("Press Ctrl-A then X to exit QEMU.\r\n");
-  uart_puts("\r\n");
+  kprintf("\r\n");
+  kprintf("========================================\r\n");
+  kprintf("  Bare-Metal RISC-V Hello World\r\n");
+  kprintf("========================================\r\n");
+  kprintf("\r\n");
+  kprintf("UART base address: 0x%016lx\r\n\r\n", UART0_BASE);
+
+  kprintf("Commands:\r\n");
+  kprintf("  echo  - Enter echo mode (type, see it back)\r\n");
+  kprintf("  count - Count keypresses\r\n");
+  kprintf("  hex   - Show hex codes of keys\r\n");
+  kprintf("  quit  - Exit to halt\r\n");
+  kprintf("\r\n");
+  kprintf("Press Ctrl-A then X to exit QEMU.\r\n");
+  kprintf("\r\n");
 
   char line[64];
 
   while (1) {
-    uart_puts("> ");
+    kprintf("> ");
     uart_getline(line, sizeof(line));
 
     // Simple command parser
     if (line[0] == 'e' && line[1] == 'c' && line[2] == 'h' && line[3] == 'o') {
       // Echo mode
-      uart_puts("Echo mode (Ctrl-C to exit):\r\n");
+      kprintf("Echo mode (Ctrl-C to exit):\r\n");
       while (1) {
         char c = uart_getc();
         if (c == 3)
@@ -178,53 +277,37 @@ void main(void) {
         if (c == '\r')
           uart_putc('\n');
       }
-      uart_puts("\r\n");
+      kprintf("\r\n");
     } else if (line[0] == 'c' && line[1] == 'o' && line[2] == 'u') {
       // Count mode
-      uart_puts("Counting keypresses (Ctrl-C to exit):\r\n");
+      kprintf("Counting keypresses (Ctrl-C to exit):\r\n");
       int count = 0;
       while (1) {
         char c = uart_getc();
         if (c == 3)
           break; // Ctrl-C
         count++;
-        uart_puts("\rCount: ");
-        uart_put_dec(count);
-        uart_puts("   ");
+        kprintf("\rCount: %d   ", count);
       }
-      uart_puts("\r\nTotal: ");
-      uart_put_dec(count);
-      uart_puts(" keys\r\n");
+      kprintf("\r\nTotal: %d keys\r\n", count);
     } else if (line[0] == 'h' && line[1] == 'e' && line[2] == 'x') {
       // Hex mode - show key codes
-      uart_puts("Showing hex codes (Ctrl-C to exit):\r\n");
+      kprintf("Showing hex codes (Ctrl-C to exit):\r\n");
       while (1) {
         char c = uart_getc();
         if (c == 3)
           break; // Ctrl-C
-        uart_puts("Key: ");
-        if (c >= 32 && c < 127) {
-          uart_putc('\'');
-          uart_putc(c);
-          uart_putc('\'');
-        } else {
-          uart_puts("   ");
-        }
-        uart_puts(" = 0x");
-        uart_putc("0123456789ABCDEF"[(c >> 4) & 0xF]);
-        uart_putc("0123456789ABCDEF"[c & 0xF]);
-        uart_puts(" = ");
-        uart_put_dec(c);
-        uart_puts("\r\n");
+        if (c >= 32 && c < 127)
+          kprintf("Key: '%c' = 0x%02x = %d\r\n", c, (uint8_t)c, c);
+        else
+          kprintf("Key:     = 0x%02x = %d\r\n", (uint8_t)c, c);
       }
-      uart_puts("\r\n");
+      kprintf("\r\n");
     } else if (line[0] == 'q' && line[1] == 'u' && line[2] == 'i') {
-      uart_puts("Halting...\r\n");
+      kprintf("Halting...\r\n");
       break;
     } else if (line[0] != '\0') {
-      uart_puts("Unknown command: ");
-      uart_puts(line);
-      uart_puts("\r\n");
+      kprintf("Unknown command: %s\r\n", line);
     }
   }
 }
@@ -3,18 +3,54 @@
  *
  * Demonstrates:
  *   - Sv39 page table setup
- *   - Identity mapping with gigapages
+ *   - A physical page allocator
+ *   - Mapping with the largest page size that fits (4 KB, 2 MB, 1 GB)
+ *   - Per-region permissions, a stack guard page, non-identity mappings
+ *   - Unmapping with targeted sfence.vma
+ *   - Demand paging: reserved regions get frames on first touch
+ *   - Several harts on one page table: per-hart stacks, a frame allocator
+ *     with per-hart caches, page faults taken in parallel
+ *   - Timestamps of boot steps and traps
  *   - Switching from M-mode to S-mode
  *   - Page fault handling
  *
  * Memory layout (QEMU virt):
  *   0x10000000 - UART
  *   0x80000000 - RAM start (kernel loaded here)
- *   0x80080000 - Page tables
+ *   _end       - Free frames (page tables and anything else allocated)
  */
 
+#include <stdarg.h>
 #include <stdint.h>
 
+// ============================================================================
+// Ticket Spinlocks
+// ============================================================================
+//
+// Take a ticket, wait until it is served. Harts get the lock in the order
+// they asked for it, so none can starve, unlike a plain test-and-set lock.
+//
+// No interrupts are enabled in this example, so holders need not turn
+// them off; a page fault must not happen while one is held.
+//
+
+#define NCPU 8 // harts with a higher mhartid are parked by start.S
+
+struct spinlock {
+    uint32_t next;    // next ticket to hand out
+    uint32_t serving; // ticket that holds the lock
+};
+
+static void spin_lock(struct spinlock *lk) {
+    uint32_t ticket = __atomic_fetch_add(&lk->next, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&lk->serving, __ATOMIC_ACQUIRE) != ticket)
+        ;
+}
+
+static void spin_unlock(struct spinlock *lk) {
+    __atomic_store_n(&lk->serving, lk->serving + 1, __ATOMIC_RELEASE);
+}
+
 // ============================================================================
 // UART (for output)
 // ============================================================================
@@ -30,45 +66,14 @@ static inline void uart_putc(char c) {
     *(volatile uint8_t *)(UART0_BASE + UART_THR) = c;
 }
 
-static void uart_puts(const char *s) {
-    while (*s)
-        uart_putc(*s++);
-}
-
-static void uart_put_hex(uint64_t n) {
-    uart_puts("0x");
-    for (int i = 60; i >= 0; i -= 4) {
-        int d = (n >> i) & 0xF;
-        uart_putc(d < 10 ? '0' + d : 'a' + d - 10);
-    }
-}
+static struct spinlock console_lock;
 
-static void uart_put_hex_short(uint64_t n) {
-    uart_puts("0x");
-    // Skip leading zeros
-    int started = 0;
-    for (int i = 60; i >= 0; i -= 4) {
-        int d = (n >> i) & 0xF;
-        if (d != 0 || started || i == 0) {
-            uart_putc(d < 10 ? '0' + d : 'a' + d - 10);
-            started = 1;
-        }
-    }
-}
-
-static void uart_put_dec(uint64_t n) {
-    if (n == 0) {
-        uart_putc('0');
-        return;
-    }
-    char buf[20];
-    int i = 0;
-    while (n > 0) {
-        buf[i++] = '0' + (n % 10);
-        n /= 10;
-    }
-    while (i > 0)
-        uart_putc(buf[--i]);
+// Send n bytes, polling; kprintf() calls this once per message
+static void uart_putn(const char *s, int n) {
+    spin_lock(&console_lock);
+    for (int i = 0; i < n; i++)
+        uart_putc(s[i]);
+    spin_unlock(&console_lock);
 }
 
 // ============================================================================
@@ -85,6 +90,225 @@ static void uart_put_dec(uint64_t n) {
     asm volatile ("csrw " #csr ", %0" :: "r"(val)); \
 })
 
+// Hart id: start.S copies mhartid into tp, since S-mode cannot read it
+static inline int cpuid(void) {
+    uint64_t id;
+    asm volatile ("mv %0, tp" : "=r"(id));
+    return id;
+}
+
+// Counters, readable from S-mode because start.S sets mcounteren. time
+// is the CLINT's mtime, which S-mode could not reach otherwise: the CLINT
+// is not mapped.
+#define TIMER_FREQ 10000000UL // time ticks per second on QEMU virt
+
+static inline uint64_t rdcycle(void) {
+    uint64_t c;
+    asm volatile ("rdcycle %0" : "=r"(c));
+    return c;
+}
+
+static inline uint64_t rdtime(void) {
+    uint64_t t;
+    asm volatile ("rdtime %0" : "=r"(t));
+    return t;
+}
+
+// ============================================================================
+// kprintf
+// ============================================================================
+//
+// kprintf formats into this hart's buffer, then hands the whole message to
+// the UART with one uart_putn() call: one unit to the driver, so lines from
+// different harts (or from a trap handler) cannot interleave inside it.
+//
+// Formats: %d %u %x %c %s %p %%, 'l' for 64-bit arguments, and a width
+// with optional zero padding ("%5d", "%08x", "%016lx"). %p is 0x and 16
+// hex digits.
+//
+
+#define KPRINTF_BUF 256 // longer messages go out in pieces
+
+static struct kbuf {
+    char buf[KPRINTF_BUF];
+    int len;
+} kprintf_buf[NCPU];
+
+static void kbuf_putc(struct kbuf *b, char c) {
+    if (b->len == KPRINTF_BUF) {
+        uart_putn(b->buf, b->len);
+        b->len = 0;
+    }
+    b->buf[b->len++] = c;
+}
+
+static void kbuf_putnum(struct kbuf *b, uint64_t n, int base, int width,
+                        char pad) {
+    char digits[20];
+    int i = 0;
+    do {
+        digits[i++] = "0123456789abcdef"[n % base];
+        n /= base;
+    } while (n);
+    while (width-- > i)
+        kbuf_putc(b, pad);
+    while (i > 0)
+        kbuf_putc(b, digits[--i]);
+}
+
+static void kprintf(const char *fmt, ...)
+        __attribute__((format(printf, 1, 2)));
+
+static void kprintf(const char *fmt, ...) {
+    struct kbuf *b = &kprintf_buf[cpuid()];
+    b->len = 0;
+
+    va_list ap;
+    va_start(ap, fmt);
+    for (const char *p = fmt; *p; p++) {
+        if (*p != '%') {
+            kbuf_putc(b, *p);
+            continue;
+        }
+        char pad = ' ';
+        int width = 0, is_long = 0;
+        if (*++p == '0') {
+            pad = '0';
+            p++;
+        }
+        while (*p >= '0' && *p <= '9')
+            width = width * 10 + *p++ - '0';
+        if (*p == 'l') {
+            is_long = 1;
+            p++;
+        }
+        if (*p == '\0')
+            break;
+
+        switch (*p) {
+        case 'd': {
+            int64_t v = is_long ? va_arg(ap, int64_t) : va_arg(ap, int);
+            uint64_t u = v;
+            if (v < 0) {
+                kbuf_putc(b, '-');
+                u = -u;
+                width--;
+            }
+            kbuf_putnum(b, u, 10, width, pad);
+            break;
+        }
+        case 'u':
+        case 'x': {
+            uint64_t u = is_long ? va_arg(ap, uint64_t) : va_arg(ap, unsigned);
+            kbuf_putnum(b, u, *p == 'u' ? 10 : 16, width, pad);
+            break;
+        }
+        case 'p':
+            kbuf_putc(b, '0');
+            kbuf_putc(b, 'x');
+            kbuf_putnum(b, (uint64_t)va_arg(ap, void *), 16, 16, '0');
+            break;
+        case 'c':
+            kbuf_putc(b, (char)va_arg(ap, int));
+            break;
+        case 's': {
+            const char *s = va_arg(ap, const char *);
+            if (!s)
+                s = "(null)";
+            while (*s)
+                kbuf_putc(b, *s++);
+            break;
+        }
+        default: // "%%", and anything unknown is printed as is
+            if (*p != '%')
+                kbuf_putc(b, '%');
+            kbuf_putc(b, *p);
+            break;
+        }
+    }
+    va_end(ap);
+
+    uart_putn(b->buf, b->len);
+}
+
+// ============================================================================
+// Timestamps
+// ============================================================================
+//
+// tstamp("what") records the cycle counter and time at a named point: a
+// boot step, a trap's entry and exit. That is two counter reads, an
+// atomic add and four stores, cheap enough to leave in the trap path.
+//
+// The first TSTAMP_KEEP records (boot, the first traps) stay; the rest go
+// round a ring in the other slots, which always holds the most recent.
+// tstamp_report() prints both, with the cycles from each record to the
+// next on the same hart (cycle counters are per hart; time is shared).
+// It may race with harts still recording and print a torn entry.
+//
+// start.S takes the stamps before BSS (and the ring in it) is cleared and
+// around the satp switch, and leaves them in boot_stamps.
+//
+
+#define NTSTAMP 64
+#define TSTAMP_KEEP 16
+
+static struct tstamp {
+    const char *what;
+    uint64_t cycle, time;
+    int hart;
+} tstamps[NTSTAMP];
+static uint32_t ntstamps; // recorded so far
+
+static struct tstamp *tstamp_slot(uint32_t n) {
+    if (n < TSTAMP_KEEP)
+        return &tstamps[n];
+    return &tstamps[TSTAMP_KEEP + (n - TSTAMP_KEEP) % (NTSTAMP - TSTAMP_KEEP)];
+}
+
+static void tstamp_at(const char *what, uint64_t cycle, uint64_t time) {
+    struct tstamp *t =
+        tstamp_slot(__atomic_fetch_add(&ntstamps, 1, __ATOMIC_RELAXED));
+    t->what = what;
+    t->cycle = cycle;
+    t->time = time;
+    t->hart = cpuid();
+}
+
+static void tstamp(const char *what) {
+    tstamp_at(what, rdcycle(), rdtime());
+}
+
+// start.S: cycle, time at reset, after BSS is cleared, after satp is set
+extern uint64_t boot_stamps[6];
+
+static void tstamp_print(struct tstamp *t, struct tstamp *prev) {
+    uint64_t us = (t->time - tstamps[0].time) / (TIMER_FREQ / 1000000);
+    if (prev && prev->hart == t->hart)
+        kprintf("  %9lu us  hart %d  %10lu cycles  %s\r\n", us, t->hart,
+                t->cycle - prev->cycle, t->what);
+    else
+        kprintf("  %9lu us  hart %d           - cycles  %s\r\n", us, t->hart,
+                t->what);
+}
+
+static void tstamp_report(void) {
+    uint32_t n = __atomic_load_n(&ntstamps, __ATOMIC_RELAXED);
+    kprintf("--- Timestamps: %u recorded, time since reset ---\r\n", n);
+    struct tstamp *prev[NCPU] = {0};
+    for (uint32_t i = 0; i < n; i++) {
+        if (i == TSTAMP_KEEP && n > NTSTAMP) {
+            kprintf("  ... %u more ...\r\n", n - NTSTAMP);
+            i = n - (NTSTAMP - TSTAMP_KEEP);
+            for (int h = 0; h < NCPU; h++)
+                prev[h] = 0; // no step across the gap
+        }
+        struct tstamp *t = tstamp_slot(i);
+        tstamp_print(t, prev[t->hart]);
+        prev[t->hart] = t;
+    }
+    kprintf("\r\n");
+}
+
 // ============================================================================
 // Page Table Constants
 // ============================================================================
@@ -109,23 +333,29 @@ static void uart_put_dec(uint64_t n) {
 #define PTE_A   (1UL << 6)      // Accessed
 #define PTE_D   (1UL << 7)      // Dirty
 
-// Gigapage size (1 GB = 2^30 bytes)
-#define GIGAPAGE_SIZE   (1UL << 30)
-#define GIGAPAGE_MASK   (GIGAPAGE_SIZE - 1)
+// Bytes mapped by one leaf PTE at each level: 4 KB, 2 MB (megapage),
+// 1 GB (gigapage)
+#define LEVEL_SIZE(level) (1UL << (PAGE_SHIFT + 9 * (level)))
 
-// Page table location (must be page-aligned)
-// We place it after our code at 0x80080000
-#define PAGE_TABLE_ROOT 0x80080000UL
+// Index into the page table at `level` for virtual address va
+#define PX(level, va)   (((va) >> (PAGE_SHIFT + 9 * (level))) & 0x1FF)
+
+// Stay below bit 38 so addresses need no sign extension (like xv6)
+#define MAXVA           (1UL << 38)
+
+#define PG_ROUND_UP(a)  (((a) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
 
 // ============================================================================
 // Page Table Entry Helpers
 // ============================================================================
 
-// Create a PTE that points to a physical address with given flags
-// For leaf entries (gigapages), physical address must be gigapage-aligned
+// Create a PTE that points to a physical address with given flags.
+// A, and D for writable pages, are set up front: hardware may otherwise
+// fault on the first access to let software track them.
 static inline uint64_t make_leaf_pte(uint64_t pa, uint64_t flags) {
     // PPN is bits [53:10] of the PTE
     // PA >> 12 gives us the full PPN, then shift left by 10 to position it
+    flags |= PTE_A | ((flags & PTE_W) ? PTE_D : 0);
     return ((pa >> PAGE_SHIFT) << 10) | flags | PTE_V;
 }
 
@@ -145,6 +375,11 @@ static inline int pte_is_leaf(uint64_t pte) {
     return (pte & (PTE_R | PTE_W | PTE_X)) != 0;
 }
 
+// Flush the TLB entry for one virtual address, instead of the whole TLB
+static inline void sfence_vma_page(uint64_t va) {
+    asm volatile ("sfence.vma %0, zero" :: "r"(va) : "memory");
+}
+
 // ============================================================================
 // Memory Utilities
 // ============================================================================
@@ -155,71 +390,323 @@ static void memset64(uint64_t *dst, uint64_t val, uint64_t count) {
     }
 }
 
+// ============================================================================
+// Physical Page Allocator
+// ============================================================================
+//
+// Hands out 4 KB frames from the end of the kernel image (_end in
+// linker.ld) to the end of RAM. Freed frames go on a free list linked
+// through the frames themselves, as in xv6's kalloc.c. Frames never
+// handed out are not on the list: they come from a bump pointer, so boot
+// does not touch all of RAM to build the list. Runs with paging on or off:
+// all of RAM is identity mapped.
+//
+// Each hart keeps a small cache of free frames and only takes the global
+// lock to move FRAME_BATCH of them at a time to or from the shared pool,
+// so harts faulting in pages at once rarely wait for each other. A frame
+// is zeroed after frames_lock is released, though a caller such as walk()
+// may still hold vm_lock. The price: a hart can run out while the others
+// still hold up to 2 * FRAME_BATCH - 1 frames each.
+//
+
+#define PHYS_TOP (0x80000000UL + 128 * 1024 * 1024) // QEMU -m 128M
+#define FRAME_BATCH 32
+
+extern char _end[];
+
+struct frame {
+    struct frame *next;
+};
+
+// The shared pool
+static struct spinlock frames_lock;
+static struct frame *free_frames;
+static uint64_t frames_next; // first frame never handed out
+
+static struct frame_cache {
+    struct frame *list;
+    int n;
+} frame_caches[NCPU];
+
+static uint64_t frames_free; // anywhere but in use; updated atomically
+
+static void free_frame(uint64_t pa) {
+    struct frame_cache *c = &frame_caches[cpuid()];
+    struct frame *f = (struct frame *)pa;
+    f->next = c->list;
+    c->list = f;
+    c->n++;
+    __atomic_fetch_add(&frames_free, 1, __ATOMIC_RELAXED);
+
+    // Too many: give a batch back for other harts to use
+    if (c->n == 2 * FRAME_BATCH) {
+        struct frame *first = c->list, *last = first;
+        for (int i = 1; i < FRAME_BATCH; i++)
+            last = last->next;
+        c->list = last->next;
+        c->n -= FRAME_BATCH;
+        spin_lock(&frames_lock);
+        last->next = free_frames;
+        free_frames = first;
+        spin_unlock(&frames_lock);
+    }
+}
+
+static void frames_init(void) {
+    frames_next = PG_ROUND_UP((uint64_t)_end);
+    frames_free = (PHYS_TOP - frames_next) / PAGE_SIZE;
+}
+
+// Move up to FRAME_BATCH frames from the pool to c
+static void frame_refill(struct frame_cache *c) {
+    spin_lock(&frames_lock);
+    while (c->n < FRAME_BATCH) {
+        struct frame *f;
+        if (free_frames) {
+            f = free_frames;
+            free_frames = f->next;
+        } else if (frames_next < PHYS_TOP) {
+            f = (struct frame *)frames_next;
+            frames_next += PAGE_SIZE;
+        } else {
+            break;
+        }
+        f->next = c->list;
+        c->list = f;
+        c->n++;
+    }
+    spin_unlock(&frames_lock);
+}
+
+// Returns a zeroed frame, or 0 when memory runs out
+static uint64_t alloc_frame(void) {
+    struct frame_cache *c = &frame_caches[cpuid()];
+    if (!c->n)
+        frame_refill(c);
+    if (!c->n)
+        return 0;
+    uint64_t pa = (uint64_t)c->list;
+    c->list = c->list->next;
+    c->n--;
+    __atomic_fetch_sub(&frames_free, 1, __ATOMIC_RELAXED);
+    memset64((uint64_t *)pa, 0, PAGE_SIZE / 8);
+    return pa;
+}
+
+// ============================================================================
+// Building Page Tables
+// ============================================================================
+
+// All harts share one page table. Once they run, whoever changes it (the
+// functions below, and the counters) holds vm_lock, as does whoever reads
+// or adds demand-paging regions.
+static struct spinlock vm_lock;
+
+// Leaf PTEs installed at each level, and table pages allocated, for the
+// setup summary
+static uint64_t leaves[LEVELS];
+static uint64_t table_pages;
+
+// Find the PTE for va at `level` (0 = 4 KB, 1 = 2 MB, 2 = 1 GB), creating
+// the tables above it if `alloc` is set. Returns 0 if a table is missing
+// (and !alloc), memory ran out, or a bigger page already covers va.
+static uint64_t *walk(uint64_t *root, uint64_t va, int level, int alloc) {
+    uint64_t *table = root;
+    for (int l = LEVELS - 1; l > level; l--) {
+        uint64_t *pte = &table[PX(l, va)];
+        if (*pte & PTE_V) {
+            if (pte_is_leaf(*pte))
+                return 0;
+            table = (uint64_t *)pte_to_pa(*pte);
+        } else {
+            uint64_t pa;
+            if (!alloc || !(pa = alloc_frame()))
+                return 0;
+            table_pages++;
+            *pte = make_table_pte(pa);
+            table = (uint64_t *)pa;
+        }
+    }
+    return &table[PX(level, va)];
+}
+
+// Find the leaf PTE that maps va, whatever its size. Sets *level.
+static uint64_t *walk_leaf(uint64_t *root, uint64_t va, int *level) {
+    uint64_t *table = root;
+    for (int l = LEVELS - 1; l >= 0; l--) {
+        uint64_t *pte = &table[PX(l, va)];
+        if (!(*pte & PTE_V))
+            return 0;
+        if (pte_is_leaf(*pte)) {
+            *level = l;
+            return pte;
+        }
+        table = (uint64_t *)pte_to_pa(*pte);
+    }
+    return 0;
+}
+
+/*
+ * Map [va, va + size) to [pa, pa + size) with permissions perm (PTE_R,
+ * PTE_W, PTE_X, PTE_U, PTE_G). Each step uses the largest page that va and
+ * pa are both aligned to and that fits in what is left, so big regions
+ * take 2 MB or 1 GB leaves: fewer table pages, and one TLB entry covers
+ * 512 or 262144 times as much as a 4 KB page.
+ *
+ * Returns 0, or -1 if the range is misaligned or out of range, memory ran
+ * out, or part of it is already mapped.
+ */
+static int map_pages(uint64_t *root, uint64_t va, uint64_t pa, uint64_t size,
+                     uint64_t perm) {
+    if ((va | pa | size) % PAGE_SIZE || va + size > MAXVA || va + size < va)
+        return -1;
+
+    while (size > 0) {
+        int level = LEVELS - 1;
+        while (level > 0 && ((va | pa) % LEVEL_SIZE(level) ||
+                             size < LEVEL_SIZE(level)))
+            level--;
+
+        uint64_t *pte = walk(root, va, level, 1);
+        // A table already hangs here (smaller pages nearby): go smaller
+        while (pte && level > 0 && (*pte & PTE_V) && !pte_is_leaf(*pte))
+            pte = walk(root, va, --level, 1);
+        if (!pte || (*pte & PTE_V))
+            return -1;
+
+        *pte = make_leaf_pte(pa, perm);
+        leaves[level]++;
+        va += LEVEL_SIZE(level);
+        pa += LEVEL_SIZE(level);
+        size -= LEVEL_SIZE(level);
+    }
+    return 0;
+}
+
+/*
+ * Remove the mappings in [va, va + size), flushing each one from the TLB
+ * with a targeted sfence.vma: other translations stay cached. A 2 MB or
+ * 1 GB page can only be unmapped whole. With free_pa set, the frames
+ * behind the mappings go back to the allocator. Table pages that become
+ * empty are kept.
+ *
+ * Returns 0, or -1 if part of the range is not mapped (or splits a big
+ * page); what came before it is unmapped by then.
+ */
+static int unmap_pages(uint64_t *root, uint64_t va, uint64_t size,
+                       int free_pa) {
+    while (size > 0) {
+        int level;
+        uint64_t *pte = walk_leaf(root, va, &level);
+        if (!pte)
+            return -1;
+        uint64_t len = LEVEL_SIZE(level);
+        if (va % len || size < len)
+            return -1;
+
+        uint64_t pa = pte_to_pa(*pte);
+        *pte = 0;
+        sfence_vma_page(va);
+        if (free_pa)
+            for (uint64_t off = 0; off < len; off += PAGE_SIZE)
+                free_frame(pa + off);
+        leaves[level]--;
+        va += len;
+        size -= len;
+    }
+    return 0;
+}
+
 // ============================================================================
 // Page Table Setup (called from assembly before entering S-mode)
 // ============================================================================
 
+// Kernel image layout, from linker.ld
+extern char _text_end[], _rodata_end[], _stacks[], _stacks_end[];
+
+// Each hart's block in _stacks: a guard page, the stack, then the trap
+// stack with the trap frame at its top. Keep in sync with start.S.
+#define KSTACK_SIZE     0x4000
+#define TRAP_STACK_SIZE 0x1000
+#define HART_STACKS     (PAGE_SIZE + KSTACK_SIZE + TRAP_STACK_SIZE)
+
+static uint64_t *kernel_root;
+
+static void kmap(const char *what, uint64_t start, uint64_t end,
+                 uint64_t perm) {
+    kprintf("  %s 0x%08lx-0x%08lx %c%c%c\r\n", what, start, end - 1,
+            (perm & PTE_R) ? 'r' : '-', (perm & PTE_W) ? 'w' : '-',
+            (perm & PTE_X) ? 'x' : '-');
+    if (map_pages(kernel_root, start, start, end - start, perm) < 0) {
+        kprintf("map_pages failed for %s\r\n", what);
+        while (1)
+            asm volatile ("wfi");
+    }
+}
+
 // This function is called from start.S in Machine mode.
-// It builds identity-mapped page tables and returns the root table address.
+// It builds the kernel's page table and returns the root table address.
 uint64_t setup_page_tables(void) {
-    uart_puts("\r\n");
-    uart_puts("================================================\r\n");
-    uart_puts("  Setting up Sv39 Page Tables\r\n");
-    uart_puts("================================================\r\n\r\n");
+    tstamp_at("reset", boot_stamps[0], boot_stamps[1]);
+    tstamp_at("BSS cleared", boot_stamps[2], boot_stamps[3]);
 
-    // Get pointer to root page table
-    uint64_t *root = (uint64_t *)PAGE_TABLE_ROOT;
+    kprintf("\r\n");
+    kprintf("================================================\r\n");
+    kprintf("  Setting up Sv39 Page Tables\r\n");
+    kprintf("================================================\r\n\r\n");
 
-    uart_puts("Page table root at: ");
-    uart_put_hex(PAGE_TABLE_ROOT);
-    uart_puts("\r\n\r\n");
+    frames_init();
+    kprintf("Free frames: %lu (0x%lx-0x%lx)\r\n", frames_free,
+            PG_ROUND_UP((uint64_t)_end), PHYS_TOP - 1);
 
-    // Clear the root page table (512 entries * 8 bytes = 4096 bytes)
-    uart_puts("Clearing page table...\r\n");
-    memset64(root, 0, PTE_PER_PAGE);
+    kernel_root = (uint64_t *)alloc_frame();
+    table_pages = 1;
+    kprintf("Page table root at: 0x%016lx\r\n\r\n",
+            (uint64_t)kernel_root);
 
     // ========================================================================
-    // Create Identity Mapping using Gigapages (1 GB each)
+    // Identity-map only what the kernel uses, each with its own permissions
     // ========================================================================
     //
-    // Sv39 virtual address: | VPN[2] | VPN[1] | VPN[0] | Offset |
-    // For a gigapage, we put a leaf entry directly in the root table (level 2).
-    // VPN[2] selects which 1GB region.
-    //
-    // Physical address ranges we need to map:
-    //   0x00000000 - 0x3FFFFFFF (1 GB) - Contains UART at 0x10000000
-    //   0x80000000 - 0xBFFFFFFF (1 GB) - RAM (our code and data)
-    //
-    // VPN[2] = VA[38:30], so:
-    //   VA 0x00000000 has VPN[2] = 0
-    //   VA 0x80000000 has VPN[2] = 2 (0x80000000 >> 30 = 2)
+    // Code is not writable, data is not executable, the page below each
+    // hart's stack is not mapped at all (an overflow faults instead of
+    // silently corrupting its neighbour), and nothing else in the low 2 GB
+    // exists.
+    // Free RAM is mapped too so the allocator's frames can be used after
+    // paging is on; from the first 2 MB boundary on it takes megapages.
     //
     // ========================================================================
 
-    uart_puts("Creating identity-mapped gigapages:\r\n");
-
-    // Map first 1 GB (0x00000000 - 0x3FFFFFFF) - contains UART
-    // VPN[2] = 0
-    uint64_t pte0 = make_leaf_pte(0x00000000UL, PTE_R | PTE_W);
-    root[0] = pte0;
-    uart_puts("  [0] VA 0x00000000-0x3FFFFFFF -> PA 0x00000000 (UART region)\r\n");
-    uart_puts("      PTE: ");
-    uart_put_hex(pte0);
-    uart_puts("\r\n");
+    kprintf("Identity mappings:\r\n");
+    uint64_t kbase = 0x80000000UL;
+    kmap("UART    ", UART0_BASE, UART0_BASE + PAGE_SIZE, PTE_R | PTE_W);
+    kmap("text    ", kbase, (uint64_t)_text_end, PTE_R | PTE_X);
+    kmap("rodata  ", (uint64_t)_text_end, (uint64_t)_rodata_end, PTE_R);
+    kmap("data    ", (uint64_t)_rodata_end, (uint64_t)_stacks,
+         PTE_R | PTE_W);
+    for (int hart = 0; hart < NCPU; hart++) {
+        uint64_t block = (uint64_t)_stacks + hart * HART_STACKS;
+        if (map_pages(kernel_root, block + PAGE_SIZE, block + PAGE_SIZE,
+                      HART_STACKS - PAGE_SIZE, PTE_R | PTE_W) < 0) {
+            kprintf("map_pages failed for hart %d's stacks\r\n", hart);
+            while (1)
+                asm volatile ("wfi");
+        }
+    }
+    kprintf("  stacks   0x%08lx-0x%08lx rw- (%d harts, guard page below "
+            "each)\r\n",
+            (uint64_t)_stacks, (uint64_t)_stacks_end - 1, NCPU);
+    kmap("free RAM", PG_ROUND_UP((uint64_t)_end), PHYS_TOP, PTE_R | PTE_W);
 
-    // Map RAM region (0x80000000 - 0xBFFFFFFF)
-    // VPN[2] = 2
-    uint64_t pte2 = make_leaf_pte(0x80000000UL, PTE_R | PTE_W | PTE_X);
-    root[2] = pte2;
-    uart_puts("  [2] VA 0x80000000-0xBFFFFFFF -> PA 0x80000000 (RAM/kernel)\r\n");
-    uart_puts("      PTE: ");
-    uart_put_hex(pte2);
-    uart_puts("\r\n");
+    kprintf("\r\nLeaf PTEs: %lu x 4 KB, %lu x 2 MB, %lu x 1 GB\r\n",
+            leaves[0], leaves[1], leaves[2]);
+    kprintf("Page table pages: %lu\r\n", table_pages);
+    tstamp("page tables built");
 
-    uart_puts("\r\nPage table setup complete!\r\n");
-    uart_puts("Returning root table address for satp...\r\n\r\n");
+    kprintf("\r\nPage table setup complete!\r\n");
+    kprintf("Returning root table address for satp...\r\n\r\n");
 
-    return PAGE_TABLE_ROOT;
+    return (uint64_t)kernel_root;
 }
 
 // ============================================================================
@@ -259,63 +746,149 @@ static const char *exception_names[] = {
     [SCAUSE_STORE_PAGE_FAULT]   = "Store/AMO page fault",
 };
 
+// ============================================================================
+// Demand Paging
+// ============================================================================
+//
+// reserve() only records a range of virtual addresses and its permissions;
+// nothing is mapped. The first load or store to a page in it page-faults,
+// and demand_fault() allocates a zeroed frame, maps it, and lets the trap
+// return: sret goes back to sepc, the faulting instruction, which now
+// succeeds. Memory in use grows with the pages actually touched, not with
+// the size of the reservation.
+//
+
+#define NREGION 8
+
+static struct region {
+    const char *name;
+    uint64_t start, end; // [start, end), page aligned
+    uint64_t perm;
+} regions[NREGION];
+static int nregions;
+
+static uint64_t demand_faults; // pages filled in; updated atomically
+
+// Returns 0, or -1 if the range is misaligned, overlaps another region or
+// the table is full
+static int reserve(const char *name, uint64_t va, uint64_t size,
+                   uint64_t perm) {
+    if ((va | size) % PAGE_SIZE || va + size > MAXVA || va + size <= va)
+        return -1;
+    spin_lock(&vm_lock);
+    int ret = nregions == NREGION ? -1 : 0;
+    for (int i = 0; i < nregions; i++)
+        if (va < regions[i].end && regions[i].start < va + size)
+            ret = -1;
+    if (ret == 0)
+        regions[nregions++] = (struct region){name, va, va + size, perm};
+    spin_unlock(&vm_lock);
+    return ret;
+}
+
+// Handle a page fault at va by mapping a fresh frame, if va is in a
+// region that allows the access. Returns 0 if the faulting instruction
+// can be retried, -1 for a real fault.
+static int demand_fault(uint64_t scause, uint64_t va) {
+    uint64_t need = scause == SCAUSE_STORE_PAGE_FAULT ? PTE_W
+                    : scause == SCAUSE_LOAD_PAGE_FAULT ? PTE_R
+                                                       : PTE_X;
+    va &= ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t pa = alloc_frame(); // zeroed before vm_lock is taken
+    if (!pa)
+        return -1;
+
+    spin_lock(&vm_lock);
+    struct region *r = 0;
+    for (int i = 0; i < nregions; i++)
+        if (va >= regions[i].start && va < regions[i].end)
+            r = &regions[i];
+    int level, ret = 0;
+    uint64_t *pte;
+    if (!r || !(r->perm & need)) {
+        free_frame(pa);
+        ret = -1;
+    } else if ((pte = walk_leaf(kernel_root, va, &level))) {
+        // Mapped already: either another hart faulted on the same page
+        // first, and this TLB missed it, or the access broke the page's
+        // permissions rather than finding it missing
+        free_frame(pa);
+        if (!(*pte & need))
+            ret = -1;
+    } else if (map_pages(kernel_root, va, pa, PAGE_SIZE, r->perm) < 0) {
+        free_frame(pa);
+        ret = -1;
+    } else {
+        __atomic_fetch_add(&demand_faults, 1, __ATOMIC_RELAXED);
+    }
+    spin_unlock(&vm_lock);
+
+    // The hardware may have cached the invalid entry
+    if (ret == 0)
+        sfence_vma_page(va);
+    return ret;
+}
+
 // ============================================================================
 // Trap Handler (called from assembly)
 // ============================================================================
 
 void trap_handler(void) {
+    uint64_t start = rdcycle();
     uint64_t scause = read_csr(scause);
     uint64_t sepc = read_csr(sepc);
     uint64_t stval = read_csr(stval);
+    static int trapped;
+    tstamp_at(__atomic_exchange_n(&trapped, 1, __ATOMIC_RELAXED)
+                  ? "trap entry"
+                  : "first trap",
+              start, rdtime());
 
     // Check if it's an interrupt (high bit set) or exception
     if (scause & (1UL << 63)) {
         // Interrupt
         uint64_t cause = scause & 0xFF;
-        uart_puts("\r\n[INTERRUPT] cause=");
-        uart_put_dec(cause);
-        uart_puts("\r\n");
+        kprintf("\r\n[INTERRUPT] cause=%lu\r\n", cause);
     } else {
-        // Exception
-        uart_puts("\r\n========================================\r\n");
-        uart_puts("EXCEPTION OCCURRED!\r\n");
-        uart_puts("========================================\r\n");
-
-        uart_puts("scause: ");
-        uart_put_dec(scause);
-        if (scause < 16 && exception_names[scause]) {
-            uart_puts(" (");
-            uart_puts(exception_names[scause]);
-            uart_puts(")");
+        // Exception: a first touch of a reserved page is not an error
+        if ((scause == SCAUSE_LOAD_PAGE_FAULT ||
+             scause == SCAUSE_STORE_PAGE_FAULT ||
+             scause == SCAUSE_INSTR_PAGE_FAULT) &&
+            demand_fault(scause, stval) == 0) {
+            tstamp("trap exit");
+            return;
         }
-        uart_puts("\r\n");
 
-        uart_puts("sepc:   ");
-        uart_put_hex(sepc);
-        uart_puts(" (faulting instruction)\r\n");
+        kprintf("\r\n========================================\r\n");
+        kprintf("EXCEPTION OCCURRED!\r\n");
+        kprintf("========================================\r\n");
+
+        const char *name = scause < 16 ? exception_names[scause] : 0;
+        if (name)
+            kprintf("scause: %lu (%s)\r\n", scause, name);
+        else
+            kprintf("scause: %lu\r\n", scause);
 
-        uart_puts("stval:  ");
-        uart_put_hex(stval);
+        kprintf("sepc:   0x%016lx (faulting instruction)\r\n", sepc);
 
         // For page faults, stval contains the faulting virtual address
-        if (scause == SCAUSE_INSTR_PAGE_FAULT ||
-            scause == SCAUSE_LOAD_PAGE_FAULT ||
-            scause == SCAUSE_STORE_PAGE_FAULT) {
-            uart_puts(" (faulting virtual address)");
-        }
-        uart_puts("\r\n");
+        int page_fault = scause == SCAUSE_INSTR_PAGE_FAULT ||
+                         scause == SCAUSE_LOAD_PAGE_FAULT ||
+                         scause == SCAUSE_STORE_PAGE_FAULT;
+        kprintf("stval:  0x%016lx%s\r\n", stval,
+                page_fault ? " (faulting virtual address)" : "");
 
         // For page faults, provide more details
         if (scause == SCAUSE_LOAD_PAGE_FAULT) {
-            uart_puts("\r\n-> Attempted to READ from unmapped address!\r\n");
+            kprintf("\r\n-> Attempted to READ from unmapped address!\r\n");
         } else if (scause == SCAUSE_STORE_PAGE_FAULT) {
-            uart_puts("\r\n-> Attempted to WRITE to unmapped address!\r\n");
+            kprintf("\r\n-> Attempted to WRITE to unmapped address!\r\n");
         } else if (scause == SCAUSE_INSTR_PAGE_FAULT) {
-            uart_puts("\r\n-> Attempted to EXECUTE from unmapped address!\r\n");
+            kprintf("\r\n-> Attempted to EXECUTE from unmapped address!\r\n");
         }
 
-        uart_puts("========================================\r\n");
-        uart_puts("Halting.\r\n");
+        kprintf("========================================\r\n");
+        kprintf("Halting.\r\n");
 
         // Halt on exception
         while (1)
@@ -329,54 +902,152 @@ void trap_handler(void) {
 
 // Test reading from mapped memory
 static void test_mapped_read(void) {
-    uart_puts("Test 1: Reading from mapped memory (should succeed)\r\n");
-    uart_puts("  Reading from 0x80000000 (kernel code)...\r\n");
+    kprintf("Test 1: Reading from mapped memory (should succeed)\r\n");
+    kprintf("  Reading from 0x80000000 (kernel code)...\r\n");
 
     volatile uint32_t *ptr = (volatile uint32_t *)0x80000000UL;
     uint32_t val = *ptr;
 
-    uart_puts("  Value at 0x80000000: ");
-    uart_put_hex_short(val);
-    uart_puts(" [OK]\r\n\r\n");
+    kprintf("  Value at 0x80000000: 0x%x [OK]\r\n\r\n", val);
 }
 
 // Test writing to mapped memory
 static void test_mapped_write(void) {
-    uart_puts("Test 2: Writing to mapped memory (should succeed)\r\n");
+    kprintf("Test 2: Writing to mapped memory (should succeed)\r\n");
 
     // Write to a safe location (somewhere in our data section)
     extern uint64_t test_variable;
-    uart_puts("  Writing 0xDEADBEEF to test_variable...\r\n");
+    kprintf("  Writing 0xDEADBEEF to test_variable...\r\n");
 
     test_variable = 0xDEADBEEFCAFEBABEUL;
 
-    uart_puts("  Read back: ");
-    uart_put_hex(test_variable);
-    if (test_variable == 0xDEADBEEFCAFEBABEUL) {
-        uart_puts(" [OK]\r\n\r\n");
-    } else {
-        uart_puts(" [FAIL]\r\n\r\n");
-    }
+    kprintf("  Read back: 0x%016lx %s\r\n\r\n", test_variable,
+            test_variable == 0xDEADBEEFCAFEBABEUL ? "[OK]" : "[FAIL]");
 }
 
 // Test UART access (shows our device mapping works)
 static void test_uart_access(void) {
-    uart_puts("Test 3: UART access at 0x10000000 (should succeed)\r\n");
-    uart_puts("  If you see this, UART mapping works! [OK]\r\n\r\n");
+    kprintf("Test 3: UART access at 0x10000000 (should succeed)\r\n");
+    kprintf("  If you see this, UART mapping works! [OK]\r\n\r\n");
+}
+
+// Map one VA to two different frames in turn. Without the sfence.vma in
+// unmap_pages, the second read could still hit the TLB entry for the first.
+static void test_remap(void) {
+    kprintf("Test 4: Non-identity mapping and remapping (should succeed)\r\n");
+
+    uint64_t va = 0x100000000UL; // 4 GB: far from any physical address
+    uint64_t a = alloc_frame(), b = alloc_frame();
+    *(volatile uint64_t *)a = 0xAAAA;
+    *(volatile uint64_t *)b = 0xBBBB;
+
+    // The other harts are up, and may be walking the table too
+    spin_lock(&vm_lock);
+    map_pages(kernel_root, va, a, PAGE_SIZE, PTE_R | PTE_W);
+    spin_unlock(&vm_lock);
+    uint64_t first = *(volatile uint64_t *)va;
+    *(volatile uint64_t *)va = 0xA0A0; // visible through the alias at a
+    spin_lock(&vm_lock);
+    unmap_pages(kernel_root, va, PAGE_SIZE, 0);
+    map_pages(kernel_root, va, b, PAGE_SIZE, PTE_R | PTE_W);
+    spin_unlock(&vm_lock);
+    uint64_t second = *(volatile uint64_t *)va;
+    spin_lock(&vm_lock);
+    unmap_pages(kernel_root, va, PAGE_SIZE, 0);
+    spin_unlock(&vm_lock);
+
+    int ok = first == 0xAAAA && *(volatile uint64_t *)a == 0xA0A0 &&
+             second == 0xBBBB;
+    kprintf("  VA 0x%lx -> PA 0x%lx read 0x%lx, then -> PA 0x%lx read "
+            "0x%lx %s\r\n\r\n",
+            va, a, first, b, second, ok ? "[OK]" : "[FAIL]");
+    free_frame(a);
+    free_frame(b);
+}
+
+// Reserve 64 MB, touch three pages of it: only those get frames, plus the
+// table pages that lead to them
+static void test_demand_paging(void) {
+    kprintf("Test 5: Demand paging (should succeed)\r\n");
+
+    uint64_t va = 0x200000000UL, size = 64 * 1024 * 1024;
+    reserve("heap", va, size, PTE_R | PTE_W);
+    uint64_t before = frames_free, faults = demand_faults;
+
+    volatile uint64_t *heap = (volatile uint64_t *)va;
+    heap[0] = 1;                                 // store fault
+    uint64_t zero = heap[PAGE_SIZE / 8 * 5];     // load fault: reads 0
+    heap[size / 8 - 1] = 2;                      // last page
+    heap[1] = 3;                                 // already mapped
+    uint64_t used = before - frames_free;
+
+    int ok = heap[0] == 1 && heap[1] == 3 && zero == 0 &&
+             heap[size / 8 - 1] == 2 && demand_faults - faults == 3;
+    kprintf("  Reserved %lu KB at 0x%lx: %lu faults, %lu frames used "
+            "%s\r\n\r\n",
+            size / 1024, va, demand_faults - faults, used,
+            ok ? "[OK]" : "[FAIL]");
+}
+
+// Every hart fills its own 2 MB window of a shared reservation, one page
+// fault per page, all at once: the faults allocate frames and add page
+// table entries (and the tables above them) concurrently
+#define PAR_BASE   0x300000000UL
+#define PAR_WINDOW (2UL * 1024 * 1024)
+
+extern volatile uint32_t harts_booted; // counted in start.S
+
+static volatile int harts_started; // harts that made it to main()
+static volatile int par_go;        // hart 0 starts the test
+static volatile int par_done;      // harts through their window
+
+static void par_touch(int hart) {
+    volatile uint64_t *w = (volatile uint64_t *)(PAR_BASE + hart * PAR_WINDOW);
+    for (uint64_t p = 0; p < PAR_WINDOW / PAGE_SIZE; p++)
+        w[p * PAGE_SIZE / 8] = (uint64_t)hart << 32 | p;
+    __atomic_fetch_add(&par_done, 1, __ATOMIC_RELEASE);
+}
+
+static void test_parallel_faults(void) {
+    kprintf("Test 6: Page faults on all harts at once (should succeed)\r\n");
+
+    int nharts = harts_booted;
+    while (__atomic_load_n(&harts_started, __ATOMIC_ACQUIRE) < nharts)
+        ;
+    reserve("par", PAR_BASE, NCPU * PAR_WINDOW, PTE_R | PTE_W);
+    uint64_t faults = demand_faults;
+
+    tstamp("parallel faults start");
+    __atomic_store_n(&par_go, 1, __ATOMIC_RELEASE);
+    par_touch(0);
+    while (__atomic_load_n(&par_done, __ATOMIC_ACQUIRE) < nharts)
+        ;
+    tstamp("parallel faults done");
+
+    int ok = 1;
+    for (int hart = 0; hart < nharts; hart++) {
+        volatile uint64_t *w =
+            (volatile uint64_t *)(PAR_BASE + hart * PAR_WINDOW);
+        for (uint64_t p = 0; p < PAR_WINDOW / PAGE_SIZE; p++)
+            if (w[p * PAGE_SIZE / 8] != ((uint64_t)hart << 32 | p))
+                ok = 0;
+    }
+    faults = demand_faults - faults;
+    ok = ok && faults == nharts * (PAR_WINDOW / PAGE_SIZE);
+    kprintf("  %d harts x %lu KB: %lu faults %s\r\n\r\n", nharts,
+            PAR_WINDOW / 1024, faults, ok ? "[OK]" : "[FAIL]");
 }
 
 // Test reading from unmapped memory (will cause page fault)
 static void test_unmapped_read(void) {
-    uart_puts("Test 4: Reading from UNMAPPED memory (will cause PAGE FAULT)\r\n");
-    uart_puts("  Attempting to read from 0x40000000 (not mapped)...\r\n");
+    kprintf("Test 7: Reading from UNMAPPED memory (will cause PAGE FAULT)\r\n");
+    kprintf("  Attempting to read from 0x40000000 (not mapped)...\r\n");
 
     volatile uint32_t *ptr = (volatile uint32_t *)0x40000000UL;
     uint32_t val = *ptr;  // This will fault!
 
     // Should never reach here
-    uart_puts("  Value: ");
-    uart_put_hex_short(val);
-    uart_puts("\r\n");
+    kprintf("  Value: 0x%x\r\n", val);
 }
 
 // ============================================================================
@@ -390,55 +1061,63 @@ uint64_t test_variable;
 // ============================================================================
 
 void main(void) {
-    uart_puts("\r\n");
-    uart_puts("================================================\r\n");
-    uart_puts("  Running in Supervisor Mode with Paging!\r\n");
-    uart_puts("================================================\r\n\r\n");
+    __atomic_fetch_add(&harts_started, 1, __ATOMIC_RELEASE);
+
+    // The other harts only take part in the parallel test
+    if (cpuid() != 0) {
+        while (!__atomic_load_n(&par_go, __ATOMIC_ACQUIRE))
+            ;
+        par_touch(cpuid());
+        while (1)
+            asm volatile ("wfi");
+    }
+
+    tstamp_at("satp switched", boot_stamps[4], boot_stamps[5]);
+    tstamp("main");
+
+    kprintf("\r\n");
+    kprintf("================================================\r\n");
+    kprintf("  Running in Supervisor Mode with Paging!\r\n");
+    kprintf("================================================\r\n\r\n");
 
     // Display current satp value
     uint64_t satp = read_csr(satp);
-    uart_puts("satp register: ");
-    uart_put_hex(satp);
-    uart_puts("\r\n");
+    kprintf("satp register: 0x%016lx\r\n", satp);
 
     uint64_t mode = (satp >> 60) & 0xF;
     uint64_t asid = (satp >> 44) & 0xFFFF;
     uint64_t ppn = satp & 0xFFFFFFFFFFFUL;
 
-    uart_puts("  MODE: ");
-    uart_put_dec(mode);
-    uart_puts(" (");
-    if (mode == 0) uart_puts("Bare - no translation");
-    else if (mode == 8) uart_puts("Sv39 - 39-bit virtual");
-    else if (mode == 9) uart_puts("Sv48 - 48-bit virtual");
-    else uart_puts("Unknown");
-    uart_puts(")\r\n");
-
-    uart_puts("  ASID: ");
-    uart_put_dec(asid);
-    uart_puts("\r\n");
-
-    uart_puts("  PPN:  ");
-    uart_put_hex_short(ppn);
-    uart_puts(" (root table at PA ");
-    uart_put_hex_short(ppn << 12);
-    uart_puts(")\r\n\r\n");
+    const char *mode_name = "Unknown";
+    if (mode == 0) mode_name = "Bare - no translation";
+    else if (mode == 8) mode_name = "Sv39 - 39-bit virtual";
+    else if (mode == 9) mode_name = "Sv48 - 48-bit virtual";
+    kprintf("  MODE: %lu (%s)\r\n", mode, mode_name);
+
+    kprintf("  ASID: %lu\r\n", asid);
+
+    kprintf("  PPN:  0x%lx (root table at PA 0x%lx)\r\n\r\n", ppn, ppn << 12);
 
     // Run tests
-    uart_puts("--- Running Memory Access Tests ---\r\n\r\n");
+    kprintf("--- Running Memory Access Tests ---\r\n\r\n");
 
     test_mapped_read();
     test_mapped_write();
     test_uart_access();
+    test_remap();
+    test_demand_paging();
+    test_parallel_faults();
 
-    uart_puts("All mapped memory tests passed!\r\n\r\n");
+    kprintf("All mapped memory tests passed!\r\n\r\n");
+    tstamp("tests done");
+    tstamp_report();
 
-    uart_puts("--- Testing Page Fault ---\r\n\r\n");
-    uart_puts("About to trigger a page fault by reading unmapped memory.\r\n");
-    uart_puts("The trap handler will catch this and display the fault info.\r\n\r\n");
+    kprintf("--- Testing Page Fault ---\r\n\r\n");
+    kprintf("About to trigger a page fault by reading unmapped memory.\r\n");
+    kprintf("The trap handler will catch this and display the fault info.\r\n\r\n");
 
     test_unmapped_read();
 
     // Should never reach here
-    uart_puts("ERROR: Unexpectedly continued after page fault!\r\n");
+    kprintf("ERROR: Unexpectedly continued after page fault!\r\n");
 }
@@ -0,0 +1,695 @@
+/*
+ * main.c - RISC-V VirtIO Block Device Example
+ *
+ * Demonstrates:
+ *   - A virtio-mmio block driver (virtio 1.x register layout, version 2)
+ *   - PLIC (Platform-Level Interrupt Controller) external interrupts
+ *   - Batching: several requests, one doorbell write, one interrupt
+ *   - Interrupt-driven UART output from a ring buffer
+ *
+ * Sector 0 of the disk holds a boot counter and sector 1 a message left by
+ * the previous boot, so running twice shows the writes reached the disk
+ * image. Runs on QEMU virt and on ../../riscv/tinyRiscVTrapEmulator (see the
+ * Makefile).
+ */
+
+#include <stdarg.h>
+#include <stdint.h>
+
+// ============================================================================
+// CSR (Control and Status Register) Access
+// ============================================================================
+
+#define read_csr(csr)                                                          \
+  ({                                                                           \
+    uint64_t __v;                                                              \
+    asm volatile("csrr %0, " #csr : "=r"(__v));                                \
+    __v;                                                                       \
+  })
+
+#define set_csr(csr, val) ({ asm volatile("csrs " #csr ", %0" ::"r"(val)); })
+#define clear_csr(csr, val) ({ asm volatile("csrc " #csr ", %0" ::"r"(val)); })
+
+#define MSTATUS_MIE (1 << 3)         // Machine Interrupt Enable
+#define MIE_MEIE (1 << 11)           // Machine External Interrupt Enable
+#define MCAUSE_INTERRUPT (1UL << 63) // High bit = interrupt (not exception)
+#define MCAUSE_MEI 11                // Machine External Interrupt
+
+// Turn interrupts off, returning whether they were on
+static inline uint64_t intr_off(void) {
+  uint64_t mstatus;
+  asm volatile("csrrc %0, mstatus, %1" : "=r"(mstatus) : "r"(MSTATUS_MIE));
+  return mstatus & MSTATUS_MIE;
+}
+
+static inline void intr_restore(uint64_t on) {
+  if (on)
+    set_csr(mstatus, MSTATUS_MIE);
+}
+
+static inline int cpuid(void) { return read_csr(mhartid); }
+
+// ============================================================================
+// PLIC (Platform-Level Interrupt Controller)
+// ============================================================================
+//
+// QEMU virt machine PLIC memory map (hart 0):
+//   0x0c000000 + 4 * irq : priority of interrupt source irq (0 = off)
+//   0x0c002000           : enable bits, context 0 (hart 0 M-mode)
+//   0x0c200000           : priority threshold, context 0
+//   0x0c200004           : claim (read) / complete (write), context 0
+//
+// A device raises its source; the PLIC sets mip.MEIP. The handler claims the
+// source (which tells it WHO interrupted), services the device, then
+// completes it so the source can interrupt again.
+//
+
+#define PLIC_BASE 0x0c000000UL
+#define PLIC_PRIORITY(irq) (PLIC_BASE + 4 * (irq))
+#define PLIC_MENABLE (PLIC_BASE + 0x2000)
+#define PLIC_MTHRESHOLD (PLIC_BASE + 0x200000)
+#define PLIC_MCLAIM (PLIC_BASE + 0x200004)
+
+#define PLIC_REG(addr) (*(volatile uint32_t *)(addr))
+
+// ============================================================================
+// UART (for output)
+// ============================================================================
+//
+// Output is queued in a ring buffer and sent by the UART's "transmit
+// holding register empty" (THRE) interrupt, through the PLIC like the disk,
+// so a message costs a few stores instead of ~87us per character at
+// 115200 baud. A writer waits only when the ring is full.
+//
+//   uart_putn ──► tx ring ──► uart_start() ──► 16-byte TX FIFO ──► wire
+//                                 ▲
+//                  THRE interrupt ┘ (FIFO drained: refill it)
+//
+// uart_panic() switches to synchronous output for the last words of a
+// dying kernel, when interrupts may never come back.
+//
+
+#define UART0_BASE 0x10000000UL
+#define UART0_IRQ 10 // PLIC source on QEMU virt
+#define UART_THR 0
+#define UART_IER 1
+#define UART_FCR 2
+#define UART_ISR 2
+#define UART_LSR 5
+#define UART_IER_TX_ENABLE (1 << 1)
+#define UART_FCR_FIFO_ENABLE (1 << 0)
+#define UART_FCR_FIFO_CLEAR (3 << 1)
+#define UART_LSR_TX_EMPTY (1 << 5) // THR and TX FIFO empty
+#define UART_FIFO_SIZE 16
+
+#define UART_REG(r) (*(volatile uint8_t *)(UART0_BASE + (r)))
+
+#define UART_TX_BUF_SIZE 1024 // power of two
+
+static struct {
+  char buf[UART_TX_BUF_SIZE];
+  uint64_t w; // next slot uart_putn fills
+  uint64_t r; // next byte to hand to the UART
+  int panicked;
+} uart_tx;
+
+static void uart_init(void) {
+  UART_REG(UART_FCR) = UART_FCR_FIFO_ENABLE | UART_FCR_FIFO_CLEAR;
+  UART_REG(UART_IER) = UART_IER_TX_ENABLE;
+
+  PLIC_REG(PLIC_PRIORITY(UART0_IRQ)) = 1;
+  PLIC_REG(PLIC_MENABLE) |= 1 << UART0_IRQ;
+  PLIC_REG(PLIC_MTHRESHOLD) = 0;
+  set_csr(mie, MIE_MEIE);
+}
+
+// Move queued bytes into the UART. THRE means the whole FIFO is empty, so
+// a burst of UART_FIFO_SIZE goes in per LSR read. Call with interrupts off.
+static void uart_start(void) {
+  while (uart_tx.r != uart_tx.w &&
+         (UART_REG(UART_LSR) & UART_LSR_TX_EMPTY)) {
+    for (int n = 0; n < UART_FIFO_SIZE && uart_tx.r != uart_tx.w; n++)
+      UART_REG(UART_THR) = uart_tx.buf[uart_tx.r++ % UART_TX_BUF_SIZE];
+  }
+}
+
+// Called from trap_handler when the PLIC says the UART interrupted
+static void uart_intr(void) {
+  (void)UART_REG(UART_ISR); // reading it acknowledges THRE
+  uart_start();
+}
+
+// Send everything queued, polling. Interrupts must be off.
+static void uart_drain(void) {
+  while (uart_tx.r != uart_tx.w) {
+    while ((UART_REG(UART_LSR) & UART_LSR_TX_EMPTY) == 0)
+      ;
+    uart_start();
+  }
+}
+
+// Queue n bytes: one interrupts-off section and at most one transmitter
+// kick for the whole message
+static void uart_putn(const char *s, int n) {
+  if (uart_tx.panicked) {
+    for (int i = 0; i < n; i++) {
+      while ((UART_REG(UART_LSR) & UART_LSR_TX_EMPTY) == 0)
+        ;
+      UART_REG(UART_THR) = s[i];
+    }
+    return;
+  }
+
+  uint64_t on = intr_off();
+  int idle = uart_tx.r == uart_tx.w;
+  for (int i = 0; i < n; i++) {
+    // Full: drain by polling rather than waiting for the interrupt, which
+    // cannot arrive if we are the trap handler
+    if (uart_tx.w - uart_tx.r == UART_TX_BUF_SIZE)
+      uart_drain();
+    uart_tx.buf[uart_tx.w++ % UART_TX_BUF_SIZE] = s[i];
+  }
+  // A non-empty ring means a THRE interrupt is on its way to send this
+  if (idle)
+    uart_start();
+  intr_restore(on);
+}
+
+// Panic path: interrupts off for good, flush what is queued (so output
+// stays in order), then write synchronously from here on
+static void uart_panic(void) {
+  intr_off();
+  uart_drain();
+  uart_tx.panicked = 1;
+}
+
+// ============================================================================
+// kprintf
+// ============================================================================
+//
+// kprintf formats into this hart's buffer, then hands the whole message to
+// the UART with one uart_putn() call: one unit to the driver, so lines from
+// different harts (or from a trap handler) cannot interleave inside it.
+//
+// Formats: %d %u %x %c %s %p %%, 'l' for 64-bit arguments, and a width
+// with optional zero padding ("%5d", "%08x", "%016lx"). %p is 0x and 16
+// hex digits.
+//
+
+#define NCPU 8
+#define KPRINTF_BUF 256 // longer messages go out in pieces
+
+static struct kbuf {
+  char buf[KPRINTF_BUF];
+  int len;
+} kprintf_buf[NCPU];
+
+static void kbuf_putc(struct kbuf *b, char c) {
+  if (b->len == KPRINTF_BUF) {
+    uart_putn(b->buf, b->len);
+    b->len = 0;
+  }
+  b->buf[b->len++] = c;
+}
+
+static void kbuf_putnum(struct kbuf *b, uint64_t n, int base, int width,
+                        char pad) {
+  char digits[20];
+  int i = 0;
+  do {
+    digits[i++] = "0123456789abcdef"[n % base];
+    n /= base;
+  } while (n);
+  while (width-- > i)
+    kbuf_putc(b, pad);
+  while (i > 0)
+    kbuf_putc(b, digits[--i]);
+}
+
+static void kprintf(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+static void kprintf(const char *fmt, ...) {
+  uint64_t on = intr_off(); // the trap handler prints too
+  struct kbuf *b = &kprintf_buf[cpuid()];
+  b->len = 0;
+
+  va_list ap;
+  va_start(ap, fmt);
+  for (const char *p = fmt; *p; p++) {
+    if (*p != '%') {
+      kbuf_putc(b, *p);
+      continue;
+    }
+    char pad = ' ';
+    int width = 0, is_long = 0;
+    if (*++p == '0') {
+      pad = '0';
+      p++;
+    }
+    while (*p >= '0' && *p <= '9')
+      width = width * 10 + *p++ - '0';
+    if (*p == 'l') {
+      is_long = 1;
+      p++;
+    }
+    if (*p == '\0')
+      break;
+
+    switch (*p) {
+    case 'd': {
+      int64_t v = is_long ? va_arg(ap, int64_t) : va_arg(ap, int);
+      uint64_t u = v;
+      if (v < 0) {
+        kbuf_putc(b, '-');
+        u = -u;
+        width--;
+      }
+      kbuf_putnum(b, u, 10, width, pad);
+      break;
+    }
+    case 'u':
+    case 'x': {
+      uint64_t u = is_long ? va_arg(ap, uint64_t) : va_arg(ap, unsigned);
+      kbuf_putnum(b, u, *p == 'u' ? 10 : 16, width, pad);
+      break;
+    }
+    case 'p':
+      kbuf_putc(b, '0');
+      kbuf_putc(b, 'x');
+      kbuf_putnum(b, (uint64_t)va_arg(ap, void *), 16, 16, '0');
+      break;
+    case 'c':
+      kbuf_putc(b, (char)va_arg(ap, int));
+      break;
+    case 's': {
+      const char *s = va_arg(ap, const char *);
+      if (!s)
+        s = "(null)";
+      while (*s)
+        kbuf_putc(b, *s++);
+      break;
+    }
+    default: // "%%", and anything unknown is printed as is
+      if (*p != '%')
+        kbuf_putc(b, '%');
+      kbuf_putc(b, *p);
+      break;
+    }
+  }
+  va_end(ap);
+
+  uart_putn(b->buf, b->len);
+  intr_restore(on);
+}
+
+// ============================================================================
+// VirtIO MMIO registers (virtio spec 4.2.2)
+// ============================================================================
+
+#define VIRTIO0_BASE 0x10001000UL
+#define VIRTIO0_IRQ 1
+
+#define VIRTIO_MMIO_MAGIC_VALUE 0x000 // 0x74726976 ("virt")
+#define VIRTIO_MMIO_VERSION 0x004     // 2 (1 is the legacy layout)
+#define VIRTIO_MMIO_DEVICE_ID 0x008   // 2 = block device, 0 = empty slot
+#define VIRTIO_MMIO_DEVICE_FEATURES 0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL 0x014
+#define VIRTIO_MMIO_DRIVER_FEATURES 0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL 0x024
+#define VIRTIO_MMIO_QUEUE_SEL 0x030
+#define VIRTIO_MMIO_QUEUE_NUM_MAX 0x034
+#define VIRTIO_MMIO_QUEUE_NUM 0x038
+#define VIRTIO_MMIO_QUEUE_READY 0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY 0x050 // the doorbell
+#define VIRTIO_MMIO_INTERRUPT_STATUS 0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK 0x064
+#define VIRTIO_MMIO_STATUS 0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW 0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH 0x084
+#define VIRTIO_MMIO_DRIVER_DESC_LOW 0x090 // available ring
+#define VIRTIO_MMIO_DRIVER_DESC_HIGH 0x094
+#define VIRTIO_MMIO_DEVICE_DESC_LOW 0x0a0 // used ring
+#define VIRTIO_MMIO_DEVICE_DESC_HIGH 0x0a4
+#define VIRTIO_MMIO_CONFIG 0x100 // block config: u64 capacity in sectors
+
+#define R(r) ((volatile uint32_t *)(VIRTIO0_BASE + (r)))
+
+// Status register bits
+#define VIRTIO_CONFIG_S_ACKNOWLEDGE 1
+#define VIRTIO_CONFIG_S_DRIVER 2
+#define VIRTIO_CONFIG_S_DRIVER_OK 4
+#define VIRTIO_CONFIG_S_FEATURES_OK 8
+
+// Feature bits
+#define VIRTIO_BLK_F_RO 5
+#define VIRTIO_BLK_F_FLUSH 9
+#define VIRTIO_F_VERSION_1 32 // bit 0 of the second feature word
+
+// ============================================================================
+// Virtqueue (split ring)
+// ============================================================================
+//
+// The driver and the device share three arrays in RAM:
+//   desc  - buffer descriptors, chained with `next`
+//   avail - driver -> device: heads of chains that are ready
+//   used  - device -> driver: heads of chains that are done
+//
+// A block request is a chain of three descriptors: a header (what to do
+// and which sector), the 512-byte data buffer, and a status byte the
+// device fills in.
+//
+
+#define NUM 16              // descriptors in the queue
+#define MAX_BATCH (NUM / 3) // three descriptors per request
+#define SECTOR_SIZE 512
+
+struct virtq_desc {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+};
+#define VRING_DESC_F_NEXT 1  // chained with another descriptor
+#define VRING_DESC_F_WRITE 2 // device writes (vs reads)
+
+struct virtq_avail {
+  uint16_t flags;
+  uint16_t idx; // where the driver puts the next entry
+  uint16_t ring[NUM];
+  uint16_t unused;
+};
+
+struct virtq_used_elem {
+  uint32_t id; // head of the completed chain
+  uint32_t len;
+};
+
+struct virtq_used {
+  uint16_t flags;
+  uint16_t idx; // where the device puts the next entry
+  struct virtq_used_elem ring[NUM];
+};
+
+#define VIRTIO_BLK_T_IN 0    // read the disk
+#define VIRTIO_BLK_T_OUT 1   // write the disk
+#define VIRTIO_BLK_T_FLUSH 4 // make earlier writes durable
+
+struct virtio_blk_req {
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t sector;
+};
+
+// A request as main() sees it
+struct request {
+  uint32_t type;
+  uint64_t sector;
+  uint8_t *data; // SECTOR_SIZE bytes, 0 for a flush
+};
+
+static struct {
+  struct virtq_desc desc[NUM] __attribute__((aligned(16)));
+  struct virtq_avail avail __attribute__((aligned(2)));
+  struct virtq_used used __attribute__((aligned(4)));
+
+  // Request slot k uses descriptors 3k, 3k+1, 3k+2
+  struct virtio_blk_req hdr[MAX_BATCH];
+  volatile uint8_t status[MAX_BATCH];
+
+  uint16_t used_idx; // how far the driver has read the used ring
+  uint64_t capacity;
+  int read_only;
+  int can_flush;
+} disk;
+
+// Updated by the interrupt handler
+volatile int completed;  // requests finished in the current batch
+volatile int errors;     // ... with a status other than 0 (OK)
+volatile int interrupts; // disk interrupts taken
+
+// ============================================================================
+// Driver
+// ============================================================================
+
+static int virtio_disk_init(void) {
+  if (*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
+      *R(VIRTIO_MMIO_VERSION) != 2 || *R(VIRTIO_MMIO_DEVICE_ID) != 2) {
+    kprintf("No virtio disk (version 2) at 0x%016lx\r\n", VIRTIO0_BASE);
+    return -1;
+  }
+
+  // Reset, then tell the device we found it and can drive it
+  uint32_t status = 0;
+  *R(VIRTIO_MMIO_STATUS) = status;
+  status |= VIRTIO_CONFIG_S_ACKNOWLEDGE;
+  *R(VIRTIO_MMIO_STATUS) = status;
+  status |= VIRTIO_CONFIG_S_DRIVER;
+  *R(VIRTIO_MMIO_STATUS) = status;
+
+  // Negotiate features: accept read-only and flush if offered
+  *R(VIRTIO_MMIO_DEVICE_FEATURES_SEL) = 0;
+  uint32_t features = *R(VIRTIO_MMIO_DEVICE_FEATURES);
+  features &= (1 << VIRTIO_BLK_F_RO) | (1 << VIRTIO_BLK_F_FLUSH);
+  disk.read_only = (features >> VIRTIO_BLK_F_RO) & 1;
+  disk.can_flush = (features >> VIRTIO_BLK_F_FLUSH) & 1;
+  *R(VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 0;
+  *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  *R(VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 1;
+  *R(VIRTIO_MMIO_DRIVER_FEATURES) = 1 << (VIRTIO_F_VERSION_1 - 32);
+
+  status |= VIRTIO_CONFIG_S_FEATURES_OK;
+  *R(VIRTIO_MMIO_STATUS) = status;
+  if (!(*R(VIRTIO_MMIO_STATUS) & VIRTIO_CONFIG_S_FEATURES_OK)) {
+    kprintf("virtio disk rejected our features\r\n");
+    return -1;
+  }
+
+  // Queue 0
+  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
+  if (*R(VIRTIO_MMIO_QUEUE_READY) || *R(VIRTIO_MMIO_QUEUE_NUM_MAX) < NUM) {
+    kprintf("virtio disk queue 0 unusable\r\n");
+    return -1;
+  }
+  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64_t)disk.desc;
+  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64_t)disk.desc >> 32;
+  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64_t)&disk.avail;
+  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64_t)&disk.avail >> 32;
+  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64_t)&disk.used;
+  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64_t)&disk.used >> 32;
+  *R(VIRTIO_MMIO_QUEUE_READY) = 1;
+
+  status |= VIRTIO_CONFIG_S_DRIVER_OK;
+  *R(VIRTIO_MMIO_STATUS) = status;
+
+  disk.capacity = *R(VIRTIO_MMIO_CONFIG) |
+                  (uint64_t)*R(VIRTIO_MMIO_CONFIG + 4) << 32;
+
+  // Route the disk's interrupt to this hart's M-mode
+  PLIC_REG(PLIC_PRIORITY(VIRTIO0_IRQ)) = 1;
+  PLIC_REG(PLIC_MENABLE) |= 1 << VIRTIO0_IRQ;
+  PLIC_REG(PLIC_MTHRESHOLD) = 0;
+  set_csr(mie, MIE_MEIE);
+  return 0;
+}
+
+// Called from trap_handler when the PLIC says the disk interrupted
+static void virtio_disk_intr(void) {
+  interrupts++;
+
+  // Acknowledge first: a completion after this raises a new interrupt
+  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+  __sync_synchronize();
+
+  // One interrupt may report many completions
+  while (disk.used_idx != *(volatile uint16_t *)&disk.used.idx) {
+    __sync_synchronize();
+    int slot = disk.used.ring[disk.used_idx % NUM].id / 3;
+    if (disk.status[slot] != 0)
+      errors++;
+    completed++;
+    disk.used_idx++;
+  }
+}
+
+/*
+ * Submit up to MAX_BATCH requests with a single doorbell write, then sleep
+ * until all of them are done. Returns the number that failed.
+ */
+static int virtio_disk_rw(struct request *reqs, int n) {
+  for (int k = 0; k < n; k++) {
+    struct virtq_desc *d = &disk.desc[3 * k];
+    disk.hdr[k] = (struct virtio_blk_req){reqs[k].type, 0, reqs[k].sector};
+    disk.status[k] = 0xff; // the device writes 0 on success
+
+    d[0] = (struct virtq_desc){(uint64_t)&disk.hdr[k],
+                               sizeof(struct virtio_blk_req),
+                               VRING_DESC_F_NEXT, 3 * k + 1};
+    if (reqs[k].data) {
+      uint16_t flags = VRING_DESC_F_NEXT;
+      if (reqs[k].type == VIRTIO_BLK_T_IN)
+        flags |= VRING_DESC_F_WRITE;
+      d[1] = (struct virtq_desc){(uint64_t)reqs[k].data, SECTOR_SIZE, flags,
+                                 3 * k + 2};
+    } else {
+      d[0].next = 3 * k + 2; // flush: no data
+    }
+    d[2] = (struct virtq_desc){(uint64_t)&disk.status[k], 1,
+                               VRING_DESC_F_WRITE, 0};
+
+    disk.avail.ring[(disk.avail.idx + k) % NUM] = 3 * k;
+  }
+
+  // Publish the whole batch, then ring the doorbell once. Interrupts stay
+  // off until we wait, so the completion cannot slip in between the check
+  // and the wfi below.
+  uint64_t on = intr_off();
+  completed = 0;
+  errors = 0;
+  __sync_synchronize();
+  disk.avail.idx += n;
+  __sync_synchronize();
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;
+
+  while (completed < n) {
+    // wfi wakes on a pending interrupt even with MIE clear; opening
+    // MIE for a moment lets the trap handler run
+    asm volatile("wfi");
+    set_csr(mstatus, MSTATUS_MIE);
+    clear_csr(mstatus, MSTATUS_MIE);
+  }
+  intr_restore(on); // back on for the UART
+  return errors;
+}
+
+// ============================================================================
+// Trap Handler (called from assembly)
+// ============================================================================
+
+void trap_handler(void) {
+  uint64_t mcause = read_csr(mcause);
+
+  if ((mcause & MCAUSE_INTERRUPT) && (mcause & 0xFF) == MCAUSE_MEI) {
+    uint32_t irq = PLIC_REG(PLIC_MCLAIM); // who interrupted?
+    if (irq == VIRTIO0_IRQ)
+      virtio_disk_intr();
+    else if (irq == UART0_IRQ)
+      uart_intr();
+    if (irq)
+      PLIC_REG(PLIC_MCLAIM) = irq; // complete: it may interrupt again
+    return;
+  }
+
+  uart_panic();
+  kprintf("\r\n[TRAP] mcause=0x%016lx mepc=0x%016lx\r\nHALTING.\r\n", mcause,
+          read_csr(mepc));
+  while (1)
+    asm volatile("wfi");
+}
+
+// ============================================================================
+// Main
+// ============================================================================
+
+#define SYSCON 0x100000UL // QEMU virt test device: write 0x5555 to power off
+
+#define BOOT_MAGIC 0x4f4d45444b4c4256UL // "VBLKDEMO"
+
+struct boot_record {
+  uint64_t magic;
+  uint64_t boots;
+};
+
+static uint8_t buf[MAX_BATCH][SECTOR_SIZE] __attribute__((aligned(16)));
+
+static void report(const char *what, int n, int interrupts_before) {
+  kprintf("%s%d request(s), 1 doorbell, %d interrupt(s)\r\n", what, n,
+          interrupts - interrupts_before);
+}
+
+static void power_off(void) {
+  intr_off();
+  uart_drain(); // the power goes before a queued message would
+  *(volatile uint32_t *)SYSCON = 0x5555;
+  while (1)
+    asm volatile("wfi");
+}
+
+void main(void) {
+  uart_init();
+  set_csr(mstatus, MSTATUS_MIE);
+  kprintf("\r\n");
+  kprintf("================================================\r\n");
+  kprintf("  RISC-V VirtIO Block Demo\r\n");
+  kprintf("================================================\r\n\r\n");
+
+  if (virtio_disk_init() < 0)
+    power_off();
+  kprintf("Disk:       %lu sectors%s\r\n", disk.capacity,
+          disk.read_only ? " (read-only)" : "");
+  if (disk.capacity < MAX_BATCH) {
+    kprintf("Disk too small for the demo\r\n");
+    power_off();
+  }
+
+  // ---- Batch 1: read the first sectors with one doorbell ----
+  struct request reads[MAX_BATCH];
+  for (int k = 0; k < MAX_BATCH; k++)
+    reads[k] = (struct request){VIRTIO_BLK_T_IN, k, buf[k]};
+  int before = interrupts;
+  if (virtio_disk_rw(reads, MAX_BATCH))
+    kprintf("read failed\r\n");
+  report("Read:       ", MAX_BATCH, before);
+
+  struct boot_record *rec = (struct boot_record *)buf[0];
+  if (rec->magic != BOOT_MAGIC) {
+    kprintf("Fresh disk, formatting the boot record\r\n");
+    rec->magic = BOOT_MAGIC;
+    rec->boots = 0;
+  } else {
+    kprintf("Last boot:  \"%s\"\r\n", (const char *)buf[1]);
+  }
+  rec->boots++;
+  kprintf("Boot count: %lu\r\n", rec->boots);
+
+  if (disk.read_only) {
+    kprintf("\r\nDisk is read-only, nothing written.\r\n");
+    power_off();
+  }
+
+  // ---- Batch 2: write the counter and a message together ----
+  const char *msg = "written by boot #";
+  int i = 0;
+  while (msg[i]) {
+    buf[1][i] = msg[i];
+    i++;
+  }
+  char digits[20];
+  int nd = 0;
+  for (uint64_t b = rec->boots; b; b /= 10)
+    digits[nd++] = '0' + b % 10;
+  while (nd)
+    buf[1][i++] = digits[--nd];
+  buf[1][i] = 0;
+
+  struct request writes[2];
+  writes[0] = (struct request){VIRTIO_BLK_T_OUT, 0, buf[0]};
+  writes[1] = (struct request){VIRTIO_BLK_T_OUT, 1, buf[1]};
+  before = interrupts;
+  if (virtio_disk_rw(writes, 2))
+    kprintf("write failed\r\n");
+  report("Wrote:      ", 2, before);
+
+  // ---- Batch 3: flush, once the writes are done ----
+  if (disk.can_flush) {
+    struct request flush = {VIRTIO_BLK_T_FLUSH, 0, 0};
+    before = interrupts;
+    if (virtio_disk_rw(&flush, 1))
+      kprintf("flush failed\r\n");
+    report("Flushed:    ", 1, before);
+  }
+
+  kprintf("\r\nRun again to see the counter go up.\r\n");
+  power_off();
+}